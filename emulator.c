@@ -4,18 +4,361 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <setjmp.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zlib.h>
 #include <readline/readline.h>
 #include <readline/history.h>
+#if defined(__SSE2__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "gameboy.h"
 
 #define NDEBUG
 
 #define u8 uint8_t
 #define i8 int8_t
 #define u16 uint16_t
+#define u32 uint32_t
+#define u64 uint64_t
 
 void breakpoint() { }
 
 
+// Timed side effects (end of OAM DMA, ...) are kept in a fixed table indexed
+// by kind. next_event caches the earliest deadline so the main loop only pays
+// a single compare per instruction.
+typedef enum Event {
+    EVENT_DMA_END,
+    EVENT_LINE,
+    EVENT_RENDER,
+    EVENT_PROFILE,
+    EVENT_TIMER,
+    EVENT_HBLANK,
+    EVENT_HDMA,
+    // Ahead of EVENT_SERIAL so that when both ends start a transfer at once,
+    // each answers the other before waiting on its own reply
+    EVENT_SERIAL_REMOTE,
+    EVENT_SERIAL,
+    EVENT_LINK_SYNC,
+    EVENT_COUNT,
+} Event;
+
+const u64 never = UINT64_MAX;
+
+// Host-side counters for watching the emulator itself. Build with
+// -DNO_METRICS to compile every counter out. Each block starts on its own
+// cache line so the render thread bumping its GPU's counters doesn't share
+// a line with the cpu's.
+#ifndef NO_METRICS
+typedef struct CpuMetrics {
+    _Alignas(64) u64 instructions;
+    // Accesses served straight from the page table vs through a handler
+    u64 fast_reads;
+    u64 fast_writes;
+    u64 slow_reads;
+    u64 slow_writes;
+    u64 frames;
+    // Host time between consecutive vblanks
+    u64 frame_start_ns;
+    u64 last_frame_ns;
+    u64 max_frame_ns;
+    u64 total_frame_ns;
+    u64 opcodes[0x100];
+    u64 cb_opcodes[0x100];
+} CpuMetrics;
+
+// Written by whichever thread renders, read by whoever dumps the metrics
+typedef struct VideoMetrics {
+    _Alignas(64) _Atomic u64 lines;
+    _Atomic u64 tile_rows;
+    // Lines copied from the previous frame instead of drawn
+    _Atomic u64 reused_lines;
+} VideoMetrics;
+
+#define count_metric(counter) ((counter)++)
+// Single writer, so a relaxed load and store is enough and stays a plain add
+#define add_video_metric(counter, n) \
+    atomic_store_explicit(&(counter), \
+        atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+#else
+#define count_metric(counter) ((void) 0)
+#define add_video_metric(counter, n) ((void) 0)
+#endif
+
+#define screen_width 160
+#define screen_height 144
+
+// Everything a line's pixels depend on besides ly. A row of the previous
+// frame drawn from the same inputs can be copied instead of drawn again.
+typedef struct LineInputs {
+    // How many vram and oam bytes had changed when the line was drawn
+    u64 video_writes;
+    // lcdc, scy, scx, wy, wx, bgp, obp0, obp1
+    u8 registers[8];
+    u8 window_line;
+} LineInputs;
+
+// A finished frame. Frames come from a small pool owned by the GPU and are
+// handed around by pointer; refs counts the current holders so the renderer
+// never draws into a frame someone is still reading.
+typedef struct Frame {
+    atomic_int refs;
+    u64 number;
+    // Number of the first frame with exactly this picture, so number itself
+    // unless nothing changed since the one before
+    u64 first_number;
+    LineInputs inputs[screen_height];
+    // Palette-applied shades, 0 (white) to 3 (black)
+    u8 shades[screen_height][screen_width];
+    // RGBA, one byte per channel in that order
+    u32 pixels[screen_height][screen_width];
+} Frame;
+
+// A consumer of finished frames (video dump, streamer, ...). Each sink has a
+// one-slot mailbox: the GPU swaps the newest frame in and drops whatever the
+// sink didn't pick up in time, so a slow sink never stalls emulation.
+typedef struct FrameSink {
+    _Atomic(Frame *) mailbox;
+    // Set by take_frame() when the frame shows the same picture as the last
+    // one this sink took, so it needn't be encoded or sent again
+    bool unchanged;
+    bool taken_any;
+    u64 last_taken;
+    // Sinks that wait in poll() set wake_fd, an eventfd bumped for each
+    // frame put in the mailbox
+    bool wakes;
+    int wake_fd;
+} FrameSink;
+
+#define max_sinks 4
+// back buffer, latest, and a mailbox slot plus a frame in use per sink
+#define frame_pool_len (2 + 2 * max_sinks)
+
+typedef struct GPU {
+    // The window keeps its own line counter; it only advances on lines
+    // where the window was actually drawn.
+    u8 window_line;
+    // bgp, obp0 and obp1 resolved through to shades and colours, indexed by
+    // palette * 4 + color
+    u8 shades[12];
+    u32 colors[12];
+    // Cgb mode: palette ram for bg and obj, BCPS and OCPS, and every colour
+    // resolved to a shade and rgba, indexed by palette * 4 + color with the
+    // obj palettes from 8
+    bool cgb;
+    u8 cgb_palettes[2][64];
+    u8 cgb_palette_index[2];
+    u8 cgb_shades[64];
+    u32 cgb_colors[64];
+    // Bumped by every write that changes vram or oam
+    u64 video_writes;
+    // Some line of the back buffer was drawn rather than copied
+    bool picture_changed;
+    Frame *frames;
+    // Frame being drawn
+    Frame *back;
+    // Last finished frame; the GPU holds a reference to it
+    Frame *latest;
+    u64 frame_count;
+    FrameSink *sinks[max_sinks];
+    int sink_count;
+#ifndef NO_METRICS
+    VideoMetrics metrics;
+#endif
+} GPU;
+
+// In threaded render mode the cpu thread doesn't draw; it logs every write
+// that affects the picture and a marker per visible line into this
+// single-producer single-consumer ring, and a render thread replays them.
+typedef enum RenderCommandKind {
+    RENDER_WRITE,
+    // A write to vram bank 1, at its address in the address space
+    RENDER_WRITE_BANK_1,
+    RENDER_LINE,
+    RENDER_FRAME,
+} RenderCommandKind;
+
+typedef struct RenderCommand {
+    u8 kind;
+    u8 val;
+    u16 address;
+} RenderCommand;
+
+#define render_queue_len (1 << 16)
+
+typedef struct RenderQueue {
+    RenderCommand commands[render_queue_len];
+    // Commands queued by the cpu thread but not yet published through head
+    size_t pending;
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+} RenderQueue;
+
+struct CPU;
+typedef u8 (*ReadHandler)(struct CPU *cpu, u16 address);
+typedef void (*WriteHandler)(struct CPU *cpu, u16 address, u8 val);
+
+// What one 256 byte page of the address space resolves to: direct pointers
+// where plain memory backs it, a handler where it doesn't
+typedef struct PageMapping {
+    u8 *read;
+    u8 *write;
+    // The page of memory write stores to, which differs for echo ram and
+    // the cgb's banks
+    u16 store_page;
+    ReadHandler read_handler;
+    WriteHandler write_handler;
+} PageMapping;
+
+#define max_breakpoints 32
+#define max_watchpoints 32
+
+typedef enum WatchKind {
+    WATCH_READ = 1,
+    WATCH_WRITE = 2,
+} WatchKind;
+
+typedef struct Watchpoint {
+    u16 address;
+    u8 kind;
+} Watchpoint;
+
+typedef struct Debugger {
+    u16 breakpoints[max_breakpoints];
+    int breakpoint_count;
+    Watchpoint watchpoints[max_watchpoints];
+    int watchpoint_count;
+    // Stop before the next instruction whatever it is
+    volatile sig_atomic_t stop_requested;
+    // next: run until the instruction after a call
+    bool stepping_over;
+    u16 step_over_address;
+    // finish: run until the stack pops above the current frame
+    bool finishing;
+    u16 finish_sp;
+    char last_command[64];
+} Debugger;
+
+// Serial link between two machines. Each side only tells the other when
+// a transfer starts, what it shifted back, and how far it has run; the
+// transfer time is the lookahead that lets them run apart without one ever
+// seeing a message from its own past.
+typedef enum LinkMessageKind {
+    LINK_TIME,
+    LINK_START,
+    LINK_REPLY,
+} LinkMessageKind;
+
+typedef struct LinkMessage {
+    u8 kind;
+    u8 val;
+    // For LINK_START, how long the sender's clock takes over the byte
+    u32 length;
+    u64 time;
+} LinkMessage;
+
+#define link_ring_len 256
+
+// One direction of an in-process link, single producer single consumer
+typedef struct LinkRing {
+    LinkMessage messages[link_ring_len];
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+} LinkRing;
+
+typedef struct Link {
+    // In process the two sides share a pair of rings, otherwise fd is one
+    // end of a SOCK_SEQPACKET socketpair
+    LinkRing *rx;
+    LinkRing *tx;
+    int fd;
+    bool closed;
+    // The partner has run at least this far and won't start a transfer
+    // stamped any earlier
+    u64 partner_time;
+    // What the partner shifted back for our transfer
+    bool reply_ready;
+    u8 reply;
+    // Byte of the transfer the partner is clocking into us
+    u8 incoming;
+} Link;
+
+#define max_profile_depth 32
+
+typedef struct CallFrame {
+    u16 routine;
+    // sp right after the return address was pushed
+    u16 sp;
+} CallFrame;
+
+// One distinct call stack seen while sampling, with how often it was seen
+typedef struct StackSample {
+    u64 hash;
+    u32 count;
+    u8 depth;
+    u16 routines[max_profile_depth];
+} StackSample;
+
+// Samples pc every interval cycles. Calls and returns are tracked on a
+// shadow stack so each sample is also attributed to the routines it is
+// nested in.
+typedef struct Profiler {
+    u64 interval;
+    u64 total_samples;
+    u32 pc_samples[0x10000];
+    CallFrame stack[max_profile_depth];
+    int depth;
+    // Open addressing, capacity is a power of two
+    StackSample *stacks;
+    size_t stack_capacity;
+    size_t stack_count;
+} Profiler;
+
+// Memory is held in 8 KiB blocks. The first eight are the regions of the
+// address space: the rom halves, vram, cartridge ram, wram, and the top 8K
+// with oam and io. The rest hold the banks a cgb switches in, vram bank 1
+// and wram banks 2-7. Forked machines share blocks and copy one on its
+// first write.
+//
+// 8 KiB is the grain of the memory map itself. Vram and cartridge ram are
+// a block each, so the renderer and a mapped save file see them as
+// contiguous bytes. Smaller blocks would let a child copy less on its first
+// write to a region, at the cost of splitting those.
+#define block_bits 13
+#define block_size (1 << block_bits)
+#define vram_bank_1 0x10000
+#define wram_banks 0x12000
+#define memory_len 0x18000
+#define block_count (memory_len >> block_bits)
+
+// Cartridge ram, 0xa000-0xbfff, is exactly one block
+#define sram_block (0xa000 >> block_bits)
+
+typedef struct Block {
+    // First, so a block can be laid over a page aligned file mapping
+    u8 bytes[block_size];
+    atomic_int refs;
+    // The bytes are a shared mapping of a save file, not heap memory
+    bool mapped;
+} Block;
+
 typedef struct CPU {
     u8 a;
     u8 f;
@@ -27,17 +370,177 @@ typedef struct CPU {
     u8 l;
     u16 pc;
     u16 sp;
-    u8 memory[0xFFFF];
+    Block *blocks[block_count];
+    // Blocks another machine may still hold; store() copies them first
+    u16 shared_blocks;
     bool boot_rom_enabled;
+    // Interrupt master enable; ei sets it one instruction late
+    bool ime;
+    bool ei_pending;
+    bool halted;
+    // halt with ime off and an interrupt pending doesn't halt, but the next
+    // opcode byte is read twice
+    bool halt_bug;
+    u64 cycles;
+    // When the current scanline started, for the STAT mode
+    u64 line_start;
+    // DIV is the top byte of a counter that started at div_base. TIMA is
+    // brought up to date lazily; timer_synced is when that last happened.
+    u64 div_base;
+    u64 timer_synced;
+    // 1 in cgb double speed, where the cpu clock the timer and serial run
+    // off ticks twice per cycle. It read clock_base at speed_changed, when
+    // the speed last changed.
+    u8 double_speed;
+    u64 clock_base;
+    u64 speed_changed;
+    // Held buttons, 1 = pressed: right, left, up, down in the low nibble,
+    // a, b, select, start in the high one
+    u8 buttons;
+    // Receives bytes sent over the serial port, if set
+    FILE *serial_out;
+    // The machine on the other end of the link cable, NULL when unplugged
+    Link *link;
+    // Every access resolves its page from scratch instead of using the
+    // cached maps. Slow, but it's the reference the fast path is checked
+    // against.
+    bool reference_memory;
+    // Rolling hash of every (address, value) written through set_memory
+    u64 write_hash;
+    // Lines aren't drawn and frames aren't published, but video timing and
+    // interrupts carry on
+    bool skip_render;
+    // init_cpu() starts at 0x100 in the state the boot rom would leave
+    bool fast_boot;
+    // Cartridge ram behind an mbc is only there while enabled; games turn
+    // it off again once they've saved
+    bool ram_enabled;
+    // The mapped .sav file in blocks[sram_block], or NULL. Writes to it go
+    // straight to the file; forks get a copy.
+    Block *save;
+    // Cartridge ram's hash when it was last flushed and last synced
+    u64 save_flushed_hash;
+    u64 save_synced_hash;
+    // Running a cgb cartridge as a cgb. Only fast boot does, there being no
+    // cgb boot rom here.
+    bool cgb;
+    // The banks VBK and SVBK switch in at 0x8000 and 0xd000
+    u8 vram_bank;
+    u8 wram_bank;
+    // An hblank HDMA is copying 16 bytes at each hblank. hdma_blocks is
+    // how many are left, also of one that was stopped.
+    bool hdma_active;
+    u16 hdma_source;
+    u16 hdma_dest;
+    u8 hdma_blocks;
+    // If set, guest faults (illegal opcodes, ...) jump here instead of
+    // exiting, with fault_reason saying what happened
+    jmp_buf *fault_jump;
+    const char *fault_reason;
+    // Fuzzer edge coverage: a 64K map of hit counts, NULL when off
+    u8 *coverage;
+    // Sum of hash_byte() over every byte of memory, per page and in total.
+    // store() keeps them current so a fingerprint never rescans memory.
+    u64 page_hash[memory_len >> 8];
+    u64 memory_hash;
+    u64 event_time[EVENT_COUNT];
+    u64 next_event;
+    bool dma_active;
+    GPU gpu;
+    // Set at the start of vblank, cleared by whoever consumes the frame
+    bool frame_done;
+    // NULL unless rendering happens on a separate thread
+    RenderQueue *render_queue;
+    // NULL entries go through the handler of the same page
+    u8 *read_map[0x100];
+    u8 *write_map[0x100];
+    // The page of memory each write_map entry stores to
+    u16 store_page[0x100];
+    ReadHandler read_handlers[0x100];
+    WriteHandler write_handlers[0x100];
+    // Non-zero for pages holding a breakpoint. The main loop only looks at
+    // the debugger when pc is on a flagged page, so an idle debugger costs
+    // one byte load per instruction.
+    u8 break_pages[0x100];
+    Debugger *debugger;
+    bool trace;
+    Profiler *profiler;
+#ifndef NO_METRICS
+    CpuMetrics metrics;
+#endif
 } CPU;
 
 // RW memory locations
 const u16 palette_address = 0xff47;
+const u16 obj_palette_0_address = 0xff48;
+const u16 obj_palette_1_address = 0xff49;
 const u16 scroll_y_address = 0xff42;
 const u16 scroll_x_address = 0xff43;
 const u16 lcd_control_address = 0xff40;
 const u16 ly_address = 0xff44;
+const u16 window_y_address = 0xff4a;
+const u16 window_x_address = 0xff4b;
 const u16 disable_bootrom_address = 0xff50;
+const u16 dma_address = 0xff46;
+const u16 lcd_status_address = 0xff41;
+const u16 ly_compare_address = 0xff45;
+const u16 joypad_address = 0xff00;
+const u16 serial_data_address = 0xff01;
+const u16 serial_control_address = 0xff02;
+const u16 div_address = 0xff04;
+const u16 tima_address = 0xff05;
+const u16 tma_address = 0xff06;
+const u16 tac_address = 0xff07;
+const u16 interrupt_flag_address = 0xff0f;
+const u16 interrupt_enable_address = 0xffff;
+// Cgb only
+const u16 key1_address = 0xff4d;
+const u16 vbk_address = 0xff4f;
+const u16 hdma_source_address = 0xff51;
+const u16 hdma_dest_address = 0xff53;
+const u16 hdma_control_address = 0xff55;
+const u16 bcps_address = 0xff68;
+const u16 ocpd_address = 0xff6b;
+const u16 svbk_address = 0xff70;
+
+// Interrupt bits in IF and IE, in priority order
+const u8 vblank_interrupt = 0x01;
+const u8 lcd_status_interrupt = 0x02;
+const u8 timer_interrupt = 0x04;
+const u8 serial_interrupt = 0x08;
+const u8 joypad_interrupt = 0x10;
+
+const u16 oam_address = 0xfe00;
+const u16 oam_len = 0xa0;
+// OAM DMA holds the bus for 160 machine cycles
+const u64 dma_cycles = 160 * 4;
+// HDMA holds the cpu for 32 cycles per 16 bytes, at either speed
+const u64 hdma_block_cycles = 32;
+// A speed switch stops the cpu for 2050 machine cycles
+const u64 speed_switch_cycles = 2050 * 4;
+
+const u64 line_cycles = 456;
+// Pixels are pushed once OAM search is over
+const u64 oam_scan_cycles = 80;
+const u8 lines_per_frame = 154;
+// Mode 3 is taken as a fixed length; hblank starts after it
+const u64 hblank_start_cycles = 80 + 172;
+
+// A byte at the internal 8192 Hz serial clock
+const u64 serial_cycles = 8 * 512;
+// How far one linked machine may run past what it knows of the other. It
+// stays a little under the shortest transfer, a double speed one, so a
+// transfer message always arrives before the partner reaches its
+// completion, even counting the instruction that crosses the limit.
+const u64 link_lookahead = 8 * 512 / 2 - 32;
+// Has to stay under the lookahead, or both sides can wait on each other
+const u64 link_sync_cycles = 1024;
+
+// TIMA period for each TAC clock select
+const u64 timer_periods[4] = {1024, 16, 64, 256};
+
+// RGBA for shades 0-3
+const u32 dmg_colors[4] = {0xffffffff, 0xffaaaaaa, 0xff555555, 0xff000000};
 
 u8 boot_rom[] = {
   0x31, 0xfe, 0xff, 0xaf, 0x21, 0xff, 0x9f, 0x32, // 0x00
@@ -75,9 +578,405 @@ u8 boot_rom[] = {
 }; 
 u16 boot_rom_len = 256; 
 
+typedef enum Operand {
+    OPERAND_NONE,
+    OPERAND_D8,
+    OPERAND_D16,
+    // offset into 0xff00
+    OPERAND_A8,
+    OPERAND_A16,
+    // relative jump target
+    OPERAND_R8,
+    // signed offset added to sp
+    OPERAND_S8,
+} Operand;
+
+// Static description of an opcode, shared by the interpreter (cycles) and the
+// disassembler (name, length, operand). A % in the name marks where the
+// operand goes. Conditional jumps, calls and returns list the untaken cost;
+// the extra cycles are added when the branch is taken. The cb prefix itself
+// is free and charged through cb_opcodes.
+typedef struct Opcode {
+    const char *name;
+    u8 length;
+    u8 cycles;
+    u8 operand;
+} Opcode;
+
+const Opcode opcodes[256] = {
+    {"NOP", 1, 4, OPERAND_NONE}, // 0x00
+    {"LD BC,%", 3, 12, OPERAND_D16}, // 0x01
+    {"LD (BC),A", 1, 8, OPERAND_NONE}, // 0x02
+    {"INC BC", 1, 8, OPERAND_NONE}, // 0x03
+    {"INC B", 1, 4, OPERAND_NONE}, // 0x04
+    {"DEC B", 1, 4, OPERAND_NONE}, // 0x05
+    {"LD B,%", 2, 8, OPERAND_D8}, // 0x06
+    {"RLCA", 1, 4, OPERAND_NONE}, // 0x07
+    {"LD (%),SP", 3, 20, OPERAND_A16}, // 0x08
+    {"ADD HL,BC", 1, 8, OPERAND_NONE}, // 0x09
+    {"LD A,(BC)", 1, 8, OPERAND_NONE}, // 0x0a
+    {"DEC BC", 1, 8, OPERAND_NONE}, // 0x0b
+    {"INC C", 1, 4, OPERAND_NONE}, // 0x0c
+    {"DEC C", 1, 4, OPERAND_NONE}, // 0x0d
+    {"LD C,%", 2, 8, OPERAND_D8}, // 0x0e
+    {"RRCA", 1, 4, OPERAND_NONE}, // 0x0f
+    {"STOP", 2, 4, OPERAND_NONE}, // 0x10
+    {"LD DE,%", 3, 12, OPERAND_D16}, // 0x11
+    {"LD (DE),A", 1, 8, OPERAND_NONE}, // 0x12
+    {"INC DE", 1, 8, OPERAND_NONE}, // 0x13
+    {"INC D", 1, 4, OPERAND_NONE}, // 0x14
+    {"DEC D", 1, 4, OPERAND_NONE}, // 0x15
+    {"LD D,%", 2, 8, OPERAND_D8}, // 0x16
+    {"RLA", 1, 4, OPERAND_NONE}, // 0x17
+    {"JR %", 2, 12, OPERAND_R8}, // 0x18
+    {"ADD HL,DE", 1, 8, OPERAND_NONE}, // 0x19
+    {"LD A,(DE)", 1, 8, OPERAND_NONE}, // 0x1a
+    {"DEC DE", 1, 8, OPERAND_NONE}, // 0x1b
+    {"INC E", 1, 4, OPERAND_NONE}, // 0x1c
+    {"DEC E", 1, 4, OPERAND_NONE}, // 0x1d
+    {"LD E,%", 2, 8, OPERAND_D8}, // 0x1e
+    {"RRA", 1, 4, OPERAND_NONE}, // 0x1f
+    {"JR NZ,%", 2, 8, OPERAND_R8}, // 0x20
+    {"LD HL,%", 3, 12, OPERAND_D16}, // 0x21
+    {"LD (HL+),A", 1, 8, OPERAND_NONE}, // 0x22
+    {"INC HL", 1, 8, OPERAND_NONE}, // 0x23
+    {"INC H", 1, 4, OPERAND_NONE}, // 0x24
+    {"DEC H", 1, 4, OPERAND_NONE}, // 0x25
+    {"LD H,%", 2, 8, OPERAND_D8}, // 0x26
+    {"DAA", 1, 4, OPERAND_NONE}, // 0x27
+    {"JR Z,%", 2, 8, OPERAND_R8}, // 0x28
+    {"ADD HL,HL", 1, 8, OPERAND_NONE}, // 0x29
+    {"LD A,(HL+)", 1, 8, OPERAND_NONE}, // 0x2a
+    {"DEC HL", 1, 8, OPERAND_NONE}, // 0x2b
+    {"INC L", 1, 4, OPERAND_NONE}, // 0x2c
+    {"DEC L", 1, 4, OPERAND_NONE}, // 0x2d
+    {"LD L,%", 2, 8, OPERAND_D8}, // 0x2e
+    {"CPL", 1, 4, OPERAND_NONE}, // 0x2f
+    {"JR NC,%", 2, 8, OPERAND_R8}, // 0x30
+    {"LD SP,%", 3, 12, OPERAND_D16}, // 0x31
+    {"LD (HL-),A", 1, 8, OPERAND_NONE}, // 0x32
+    {"INC SP", 1, 8, OPERAND_NONE}, // 0x33
+    {"INC (HL)", 1, 12, OPERAND_NONE}, // 0x34
+    {"DEC (HL)", 1, 12, OPERAND_NONE}, // 0x35
+    {"LD (HL),%", 2, 12, OPERAND_D8}, // 0x36
+    {"SCF", 1, 4, OPERAND_NONE}, // 0x37
+    {"JR C,%", 2, 8, OPERAND_R8}, // 0x38
+    {"ADD HL,SP", 1, 8, OPERAND_NONE}, // 0x39
+    {"LD A,(HL-)", 1, 8, OPERAND_NONE}, // 0x3a
+    {"DEC SP", 1, 8, OPERAND_NONE}, // 0x3b
+    {"INC A", 1, 4, OPERAND_NONE}, // 0x3c
+    {"DEC A", 1, 4, OPERAND_NONE}, // 0x3d
+    {"LD A,%", 2, 8, OPERAND_D8}, // 0x3e
+    {"CCF", 1, 4, OPERAND_NONE}, // 0x3f
+    {"LD B,B", 1, 4, OPERAND_NONE}, // 0x40
+    {"LD B,C", 1, 4, OPERAND_NONE}, // 0x41
+    {"LD B,D", 1, 4, OPERAND_NONE}, // 0x42
+    {"LD B,E", 1, 4, OPERAND_NONE}, // 0x43
+    {"LD B,H", 1, 4, OPERAND_NONE}, // 0x44
+    {"LD B,L", 1, 4, OPERAND_NONE}, // 0x45
+    {"LD B,(HL)", 1, 8, OPERAND_NONE}, // 0x46
+    {"LD B,A", 1, 4, OPERAND_NONE}, // 0x47
+    {"LD C,B", 1, 4, OPERAND_NONE}, // 0x48
+    {"LD C,C", 1, 4, OPERAND_NONE}, // 0x49
+    {"LD C,D", 1, 4, OPERAND_NONE}, // 0x4a
+    {"LD C,E", 1, 4, OPERAND_NONE}, // 0x4b
+    {"LD C,H", 1, 4, OPERAND_NONE}, // 0x4c
+    {"LD C,L", 1, 4, OPERAND_NONE}, // 0x4d
+    {"LD C,(HL)", 1, 8, OPERAND_NONE}, // 0x4e
+    {"LD C,A", 1, 4, OPERAND_NONE}, // 0x4f
+    {"LD D,B", 1, 4, OPERAND_NONE}, // 0x50
+    {"LD D,C", 1, 4, OPERAND_NONE}, // 0x51
+    {"LD D,D", 1, 4, OPERAND_NONE}, // 0x52
+    {"LD D,E", 1, 4, OPERAND_NONE}, // 0x53
+    {"LD D,H", 1, 4, OPERAND_NONE}, // 0x54
+    {"LD D,L", 1, 4, OPERAND_NONE}, // 0x55
+    {"LD D,(HL)", 1, 8, OPERAND_NONE}, // 0x56
+    {"LD D,A", 1, 4, OPERAND_NONE}, // 0x57
+    {"LD E,B", 1, 4, OPERAND_NONE}, // 0x58
+    {"LD E,C", 1, 4, OPERAND_NONE}, // 0x59
+    {"LD E,D", 1, 4, OPERAND_NONE}, // 0x5a
+    {"LD E,E", 1, 4, OPERAND_NONE}, // 0x5b
+    {"LD E,H", 1, 4, OPERAND_NONE}, // 0x5c
+    {"LD E,L", 1, 4, OPERAND_NONE}, // 0x5d
+    {"LD E,(HL)", 1, 8, OPERAND_NONE}, // 0x5e
+    {"LD E,A", 1, 4, OPERAND_NONE}, // 0x5f
+    {"LD H,B", 1, 4, OPERAND_NONE}, // 0x60
+    {"LD H,C", 1, 4, OPERAND_NONE}, // 0x61
+    {"LD H,D", 1, 4, OPERAND_NONE}, // 0x62
+    {"LD H,E", 1, 4, OPERAND_NONE}, // 0x63
+    {"LD H,H", 1, 4, OPERAND_NONE}, // 0x64
+    {"LD H,L", 1, 4, OPERAND_NONE}, // 0x65
+    {"LD H,(HL)", 1, 8, OPERAND_NONE}, // 0x66
+    {"LD H,A", 1, 4, OPERAND_NONE}, // 0x67
+    {"LD L,B", 1, 4, OPERAND_NONE}, // 0x68
+    {"LD L,C", 1, 4, OPERAND_NONE}, // 0x69
+    {"LD L,D", 1, 4, OPERAND_NONE}, // 0x6a
+    {"LD L,E", 1, 4, OPERAND_NONE}, // 0x6b
+    {"LD L,H", 1, 4, OPERAND_NONE}, // 0x6c
+    {"LD L,L", 1, 4, OPERAND_NONE}, // 0x6d
+    {"LD L,(HL)", 1, 8, OPERAND_NONE}, // 0x6e
+    {"LD L,A", 1, 4, OPERAND_NONE}, // 0x6f
+    {"LD (HL),B", 1, 8, OPERAND_NONE}, // 0x70
+    {"LD (HL),C", 1, 8, OPERAND_NONE}, // 0x71
+    {"LD (HL),D", 1, 8, OPERAND_NONE}, // 0x72
+    {"LD (HL),E", 1, 8, OPERAND_NONE}, // 0x73
+    {"LD (HL),H", 1, 8, OPERAND_NONE}, // 0x74
+    {"LD (HL),L", 1, 8, OPERAND_NONE}, // 0x75
+    {"HALT", 1, 4, OPERAND_NONE}, // 0x76
+    {"LD (HL),A", 1, 8, OPERAND_NONE}, // 0x77
+    {"LD A,B", 1, 4, OPERAND_NONE}, // 0x78
+    {"LD A,C", 1, 4, OPERAND_NONE}, // 0x79
+    {"LD A,D", 1, 4, OPERAND_NONE}, // 0x7a
+    {"LD A,E", 1, 4, OPERAND_NONE}, // 0x7b
+    {"LD A,H", 1, 4, OPERAND_NONE}, // 0x7c
+    {"LD A,L", 1, 4, OPERAND_NONE}, // 0x7d
+    {"LD A,(HL)", 1, 8, OPERAND_NONE}, // 0x7e
+    {"LD A,A", 1, 4, OPERAND_NONE}, // 0x7f
+    {"ADD A,B", 1, 4, OPERAND_NONE}, // 0x80
+    {"ADD A,C", 1, 4, OPERAND_NONE}, // 0x81
+    {"ADD A,D", 1, 4, OPERAND_NONE}, // 0x82
+    {"ADD A,E", 1, 4, OPERAND_NONE}, // 0x83
+    {"ADD A,H", 1, 4, OPERAND_NONE}, // 0x84
+    {"ADD A,L", 1, 4, OPERAND_NONE}, // 0x85
+    {"ADD A,(HL)", 1, 8, OPERAND_NONE}, // 0x86
+    {"ADD A,A", 1, 4, OPERAND_NONE}, // 0x87
+    {"ADC A,B", 1, 4, OPERAND_NONE}, // 0x88
+    {"ADC A,C", 1, 4, OPERAND_NONE}, // 0x89
+    {"ADC A,D", 1, 4, OPERAND_NONE}, // 0x8a
+    {"ADC A,E", 1, 4, OPERAND_NONE}, // 0x8b
+    {"ADC A,H", 1, 4, OPERAND_NONE}, // 0x8c
+    {"ADC A,L", 1, 4, OPERAND_NONE}, // 0x8d
+    {"ADC A,(HL)", 1, 8, OPERAND_NONE}, // 0x8e
+    {"ADC A,A", 1, 4, OPERAND_NONE}, // 0x8f
+    {"SUB B", 1, 4, OPERAND_NONE}, // 0x90
+    {"SUB C", 1, 4, OPERAND_NONE}, // 0x91
+    {"SUB D", 1, 4, OPERAND_NONE}, // 0x92
+    {"SUB E", 1, 4, OPERAND_NONE}, // 0x93
+    {"SUB H", 1, 4, OPERAND_NONE}, // 0x94
+    {"SUB L", 1, 4, OPERAND_NONE}, // 0x95
+    {"SUB (HL)", 1, 8, OPERAND_NONE}, // 0x96
+    {"SUB A", 1, 4, OPERAND_NONE}, // 0x97
+    {"SBC A,B", 1, 4, OPERAND_NONE}, // 0x98
+    {"SBC A,C", 1, 4, OPERAND_NONE}, // 0x99
+    {"SBC A,D", 1, 4, OPERAND_NONE}, // 0x9a
+    {"SBC A,E", 1, 4, OPERAND_NONE}, // 0x9b
+    {"SBC A,H", 1, 4, OPERAND_NONE}, // 0x9c
+    {"SBC A,L", 1, 4, OPERAND_NONE}, // 0x9d
+    {"SBC A,(HL)", 1, 8, OPERAND_NONE}, // 0x9e
+    {"SBC A,A", 1, 4, OPERAND_NONE}, // 0x9f
+    {"AND B", 1, 4, OPERAND_NONE}, // 0xa0
+    {"AND C", 1, 4, OPERAND_NONE}, // 0xa1
+    {"AND D", 1, 4, OPERAND_NONE}, // 0xa2
+    {"AND E", 1, 4, OPERAND_NONE}, // 0xa3
+    {"AND H", 1, 4, OPERAND_NONE}, // 0xa4
+    {"AND L", 1, 4, OPERAND_NONE}, // 0xa5
+    {"AND (HL)", 1, 8, OPERAND_NONE}, // 0xa6
+    {"AND A", 1, 4, OPERAND_NONE}, // 0xa7
+    {"XOR B", 1, 4, OPERAND_NONE}, // 0xa8
+    {"XOR C", 1, 4, OPERAND_NONE}, // 0xa9
+    {"XOR D", 1, 4, OPERAND_NONE}, // 0xaa
+    {"XOR E", 1, 4, OPERAND_NONE}, // 0xab
+    {"XOR H", 1, 4, OPERAND_NONE}, // 0xac
+    {"XOR L", 1, 4, OPERAND_NONE}, // 0xad
+    {"XOR (HL)", 1, 8, OPERAND_NONE}, // 0xae
+    {"XOR A", 1, 4, OPERAND_NONE}, // 0xaf
+    {"OR B", 1, 4, OPERAND_NONE}, // 0xb0
+    {"OR C", 1, 4, OPERAND_NONE}, // 0xb1
+    {"OR D", 1, 4, OPERAND_NONE}, // 0xb2
+    {"OR E", 1, 4, OPERAND_NONE}, // 0xb3
+    {"OR H", 1, 4, OPERAND_NONE}, // 0xb4
+    {"OR L", 1, 4, OPERAND_NONE}, // 0xb5
+    {"OR (HL)", 1, 8, OPERAND_NONE}, // 0xb6
+    {"OR A", 1, 4, OPERAND_NONE}, // 0xb7
+    {"CP B", 1, 4, OPERAND_NONE}, // 0xb8
+    {"CP C", 1, 4, OPERAND_NONE}, // 0xb9
+    {"CP D", 1, 4, OPERAND_NONE}, // 0xba
+    {"CP E", 1, 4, OPERAND_NONE}, // 0xbb
+    {"CP H", 1, 4, OPERAND_NONE}, // 0xbc
+    {"CP L", 1, 4, OPERAND_NONE}, // 0xbd
+    {"CP (HL)", 1, 8, OPERAND_NONE}, // 0xbe
+    {"CP A", 1, 4, OPERAND_NONE}, // 0xbf
+    {"RET NZ", 1, 8, OPERAND_NONE}, // 0xc0
+    {"POP BC", 1, 12, OPERAND_NONE}, // 0xc1
+    {"JP NZ,%", 3, 12, OPERAND_A16}, // 0xc2
+    {"JP %", 3, 16, OPERAND_A16}, // 0xc3
+    {"CALL NZ,%", 3, 12, OPERAND_A16}, // 0xc4
+    {"PUSH BC", 1, 16, OPERAND_NONE}, // 0xc5
+    {"ADD A,%", 2, 8, OPERAND_D8}, // 0xc6
+    {"RST $00", 1, 16, OPERAND_NONE}, // 0xc7
+    {"RET Z", 1, 8, OPERAND_NONE}, // 0xc8
+    {"RET", 1, 16, OPERAND_NONE}, // 0xc9
+    {"JP Z,%", 3, 12, OPERAND_A16}, // 0xca
+    {"PREFIX CB", 2, 0, OPERAND_NONE}, // 0xcb
+    {"CALL Z,%", 3, 12, OPERAND_A16}, // 0xcc
+    {"CALL %", 3, 24, OPERAND_A16}, // 0xcd
+    {"ADC A,%", 2, 8, OPERAND_D8}, // 0xce
+    {"RST $08", 1, 16, OPERAND_NONE}, // 0xcf
+    {"RET NC", 1, 8, OPERAND_NONE}, // 0xd0
+    {"POP DE", 1, 12, OPERAND_NONE}, // 0xd1
+    {"JP NC,%", 3, 12, OPERAND_A16}, // 0xd2
+    {"-", 1, 0, OPERAND_NONE}, // 0xd3
+    {"CALL NC,%", 3, 12, OPERAND_A16}, // 0xd4
+    {"PUSH DE", 1, 16, OPERAND_NONE}, // 0xd5
+    {"SUB %", 2, 8, OPERAND_D8}, // 0xd6
+    {"RST $10", 1, 16, OPERAND_NONE}, // 0xd7
+    {"RET C", 1, 8, OPERAND_NONE}, // 0xd8
+    {"RETI", 1, 16, OPERAND_NONE}, // 0xd9
+    {"JP C,%", 3, 12, OPERAND_A16}, // 0xda
+    {"-", 1, 0, OPERAND_NONE}, // 0xdb
+    {"CALL C,%", 3, 12, OPERAND_A16}, // 0xdc
+    {"-", 1, 0, OPERAND_NONE}, // 0xdd
+    {"SBC A,%", 2, 8, OPERAND_D8}, // 0xde
+    {"RST $18", 1, 16, OPERAND_NONE}, // 0xdf
+    {"LDH (%),A", 2, 12, OPERAND_A8}, // 0xe0
+    {"POP HL", 1, 12, OPERAND_NONE}, // 0xe1
+    {"LD (C),A", 1, 8, OPERAND_NONE}, // 0xe2
+    {"-", 1, 0, OPERAND_NONE}, // 0xe3
+    {"-", 1, 0, OPERAND_NONE}, // 0xe4
+    {"PUSH HL", 1, 16, OPERAND_NONE}, // 0xe5
+    {"AND %", 2, 8, OPERAND_D8}, // 0xe6
+    {"RST $20", 1, 16, OPERAND_NONE}, // 0xe7
+    {"ADD SP,%", 2, 16, OPERAND_S8}, // 0xe8
+    {"JP HL", 1, 4, OPERAND_NONE}, // 0xe9
+    {"LD (%),A", 3, 16, OPERAND_A16}, // 0xea
+    {"-", 1, 0, OPERAND_NONE}, // 0xeb
+    {"-", 1, 0, OPERAND_NONE}, // 0xec
+    {"-", 1, 0, OPERAND_NONE}, // 0xed
+    {"XOR %", 2, 8, OPERAND_D8}, // 0xee
+    {"RST $28", 1, 16, OPERAND_NONE}, // 0xef
+    {"LDH A,(%)", 2, 12, OPERAND_A8}, // 0xf0
+    {"POP AF", 1, 12, OPERAND_NONE}, // 0xf1
+    {"LD A,(C)", 1, 8, OPERAND_NONE}, // 0xf2
+    {"DI", 1, 4, OPERAND_NONE}, // 0xf3
+    {"-", 1, 0, OPERAND_NONE}, // 0xf4
+    {"PUSH AF", 1, 16, OPERAND_NONE}, // 0xf5
+    {"OR %", 2, 8, OPERAND_D8}, // 0xf6
+    {"RST $30", 1, 16, OPERAND_NONE}, // 0xf7
+    {"LD HL,SP+%", 2, 12, OPERAND_S8}, // 0xf8
+    {"LD SP,HL", 1, 8, OPERAND_NONE}, // 0xf9
+    {"LD A,(%)", 3, 16, OPERAND_A16}, // 0xfa
+    {"EI", 1, 4, OPERAND_NONE}, // 0xfb
+    {"-", 1, 0, OPERAND_NONE}, // 0xfc
+    {"-", 1, 0, OPERAND_NONE}, // 0xfd
+    {"CP %", 2, 8, OPERAND_D8}, // 0xfe
+    {"RST $38", 1, 16, OPERAND_NONE}, // 0xff
+};
+
+const Opcode cb_opcodes[256] = {
+    {"RLC B", 2, 8}, {"RLC C", 2, 8}, {"RLC D", 2, 8}, {"RLC E", 2, 8}, // 0x00
+    {"RLC H", 2, 8}, {"RLC L", 2, 8}, {"RLC (HL)", 2, 16}, {"RLC A", 2, 8}, // 0x04
+    {"RRC B", 2, 8}, {"RRC C", 2, 8}, {"RRC D", 2, 8}, {"RRC E", 2, 8}, // 0x08
+    {"RRC H", 2, 8}, {"RRC L", 2, 8}, {"RRC (HL)", 2, 16}, {"RRC A", 2, 8}, // 0x0c
+    {"RL B", 2, 8}, {"RL C", 2, 8}, {"RL D", 2, 8}, {"RL E", 2, 8}, // 0x10
+    {"RL H", 2, 8}, {"RL L", 2, 8}, {"RL (HL)", 2, 16}, {"RL A", 2, 8}, // 0x14
+    {"RR B", 2, 8}, {"RR C", 2, 8}, {"RR D", 2, 8}, {"RR E", 2, 8}, // 0x18
+    {"RR H", 2, 8}, {"RR L", 2, 8}, {"RR (HL)", 2, 16}, {"RR A", 2, 8}, // 0x1c
+    {"SLA B", 2, 8}, {"SLA C", 2, 8}, {"SLA D", 2, 8}, {"SLA E", 2, 8}, // 0x20
+    {"SLA H", 2, 8}, {"SLA L", 2, 8}, {"SLA (HL)", 2, 16}, {"SLA A", 2, 8}, // 0x24
+    {"SRA B", 2, 8}, {"SRA C", 2, 8}, {"SRA D", 2, 8}, {"SRA E", 2, 8}, // 0x28
+    {"SRA H", 2, 8}, {"SRA L", 2, 8}, {"SRA (HL)", 2, 16}, {"SRA A", 2, 8}, // 0x2c
+    {"SWAP B", 2, 8}, {"SWAP C", 2, 8}, {"SWAP D", 2, 8}, {"SWAP E", 2, 8}, // 0x30
+    {"SWAP H", 2, 8}, {"SWAP L", 2, 8}, {"SWAP (HL)", 2, 16}, {"SWAP A", 2, 8}, // 0x34
+    {"SRL B", 2, 8}, {"SRL C", 2, 8}, {"SRL D", 2, 8}, {"SRL E", 2, 8}, // 0x38
+    {"SRL H", 2, 8}, {"SRL L", 2, 8}, {"SRL (HL)", 2, 16}, {"SRL A", 2, 8}, // 0x3c
+    {"BIT 0,B", 2, 8}, {"BIT 0,C", 2, 8}, {"BIT 0,D", 2, 8}, {"BIT 0,E", 2, 8}, // 0x40
+    {"BIT 0,H", 2, 8}, {"BIT 0,L", 2, 8}, {"BIT 0,(HL)", 2, 12}, {"BIT 0,A", 2, 8}, // 0x44
+    {"BIT 1,B", 2, 8}, {"BIT 1,C", 2, 8}, {"BIT 1,D", 2, 8}, {"BIT 1,E", 2, 8}, // 0x48
+    {"BIT 1,H", 2, 8}, {"BIT 1,L", 2, 8}, {"BIT 1,(HL)", 2, 12}, {"BIT 1,A", 2, 8}, // 0x4c
+    {"BIT 2,B", 2, 8}, {"BIT 2,C", 2, 8}, {"BIT 2,D", 2, 8}, {"BIT 2,E", 2, 8}, // 0x50
+    {"BIT 2,H", 2, 8}, {"BIT 2,L", 2, 8}, {"BIT 2,(HL)", 2, 12}, {"BIT 2,A", 2, 8}, // 0x54
+    {"BIT 3,B", 2, 8}, {"BIT 3,C", 2, 8}, {"BIT 3,D", 2, 8}, {"BIT 3,E", 2, 8}, // 0x58
+    {"BIT 3,H", 2, 8}, {"BIT 3,L", 2, 8}, {"BIT 3,(HL)", 2, 12}, {"BIT 3,A", 2, 8}, // 0x5c
+    {"BIT 4,B", 2, 8}, {"BIT 4,C", 2, 8}, {"BIT 4,D", 2, 8}, {"BIT 4,E", 2, 8}, // 0x60
+    {"BIT 4,H", 2, 8}, {"BIT 4,L", 2, 8}, {"BIT 4,(HL)", 2, 12}, {"BIT 4,A", 2, 8}, // 0x64
+    {"BIT 5,B", 2, 8}, {"BIT 5,C", 2, 8}, {"BIT 5,D", 2, 8}, {"BIT 5,E", 2, 8}, // 0x68
+    {"BIT 5,H", 2, 8}, {"BIT 5,L", 2, 8}, {"BIT 5,(HL)", 2, 12}, {"BIT 5,A", 2, 8}, // 0x6c
+    {"BIT 6,B", 2, 8}, {"BIT 6,C", 2, 8}, {"BIT 6,D", 2, 8}, {"BIT 6,E", 2, 8}, // 0x70
+    {"BIT 6,H", 2, 8}, {"BIT 6,L", 2, 8}, {"BIT 6,(HL)", 2, 12}, {"BIT 6,A", 2, 8}, // 0x74
+    {"BIT 7,B", 2, 8}, {"BIT 7,C", 2, 8}, {"BIT 7,D", 2, 8}, {"BIT 7,E", 2, 8}, // 0x78
+    {"BIT 7,H", 2, 8}, {"BIT 7,L", 2, 8}, {"BIT 7,(HL)", 2, 12}, {"BIT 7,A", 2, 8}, // 0x7c
+    {"RES 0,B", 2, 8}, {"RES 0,C", 2, 8}, {"RES 0,D", 2, 8}, {"RES 0,E", 2, 8}, // 0x80
+    {"RES 0,H", 2, 8}, {"RES 0,L", 2, 8}, {"RES 0,(HL)", 2, 16}, {"RES 0,A", 2, 8}, // 0x84
+    {"RES 1,B", 2, 8}, {"RES 1,C", 2, 8}, {"RES 1,D", 2, 8}, {"RES 1,E", 2, 8}, // 0x88
+    {"RES 1,H", 2, 8}, {"RES 1,L", 2, 8}, {"RES 1,(HL)", 2, 16}, {"RES 1,A", 2, 8}, // 0x8c
+    {"RES 2,B", 2, 8}, {"RES 2,C", 2, 8}, {"RES 2,D", 2, 8}, {"RES 2,E", 2, 8}, // 0x90
+    {"RES 2,H", 2, 8}, {"RES 2,L", 2, 8}, {"RES 2,(HL)", 2, 16}, {"RES 2,A", 2, 8}, // 0x94
+    {"RES 3,B", 2, 8}, {"RES 3,C", 2, 8}, {"RES 3,D", 2, 8}, {"RES 3,E", 2, 8}, // 0x98
+    {"RES 3,H", 2, 8}, {"RES 3,L", 2, 8}, {"RES 3,(HL)", 2, 16}, {"RES 3,A", 2, 8}, // 0x9c
+    {"RES 4,B", 2, 8}, {"RES 4,C", 2, 8}, {"RES 4,D", 2, 8}, {"RES 4,E", 2, 8}, // 0xa0
+    {"RES 4,H", 2, 8}, {"RES 4,L", 2, 8}, {"RES 4,(HL)", 2, 16}, {"RES 4,A", 2, 8}, // 0xa4
+    {"RES 5,B", 2, 8}, {"RES 5,C", 2, 8}, {"RES 5,D", 2, 8}, {"RES 5,E", 2, 8}, // 0xa8
+    {"RES 5,H", 2, 8}, {"RES 5,L", 2, 8}, {"RES 5,(HL)", 2, 16}, {"RES 5,A", 2, 8}, // 0xac
+    {"RES 6,B", 2, 8}, {"RES 6,C", 2, 8}, {"RES 6,D", 2, 8}, {"RES 6,E", 2, 8}, // 0xb0
+    {"RES 6,H", 2, 8}, {"RES 6,L", 2, 8}, {"RES 6,(HL)", 2, 16}, {"RES 6,A", 2, 8}, // 0xb4
+    {"RES 7,B", 2, 8}, {"RES 7,C", 2, 8}, {"RES 7,D", 2, 8}, {"RES 7,E", 2, 8}, // 0xb8
+    {"RES 7,H", 2, 8}, {"RES 7,L", 2, 8}, {"RES 7,(HL)", 2, 16}, {"RES 7,A", 2, 8}, // 0xbc
+    {"SET 0,B", 2, 8}, {"SET 0,C", 2, 8}, {"SET 0,D", 2, 8}, {"SET 0,E", 2, 8}, // 0xc0
+    {"SET 0,H", 2, 8}, {"SET 0,L", 2, 8}, {"SET 0,(HL)", 2, 16}, {"SET 0,A", 2, 8}, // 0xc4
+    {"SET 1,B", 2, 8}, {"SET 1,C", 2, 8}, {"SET 1,D", 2, 8}, {"SET 1,E", 2, 8}, // 0xc8
+    {"SET 1,H", 2, 8}, {"SET 1,L", 2, 8}, {"SET 1,(HL)", 2, 16}, {"SET 1,A", 2, 8}, // 0xcc
+    {"SET 2,B", 2, 8}, {"SET 2,C", 2, 8}, {"SET 2,D", 2, 8}, {"SET 2,E", 2, 8}, // 0xd0
+    {"SET 2,H", 2, 8}, {"SET 2,L", 2, 8}, {"SET 2,(HL)", 2, 16}, {"SET 2,A", 2, 8}, // 0xd4
+    {"SET 3,B", 2, 8}, {"SET 3,C", 2, 8}, {"SET 3,D", 2, 8}, {"SET 3,E", 2, 8}, // 0xd8
+    {"SET 3,H", 2, 8}, {"SET 3,L", 2, 8}, {"SET 3,(HL)", 2, 16}, {"SET 3,A", 2, 8}, // 0xdc
+    {"SET 4,B", 2, 8}, {"SET 4,C", 2, 8}, {"SET 4,D", 2, 8}, {"SET 4,E", 2, 8}, // 0xe0
+    {"SET 4,H", 2, 8}, {"SET 4,L", 2, 8}, {"SET 4,(HL)", 2, 16}, {"SET 4,A", 2, 8}, // 0xe4
+    {"SET 5,B", 2, 8}, {"SET 5,C", 2, 8}, {"SET 5,D", 2, 8}, {"SET 5,E", 2, 8}, // 0xe8
+    {"SET 5,H", 2, 8}, {"SET 5,L", 2, 8}, {"SET 5,(HL)", 2, 16}, {"SET 5,A", 2, 8}, // 0xec
+    {"SET 6,B", 2, 8}, {"SET 6,C", 2, 8}, {"SET 6,D", 2, 8}, {"SET 6,E", 2, 8}, // 0xf0
+    {"SET 6,H", 2, 8}, {"SET 6,L", 2, 8}, {"SET 6,(HL)", 2, 16}, {"SET 6,A", 2, 8}, // 0xf4
+    {"SET 7,B", 2, 8}, {"SET 7,C", 2, 8}, {"SET 7,D", 2, 8}, {"SET 7,E", 2, 8}, // 0xf8
+    {"SET 7,H", 2, 8}, {"SET 7,L", 2, 8}, {"SET 7,(HL)", 2, 16}, {"SET 7,A", 2, 8}, // 0xfc
+};
+
 #define rom_len 0x8000
 u8 rom[rom_len];
 
+bool load_rom(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    bool ok = fread(rom, 1, rom_len, f) == rom_len;
+    fclose(f);
+    return ok;
+}
+
+const u16 cgb_flag_address = 0x143;
+const u16 cartridge_type_address = 0x147;
+const u16 ram_size_address = 0x149;
+
+// Whether the cartridge's ram sits behind an mbc's enable register (mbc1,
+// mbc3 and mbc5 with ram)
+bool ram_gated() {
+    switch (rom[cartridge_type_address]) {
+        case 0x02: case 0x03: case 0x10: case 0x12: case 0x13:
+        case 0x1a: case 0x1b: case 0x1d: case 0x1e: {
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+bool battery_backed() {
+    switch (rom[cartridge_type_address]) {
+        case 0x03: case 0x09: case 0x10: case 0x13: case 0x1b: case 0x1e: {
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+u32 cartridge_ram_len() {
+    static const u32 lens[] = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+    u8 size = rom[ram_size_address];
+    return size < sizeof(lens) / sizeof(lens[0]) ? lens[size] : 0;
+}
+
 u16 make_u16(u8 hi, u8 lo) {
     return (hi << 8) | lo;
 }
@@ -145,1099 +1044,7319 @@ void dump_regs(CPU *cpu) {
 }
 
 
-void init_cpu(CPU *cpu) {
-    cpu->a = 0;
-    cpu->f = 0;
-    cpu->b = 0;
-    cpu->c = 0;
-    cpu->d = 0;
-    cpu->e = 0;
-    cpu->h = 0;
-    cpu->l = 0;
-    cpu->pc = 0;
-    cpu->sp = 0;
-    cpu->boot_rom_enabled = true;
-    memset(cpu->memory, 0, 0xFFFF);
-    // TODO: handle boot rom layering properly
-    memcpy(cpu->memory, rom, rom_len);
-    memcpy(cpu->memory, boot_rom, boot_rom_len);
+void update_palette(GPU *gpu, int palette, u8 val) {
+    for (int color = 0; color < 4; color++) {
+        u8 shade = (val >> (color * 2)) & 0x3;
+        gpu->shades[palette * 4 + color] = shade;
+        gpu->colors[palette * 4 + color] = dmg_colors[shade];
+    }
 }
 
-
-u8 memory(CPU *cpu, u16 address) {
-    if (address <= 0xff) {
-        if (cpu->boot_rom_enabled) {
-            return boot_rom[address];
-        } else {
-            goto passthrough;
-        }
-    } else if ((address <= 0xff26 && address >= 0xff20)
-        || (address <= 0xff3f && address >= 0xff30)
-        || (address <= 0xff1e && address >= 0xff10)) {
-        // sound stuff
-    } else if (address == ly_address) {
-        // vertical line of gpu
-        // TODO
-        return 144;
-    } else if (address == scroll_y_address || address == scroll_x_address) {
-        goto passthrough;
-    } else if (address == disable_bootrom_address) {
-        goto passthrough;
-    } else if (address >= 0xff00 && address <= 0xff7f) {
-        dump_regs(cpu);
-        printf("read address: %04x\n", address);
-        assert(false);
+// Resolves one rgb555 colour of cgb palette ram, which = 0 for bg and 1
+// for obj. The shade is for sinks that only show four.
+void update_cgb_color(GPU *gpu, int which, int color) {
+    const u8 *bytes = &gpu->cgb_palettes[which][color * 2];
+    u16 rgb = bytes[0] | (bytes[1] << 8);
+    u32 channels[3];
+    for (int i = 0; i < 3; i++) {
+        u32 c = (rgb >> (i * 5)) & 0x1f;
+        channels[i] = (c << 3) | (c >> 2);
     }
-passthrough:
-    return cpu->memory[address];
+    u32 luma = (channels[0] * 299 + channels[1] * 587 + channels[2] * 114) / 1000;
+    gpu->cgb_shades[which * 32 + color] = (255 - luma) >> 6;
+    gpu->cgb_colors[which * 32 + color] = 0xff000000 | (channels[2] << 16)
+        | (channels[1] << 8) | channels[0];
 }
 
-void set_memory(CPU *cpu, u16 address, u8 val) {
-    if (address <= 0xff) {
-        if (cpu->boot_rom_enabled) {
-            // Read only?
-            assert(false);
-        } else {
-            goto passthrough;
-        }
-    } else if ((address <= 0xff26 && address >= 0xff20)
-        || (address <= 0xff3f && address >= 0xff30)
-        || (address <= 0xff1e && address >= 0xff10)) {
-        // sound stuff
-    } else if (address == palette_address) {
-        // TODO
-    } else if (address == scroll_y_address || address == scroll_x_address) {
-        goto passthrough;
-    } else if (address == lcd_control_address) {
-        // TODO
-    } else if (address == ly_address) {
-        // TODO
-        assert(false);
-    } else if (address == disable_bootrom_address) {
-        if (val == 1) {
-            cpu->boot_rom_enabled = false;
-        }
-        goto passthrough;
-    } else if (address >= 0xff00 && address <= 0xff7f) {
-        dump_regs(cpu);
-        printf("write address: %04x\n", address);
-        assert(false);
+// A write to BCPS, BCPD, OCPS or OCPD. The data registers go through to
+// the byte the index register selects, moving it on if it auto increments.
+void cgb_palette_write(GPU *gpu, u16 address, u8 val) {
+    int which = (address - bcps_address) / 2;
+    u8 index = gpu->cgb_palette_index[which];
+    if (!(address & 1)) {
+        gpu->cgb_palette_index[which] = val & 0xbf;
+        return;
+    }
+    u8 at = index & 0x3f;
+    if (gpu->cgb_palettes[which][at] != val) {
+        gpu->cgb_palettes[which][at] = val;
+        update_cgb_color(gpu, which, at / 2);
+        gpu->video_writes++;
+    }
+    if (index & 0x80) {
+        gpu->cgb_palette_index[which] = 0x80 | ((at + 1) & 0x3f);
     }
-passthrough:
-    cpu->memory[address] = val;
 }
 
-i8 parse_i8(CPU *cpu) {
-    i8 ret = (i8) memory(cpu, cpu->pc);
-    cpu->pc += 1;
-    return ret;
+u8 cgb_palette_read(GPU *gpu, u16 address) {
+    int which = (address - bcps_address) / 2;
+    u8 index = gpu->cgb_palette_index[which];
+    if (!(address & 1)) {
+        return index | 0x40;
+    }
+    return gpu->cgb_palettes[which][index & 0x3f];
 }
 
-u8 parse_u8(CPU *cpu) {
-    u16 ret = memory(cpu, cpu->pc);
-    cpu->pc += 1;
-    return ret;
+void init_gpu(GPU *gpu) {
+    if (!gpu->frames) {
+        gpu->frames = calloc(frame_pool_len, sizeof(Frame));
+        assert(gpu->frames);
+    }
+    for (int i = 0; i < 3; i++) {
+        update_palette(gpu, i, 0);
+    }
+    // All white, as the cgb boot rom leaves them
+    gpu->cgb = false;
+    memset(gpu->cgb_palettes, 0xff, sizeof(gpu->cgb_palettes));
+    memset(gpu->cgb_palette_index, 0, sizeof(gpu->cgb_palette_index));
+    for (int i = 0; i < 64; i++) {
+        update_cgb_color(gpu, i / 32, i % 32);
+    }
+    gpu->back = &gpu->frames[0];
+    gpu->latest = NULL;
+    gpu->frame_count = 0;
 }
 
-u16 parse_u16(CPU *cpu) {
-    u16 ret = make_u16(memory(cpu, cpu->pc + 1), memory(cpu, cpu->pc));
-    cpu->pc += 2;
-    return ret;
+void add_sink(GPU *gpu, FrameSink *sink) {
+    assert(gpu->sink_count < max_sinks);
+    atomic_init(&sink->mailbox, NULL);
+    sink->unchanged = false;
+    sink->taken_any = false;
+    gpu->sinks[gpu->sink_count++] = sink;
 }
 
-u8 hi(u16 val) {
-    return val >> 8;
+// Returns the newest frame the sink hasn't seen yet, or NULL. The caller
+// owns a reference and must release_frame() it.
+Frame *take_frame(FrameSink *sink) {
+    Frame *frame = atomic_exchange(&sink->mailbox, NULL);
+    if (frame) {
+        // Frames the sink missed count too, so compare against the last one
+        // it took rather than the one just before
+        sink->unchanged = sink->taken_any && frame->first_number <= sink->last_taken;
+        sink->taken_any = true;
+        sink->last_taken = frame->number;
+    }
+    return frame;
 }
 
-u8 lo(u16 val) {
-    return val & 0xFF;
+void release_frame(Frame *frame) {
+    atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_release);
 }
 
-void set_bc(CPU *cpu, u16 val) {
-    cpu->b = hi(val);
-    cpu->c = lo(val);
-}
+// Hands the back buffer to every sink without copying and picks a frame
+// nobody holds as the next back buffer.
+void publish_frame(GPU *gpu) {
+    Frame *frame = gpu->back;
+    frame->number = gpu->frame_count++;
+    frame->first_number = gpu->latest && !gpu->picture_changed
+        ? gpu->latest->first_number : frame->number;
+    gpu->picture_changed = false;
+    atomic_store(&frame->refs, 1 + gpu->sink_count);
+    if (gpu->latest) {
+        release_frame(gpu->latest);
+    }
+    gpu->latest = frame;
+    for (int i = 0; i < gpu->sink_count; i++) {
+        FrameSink *sink = gpu->sinks[i];
+        Frame *dropped = atomic_exchange(&sink->mailbox, frame);
+        if (dropped) {
+            release_frame(dropped);
+        }
+        if (sink->wakes) {
+            u64 one = 1;
+            ssize_t written = write(sink->wake_fd, &one, sizeof(one));
+            (void) written;
+        }
+    }
 
-void set_de(CPU *cpu, u16 val) {
-    cpu->d = hi(val);
-    cpu->e = lo(val);
+    gpu->back = NULL;
+    for (int i = 0; i < frame_pool_len; i++) {
+        if (atomic_load_explicit(&gpu->frames[i].refs, memory_order_acquire) == 0) {
+            gpu->back = &gpu->frames[i];
+            break;
+        }
+    }
+    // Each sink holds at most two frames, so the pool can't run dry
+    assert(gpu->back);
 }
 
-void set_hl(CPU *cpu, u16 val) {
-    cpu->h = hi(val);
-    cpu->l = lo(val);
+void schedule_at(CPU *cpu, Event event, u64 time) {
+    cpu->event_time[event] = time;
+    if (time < cpu->next_event) {
+        cpu->next_event = time;
+    }
 }
 
-void set_af(CPU *cpu, u16 val) {
-    cpu->a = hi(val);
-    cpu->f = lo(val) & 0xF0;
+void schedule(CPU *cpu, Event event, u64 delay) {
+    schedule_at(cpu, event, cpu->cycles + delay);
 }
 
-
-void set_dereference_bc(CPU *cpu, u8 val) {
-    set_memory(cpu, bc(cpu), val);
+void cancel(CPU *cpu, Event event) {
+    // next_event may now be early, which only costs a spurious run_events()
+    cpu->event_time[event] = never;
 }
 
-void set_dereference_de(CPU *cpu, u8 val) {
-    set_memory(cpu, de(cpu), val);
+// Reference decoder, one pixel at a time. Bit 7 of each plane is the
+// leftmost pixel.
+void decode_tile_row_scalar(u8 lo_pixels, u8 hi_pixels, u8 *out) {
+    for (int c = 0; c < 8; c++) {
+        u8 lo = (lo_pixels >> (7 - c)) & 0x1;
+        u8 hi = (hi_pixels >> (7 - c)) & 0x1;
+        out[c] = (hi << 1) | lo;
+    }
 }
 
-void set_dereference_hl(CPU *cpu, u8 val) {
-    set_memory(cpu, hl(cpu), val);
+#if defined(__x86_64__)
+// Deposits each plane bit into its own byte, then reverses the byte order
+// so bit 7 lands in out[0]
+__attribute__((target("bmi2")))
+void decode_tile_row_pdep(u8 lo_pixels, u8 hi_pixels, u8 *out) {
+    u64 lo = _pdep_u64(lo_pixels, 0x0101010101010101);
+    u64 hi = _pdep_u64(hi_pixels, 0x0101010101010101);
+    u64 pixels = __builtin_bswap64(lo | (hi << 1));
+    memcpy(out, &pixels, 8);
 }
+#endif
 
-u8 dereference_bc(CPU *cpu) {
-    return memory(cpu, bc(cpu));
-}
+// Picked for the host by init_decoders()
+void (*decode_tile_row)(u8 lo_pixels, u8 hi_pixels, u8 *out) = decode_tile_row_scalar;
 
-u8 dereference_de(CPU *cpu) {
-    return memory(cpu, de(cpu));
+// Decodes count tile rows, given as separate bitplane arrays, into
+// count * 8 consecutive pixels. The vector paths broadcast each plane byte
+// across 8 lanes and test one bit per lane, so no per-pixel shifting is
+// needed.
+void decode_tile_rows_default(const u8 *lo, const u8 *hi, int count, u8 *out) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i bits = _mm_set1_epi64x(0x0102040810204080);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi8(2);
+    for (; i + 2 <= count; i += 2) {
+        __m128i l = _mm_set_epi64x(0x0101010101010101 * lo[i + 1],
+                                   0x0101010101010101 * lo[i]);
+        __m128i h = _mm_set_epi64x(0x0101010101010101 * hi[i + 1],
+                                   0x0101010101010101 * hi[i]);
+        l = _mm_cmpeq_epi8(_mm_and_si128(l, bits), bits);
+        h = _mm_cmpeq_epi8(_mm_and_si128(h, bits), bits);
+        __m128i pixels = _mm_or_si128(_mm_and_si128(l, one),
+                                      _mm_and_si128(h, two));
+        _mm_storeu_si128((__m128i *) (out + i * 8), pixels);
+    }
+#endif
+    for (; i < count; i++) {
+        decode_tile_row(lo[i], hi[i], out + i * 8);
+    }
 }
 
-u8 dereference_hl(CPU *cpu) {
-    return memory(cpu, hl(cpu));
+#if defined(__x86_64__)
+// Four rows at a time, leaving the rest to the default path
+__attribute__((target("avx2")))
+void decode_tile_rows_avx2(const u8 *lo, const u8 *hi, int count, u8 *out) {
+    const __m256i bits = _mm256_set1_epi64x(0x0102040810204080);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi8(2);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i l = _mm256_setr_epi64x(0x0101010101010101 * lo[i],
+                                       0x0101010101010101 * lo[i + 1],
+                                       0x0101010101010101 * lo[i + 2],
+                                       0x0101010101010101 * lo[i + 3]);
+        __m256i h = _mm256_setr_epi64x(0x0101010101010101 * hi[i],
+                                       0x0101010101010101 * hi[i + 1],
+                                       0x0101010101010101 * hi[i + 2],
+                                       0x0101010101010101 * hi[i + 3]);
+        l = _mm256_cmpeq_epi8(_mm256_and_si256(l, bits), bits);
+        h = _mm256_cmpeq_epi8(_mm256_and_si256(h, bits), bits);
+        __m256i pixels = _mm256_or_si256(_mm256_and_si256(l, one),
+                                         _mm256_and_si256(h, two));
+        _mm256_storeu_si256((__m256i *) (out + i * 8), pixels);
+    }
+    decode_tile_rows_default(lo + i, hi + i, count - i, out + i * 8);
 }
+#endif
 
-void set_z(CPU *cpu, bool val) {
-    cpu->f = (cpu->f & ~Z_MASK) | (val << Z_INDEX);
-    assert((cpu->f & 0xF) == 0);
-}
+void (*decode_tile_rows)(const u8 *lo, const u8 *hi, int count, u8 *out) = decode_tile_rows_default;
 
-void set_n(CPU *cpu, bool val) {
-    cpu->f = (cpu->f & ~N_MASK) | (val << N_INDEX);
-    assert((cpu->f & 0xF) == 0);
+// Builds don't assume anything past the baseline instruction set, so the
+// bmi2 and avx2 kernels are picked at startup on hosts that have them.
+// pdep is microcoded, and slower than the plain loop, before Zen 3.
+__attribute__((constructor))
+void init_decoders() {
+    decode_tile_row = decode_tile_row_scalar;
+    decode_tile_rows = decode_tile_rows_default;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("bmi2") && !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2")) {
+        decode_tile_row = decode_tile_row_pdep;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        decode_tile_rows = decode_tile_rows_avx2;
+    }
+#endif
 }
 
-void set_h(CPU *cpu, bool val) {
-    cpu->f = (cpu->f & ~H_MASK) | (val << H_INDEX);
-    assert((cpu->f & 0xF) == 0);
+// Checks the decoders as they are currently picked against the scalar one,
+// on every row and on random planes for every count a line can need.
+// Returns how many differ.
+int check_decoders(const char *name) {
+    int differences = 0;
+    for (int planes = 0; planes < 0x10000; planes++) {
+        u8 out[8];
+        u8 expected[8];
+        decode_tile_row(planes, planes >> 8, out);
+        decode_tile_row_scalar(planes, planes >> 8, expected);
+        if (memcmp(out, expected, sizeof(out)) != 0) {
+            printf("%s: row %02x %02x differs\n", name, planes & 0xff, planes >> 8);
+            differences++;
+        }
+    }
+    u64 rng = 0x9e3779b97f4a7c15;
+    for (int round = 0; round < 10000; round++) {
+        int count = round % 22;
+        u8 lo[21];
+        u8 hi[21];
+        for (int i = 0; i < count; i++) {
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            lo[i] = rng;
+            hi[i] = rng >> 8;
+        }
+        // The byte past the end must be left alone
+        u8 out[21 * 8 + 1];
+        u8 expected[21 * 8 + 1];
+        memset(out, 0xaa, sizeof(out));
+        memset(expected, 0xaa, sizeof(expected));
+        decode_tile_rows(lo, hi, count, out);
+        for (int i = 0; i < count; i++) {
+            decode_tile_row_scalar(lo[i], hi[i], expected + i * 8);
+        }
+        if (memcmp(out, expected, sizeof(out)) != 0) {
+            printf("%s: count %d differs\n", name, count);
+            differences++;
+        }
+    }
+    return differences;
 }
 
-void set_c(CPU *cpu, bool val) {
-    cpu->f = (cpu->f & ~C_MASK) | (val << C_INDEX);
-    assert((cpu->f & 0xF) == 0);
+// Checks every kernel the host can run, not just the ones picked for it.
+// Returns 0 if they all agree with the scalar decoder.
+int check_decode() {
+    int differences = 0;
+    decode_tile_row = decode_tile_row_scalar;
+    decode_tile_rows = decode_tile_rows_default;
+    differences += check_decoders("default");
+    printf("checked default\n");
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("bmi2")) {
+        decode_tile_row = decode_tile_row_pdep;
+        differences += check_decoders("bmi2");
+        decode_tile_row = decode_tile_row_scalar;
+        printf("checked bmi2\n");
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        decode_tile_rows = decode_tile_rows_avx2;
+        differences += check_decoders("avx2");
+        printf("checked avx2\n");
+    }
+#endif
+    init_decoders();
+    printf("decode %s\n", differences ? "differs" : "matches");
+    return differences != 0;
 }
 
-void xor(CPU *cpu, u8 val) {
-    cpu->a ^= val;
-    if (cpu->a == 0) {
-        set_z(cpu, 1);
-    } else {
-        set_z(cpu, 0);
+// Decodes `count` consecutive tiles of a map row (wrapping at 32) into out.
+// tile_data and bias select the addressing mode: tile n lives at
+// tile_data + (n ^ bias) * 16, which covers both the unsigned 0x8000 and the
+// signed 0x8800 layout.
+void draw_tiles(u8 *out, const u8 *map_row, int col, int count,
+                const u8 *tile_data, u8 bias, int r) {
+    u8 lo[32];
+    u8 hi[32];
+    for (int i = 0; i < count; i++) {
+        u8 tile = map_row[(col + i) & 31];
+        const u8 *pixels = tile_data + (tile ^ bias) * 16 + r * 2;
+        lo[i] = pixels[0];
+        hi[i] = pixels[1];
     }
+    decode_tile_rows(lo, hi, count, out);
 }
 
-void bit(CPU *cpu, int n, u8 val) {
-    u8 res = cpu->h & (1 << n);
-    set_z(cpu, res == 0);
-    set_n(cpu, 0);
-    set_h(cpu, 1);
+// Where offset lives in a machine's blocks. Vram, oam and the lcd
+// registers each sit inside one block, so pointers can be walked from here.
+const u8 *block_at(const u8 *const *blocks, u32 offset) {
+    return blocks[offset >> block_bits] + (offset & (block_size - 1));
 }
 
-void inc(CPU *cpu, u8 *loc) {
-    u8 half_carry = ((*loc & 0xf) + 1) & 0x10;
-    *loc += 1;
-    set_z(cpu, *loc == 0);
-    set_n(cpu, 0);
-    set_h(cpu, half_carry != 0);
+u8 reverse_bits(u8 b) {
+    b = (b >> 4) | (b << 4);
+    b = ((b & 0xcc) >> 2) | ((b & 0x33) << 2);
+    return ((b & 0xaa) >> 1) | ((b & 0x55) << 1);
 }
 
-void dec(CPU *cpu, u8 *loc) {
-    u8 half_carry = ((*loc & 0xf) - 1) & 0x10;
-    *loc -= 1;
-    set_z(cpu, *loc == 0);
-    set_n(cpu, 1);
-    set_h(cpu, half_carry != 0);
+// Like draw_tiles() for a cgb, where each map entry has an attribute byte
+// at the same place in vram bank 1: palette (bits 0-2), tile bank (3),
+// x and y flip (5, 6) and priority over sprites (7). Always a line and a
+// tile's worth. out gets palette * 4 + color and attributes_out the
+// attributes, per pixel.
+void draw_cgb_tiles(u8 *out, u8 *attributes_out, const u8 *const *blocks,
+                    u16 map_row, int col, u8 lcdc, int r) {
+    u8 lo[screen_width / 8 + 1];
+    u8 hi[screen_width / 8 + 1];
+    u8 attributes[screen_width / 8 + 1];
+    int count = screen_width / 8 + 1;
+    for (int i = 0; i < count; i++) {
+        u16 entry = map_row + ((col + i) & 31);
+        u8 tile = *block_at(blocks, entry);
+        attributes[i] = *block_at(blocks, entry - 0x8000 + vram_bank_1);
+        u32 data = (attributes[i] & 0x08) ? vram_bank_1 : 0x8000;
+        data += (lcdc & 0x10) ? tile * 16 : 0x1000 + (i8) tile * 16;
+        int row = (attributes[i] & 0x40) ? 7 - r : r;
+        const u8 *pixels = block_at(blocks, data + row * 2);
+        // x flip is done on the bitplanes so the batch decode still applies
+        lo[i] = (attributes[i] & 0x20) ? reverse_bits(pixels[0]) : pixels[0];
+        hi[i] = (attributes[i] & 0x20) ? reverse_bits(pixels[1]) : pixels[1];
+    }
+    decode_tile_rows(lo, hi, count, out);
+    for (int i = 0; i < count; i++) {
+        u64 pixels;
+        memcpy(&pixels, out + i * 8, 8);
+        pixels |= 0x0101010101010101 * ((attributes[i] & 0x07) << 2);
+        memcpy(out + i * 8, &pixels, 8);
+        memset(attributes_out + i * 8, attributes[i], 8);
+    }
 }
 
-void push(CPU *cpu, u16 val) {
-    set_memory(cpu, cpu->sp, lo(val));
-    set_memory(cpu, cpu->sp + 1, hi(val));
-    cpu->sp -= 2;
-}
+// The cgb half of render_line(), once the line is known to need drawing.
+// Lcdc bit 0 no longer hides the background; it lets sprites ignore
+// priority instead.
+void render_cgb_line(GPU *gpu, const u8 *const *blocks, u8 ly, bool window, u8 wl) {
+    u8 lcdc = *block_at(blocks, lcd_control_address);
+    int wx = *block_at(blocks, window_x_address) - 7;
+    u8 index[screen_width];
+    u8 attributes[screen_width];
+    // One spare tile on the end for the fine scroll
+    u8 line[screen_width + 8];
+    u8 line_attributes[screen_width + 8];
 
-u16 pop(CPU *cpu) {
-    cpu->sp += 2;
-    u16 ret = make_u16(memory(cpu, cpu->sp + 1), memory(cpu, cpu->sp));
-    return ret;
-}
+    u8 scx = *block_at(blocks, scroll_x_address);
+    u8 y = *block_at(blocks, scroll_y_address) + ly;
+    u16 bg_map = (lcdc & 0x08) ? 0x9c00 : 0x9800;
+    draw_cgb_tiles(line, line_attributes, blocks, bg_map + (y / 8) * 32, scx / 8,
+                   lcdc, y % 8);
+    memcpy(index, line + scx % 8, screen_width);
+    memcpy(attributes, line_attributes + scx % 8, screen_width);
+    add_video_metric(gpu->metrics.tile_rows, screen_width / 8 + 1);
 
-void rla(CPU *cpu) {
-    u8 carry = cpu->a & 0x80;
-    cpu->a <<= 1;
-    cpu->a |= c(cpu);
-    set_z(cpu, 0);
-    set_n(cpu, 0);
-    set_h(cpu, 0);
-    set_c(cpu, carry != 0);
-}
+    if (window) {
+        u16 window_map = (lcdc & 0x40) ? 0x9c00 : 0x9800;
+        draw_cgb_tiles(line, line_attributes, blocks, window_map + (wl / 8) * 32, 0,
+                       lcdc, wl % 8);
+        add_video_metric(gpu->metrics.tile_rows, screen_width / 8 + 1);
+        int skip = wx < 0 ? -wx : 0;
+        int start = wx < 0 ? 0 : wx;
+        memcpy(index + start, line + skip, screen_width - start);
+        memcpy(attributes + start, line_attributes + skip, screen_width - start);
+    }
 
-void rl(CPU *cpu, u8 *loc) {
-    u8 carry = *loc & 0x80;
-    *loc <<= 1;
-    *loc |= c(cpu);
-    set_z(cpu, *loc == 0);
-    set_n(cpu, 0);
-    set_h(cpu, 0);
-    set_c(cpu, carry != 0);
+    if (lcdc & 0x02) {
+        // The first ten sprites in OAM order that cover this line, which is
+        // also their priority order on a cgb
+        const u8 *oam = block_at(blocks, oam_address);
+        int height = (lcdc & 0x04) ? 16 : 8;
+        bool taken[screen_width] = {false};
+        int count = 0;
+        for (int i = 0; i < 40 && count < 10; i++) {
+            const u8 *sprite = oam + i * 4;
+            int r = ly - (sprite[0] - 16);
+            if (r < 0 || r >= height) {
+                continue;
+            }
+            count++;
+            int x = sprite[1] - 8;
+            u8 tile = sprite[2];
+            u8 sprite_attributes = sprite[3];
+            if (sprite_attributes & 0x40) {
+                r = height - 1 - r;
+            }
+            if (height == 16) {
+                tile &= 0xfe;
+            }
+            u32 data = (sprite_attributes & 0x08) ? vram_bank_1 : 0x8000;
+            const u8 *pixels = block_at(blocks, data + tile * 16 + r * 2);
+            u8 row[8];
+            decode_tile_row(pixels[0], pixels[1], row);
+            u8 palette = 8 + (sprite_attributes & 0x07);
+            for (int c = 0; c < 8; c++) {
+                int px = x + c;
+                u8 color = row[(sprite_attributes & 0x20) ? 7 - c : c];
+                if (px < 0 || px >= screen_width || taken[px] || color == 0) {
+                    continue;
+                }
+                taken[px] = true;
+                if ((lcdc & 0x01) && (index[px] & 3)
+                    && ((sprite_attributes | attributes[px]) & 0x80)) {
+                    continue;
+                }
+                index[px] = palette * 4 + color;
+            }
+        }
+    }
+
+    u8 *shades = gpu->back->shades[ly];
+    u32 *pixels = gpu->back->pixels[ly];
+    for (int x = 0; x < screen_width; x++) {
+        shades[x] = gpu->cgb_shades[index[x]];
+        pixels[x] = gpu->cgb_colors[index[x]];
+    }
 }
 
-u8 add(CPU *cpu, u8 val) {
-    u8 res = cpu->a + val;
-    u8 half_carry = (cpu->a & 0xf) + (val & 0xf);
-    set_z(cpu, res == 0);
-    set_n(cpu, 0);
-    set_h(cpu, (half_carry & 0x10) != 0);
-    set_c(cpu, cpu->a > 0xff - val);
-    return res;
+bool same_inputs(const LineInputs *a, const LineInputs *b) {
+    return a->video_writes == b->video_writes && a->window_line == b->window_line
+        && memcmp(a->registers, b->registers, sizeof(a->registers)) == 0;
 }
 
-u8 sub(CPU *cpu, u8 val) {
-    u8 res = cpu->a - val;
-    set_z(cpu, res == 0);
-    set_n(cpu, 1);
-    set_h(cpu, (cpu->a & 0xf) < (val & 0xf));
-    set_c(cpu, cpu->a < val);
-    return res;
+void render_line(GPU *gpu, const u8 *const *blocks, u8 ly) {
+    u8 lcdc = *block_at(blocks, lcd_control_address);
+    u8 wy = *block_at(blocks, window_y_address);
+    int wx = *block_at(blocks, window_x_address) - 7;
+    // palette * 4 + color for every pixel, bg palette being 0
+    u8 index[screen_width];
+
+    if (ly == 0) {
+        gpu->window_line = 0;
+    }
+    add_video_metric(gpu->metrics.lines, 1);
+
+    LineInputs *inputs = &gpu->back->inputs[ly];
+    *inputs = (LineInputs) {
+        .video_writes = gpu->video_writes,
+        .registers = {lcdc, *block_at(blocks, scroll_y_address),
+                      *block_at(blocks, scroll_x_address), wy, wx + 7,
+                      *block_at(blocks, palette_address),
+                      *block_at(blocks, obj_palette_0_address),
+                      *block_at(blocks, obj_palette_1_address)},
+        .window_line = gpu->window_line,
+    };
+    // On a cgb lcdc bit 0 doesn't turn the window off
+    u8 window_bits = gpu->cgb ? 0x20 : 0x21;
+    bool window = (lcdc & window_bits) == window_bits && ly >= wy && wx < screen_width;
+    if (window) {
+        gpu->window_line += 1;
+    }
+    if (gpu->latest && same_inputs(inputs, &gpu->latest->inputs[ly])) {
+        memcpy(gpu->back->shades[ly], gpu->latest->shades[ly], sizeof(gpu->back->shades[ly]));
+        memcpy(gpu->back->pixels[ly], gpu->latest->pixels[ly], sizeof(gpu->back->pixels[ly]));
+        add_video_metric(gpu->metrics.reused_lines, 1);
+        return;
+    }
+    gpu->picture_changed = true;
+    if (gpu->cgb) {
+        render_cgb_line(gpu, blocks, ly, window, inputs->window_line);
+        return;
+    }
+
+    if ((lcdc & 0x01) == 0) {
+        memset(index, 0, screen_width);
+    } else {
+        // Everything that depends on lcdc is resolved once for the whole line
+        const u8 *tile_data = block_at(blocks, (lcdc & 0x10) ? 0x8000 : 0x8800);
+        u8 bias = (lcdc & 0x10) ? 0x00 : 0x80;
+        const u8 *bg_map = block_at(blocks, (lcdc & 0x08) ? 0x9c00 : 0x9800);
+        const u8 *window_map = block_at(blocks, (lcdc & 0x40) ? 0x9c00 : 0x9800);
+
+        // One spare tile on the end for the fine scroll
+        u8 line[screen_width + 8];
+
+        u8 scx = *block_at(blocks, scroll_x_address);
+        u8 y = *block_at(blocks, scroll_y_address) + ly;
+        draw_tiles(line, bg_map + (y / 8) * 32, scx / 8, screen_width / 8 + 1,
+                   tile_data, bias, y % 8);
+        memcpy(index, line + scx % 8, screen_width);
+        add_video_metric(gpu->metrics.tile_rows, screen_width / 8 + 1);
+
+        if (window) {
+            u8 wl = inputs->window_line;
+            draw_tiles(line, window_map + (wl / 8) * 32, 0, screen_width / 8 + 1,
+                       tile_data, bias, wl % 8);
+            add_video_metric(gpu->metrics.tile_rows, screen_width / 8 + 1);
+            if (wx >= 0) {
+                memcpy(index + wx, line, screen_width - wx);
+            } else {
+                memcpy(index, line - wx, screen_width);
+            }
+        }
+    }
+
+    if (lcdc & 0x02) {
+        // The first ten sprites in OAM order that cover this line
+        const u8 *oam = block_at(blocks, oam_address);
+        int height = (lcdc & 0x04) ? 16 : 8;
+        const u8 *sprites[10];
+        int count = 0;
+        for (int i = 0; i < 40 && count < 10; i++) {
+            int top = oam[i * 4] - 16;
+            if (ly >= top && ly < top + height) {
+                sprites[count++] = oam + i * 4;
+            }
+        }
+        // Smaller x wins, then lower OAM index
+        for (int i = 1; i < count; i++) {
+            const u8 *sprite = sprites[i];
+            int j = i;
+            for (; j > 0 && sprites[j - 1][1] > sprite[1]; j--) {
+                sprites[j] = sprites[j - 1];
+            }
+            sprites[j] = sprite;
+        }
+
+        bool taken[screen_width] = {false};
+        for (int i = 0; i < count; i++) {
+            const u8 *sprite = sprites[i];
+            int x = sprite[1] - 8;
+            u8 tile = sprite[2];
+            u8 attributes = sprite[3];
+            int r = ly - (sprite[0] - 16);
+            if (attributes & 0x40) {
+                r = height - 1 - r;
+            }
+            if (height == 16) {
+                tile &= 0xfe;
+            }
+            const u8 *pixels = block_at(blocks, 0x8000 + tile * 16 + r * 2);
+            u8 row[8];
+            decode_tile_row(pixels[0], pixels[1], row);
+            u8 palette = (attributes & 0x10) ? 2 : 1;
+            for (int c = 0; c < 8; c++) {
+                int px = x + c;
+                u8 color = row[(attributes & 0x20) ? 7 - c : c];
+                if (px < 0 || px >= screen_width || taken[px] || color == 0) {
+                    continue;
+                }
+                // The highest priority opaque sprite owns the pixel even if
+                // it then loses to the background
+                taken[px] = true;
+                if ((attributes & 0x80) && index[px] != 0) {
+                    continue;
+                }
+                index[px] = palette * 4 + color;
+            }
+        }
+    }
+
+    u8 *shades = gpu->back->shades[ly];
+    u32 *pixels = gpu->back->pixels[ly];
+    for (int x = 0; x < screen_width; x++) {
+        shades[x] = gpu->shades[index[x]];
+        pixels[x] = gpu->colors[index[x]];
+    }
 }
 
-void cb_prefix(CPU *cpu) {
-    u8 byte = memory(cpu, cpu->pc);
-    printf("  %02x\n", byte);
-    cpu->pc += 1;
-    switch (byte) {
-        case 0x10: {
-            rl(cpu, &cpu->b);
-            break;
+void present_frame(FrameSink *sink) {
+    Frame *frame = take_frame(sink);
+    if (!frame) {
+        return;
+    }
+    if (sink->unchanged) {
+        // Already on the terminal
+        release_frame(frame);
+        return;
+    }
+    bool print = false;
+    for (int i = 0; i < screen_height; i++) {
+        for (int j = 0; j < screen_width; j++) {
+            if (frame->shades[i][j]) print = true;
         }
-        case 0x11: {
-            rl(cpu, &cpu->c);
-            break;
+    }
+
+    if (print) {
+        for (int i = 0; i < screen_height; i++) {
+            for (int j = 0; j < screen_width; j++) {
+                u8 pix = frame->shades[i][j];
+                char disp[] = {' ', '.', 'O', '#'};
+                printf("%c", disp[pix]);
+            }
+            printf("\n");
         }
-        case 0x12: {
-            rl(cpu, &cpu->d);
-            break;
+    }
+    release_frame(frame);
+}
+
+typedef struct RenderThread {
+    RenderQueue queue;
+    GPU gpu;
+    // The render thread's own copy of vram, oam and the lcd registers, kept
+    // at the same offsets so render_line() can't tell the difference
+    u8 memory[memory_len];
+    const u8 *blocks[block_count];
+    atomic_bool quit;
+    pthread_t thread;
+} RenderThread;
+
+// Vram and oam, the memory lines are drawn from
+bool is_tile_memory(u32 offset) {
+    return (offset >= 0x8000 && offset <= 0x9fff)
+        || (offset >= oam_address && offset < oam_address + oam_len)
+        || (offset >= vram_bank_1 && offset < vram_bank_1 + 0x2000);
+}
+
+bool is_video_address(u16 address) {
+    return (address >= 0x8000 && address <= 0x9fff)
+        || (address >= oam_address && address < oam_address + oam_len)
+        || (address >= lcd_control_address && address <= window_x_address);
+}
+
+void flush_commands(RenderQueue *queue) {
+    atomic_store_explicit(&queue->head, queue->pending, memory_order_release);
+}
+
+void queue_command(RenderQueue *queue, RenderCommandKind kind, u16 address, u8 val) {
+    size_t head = queue->pending;
+    if (head - atomic_load_explicit(&queue->tail, memory_order_acquire) == render_queue_len) {
+        // Only wait once the renderer has seen everything we have
+        flush_commands(queue);
+        while (head - atomic_load_explicit(&queue->tail, memory_order_acquire) == render_queue_len) {
+            sched_yield();
         }
-        case 0x13: {
-            rl(cpu, &cpu->e);
+    }
+    queue->commands[head % render_queue_len] = (RenderCommand) {kind, val, address};
+    queue->pending = head + 1;
+}
+
+void replay(RenderThread *rt, RenderCommand command) {
+    switch (command.kind) {
+        case RENDER_WRITE:
+        case RENDER_WRITE_BANK_1: {
+            u32 offset = command.address;
+            if (command.kind == RENDER_WRITE_BANK_1) {
+                offset += vram_bank_1 - 0x8000;
+            }
+            if (rt->memory[offset] != command.val && is_tile_memory(offset)) {
+                rt->gpu.video_writes++;
+            }
+            rt->memory[offset] = command.val;
+            if (offset >= palette_address && offset <= obj_palette_1_address) {
+                update_palette(&rt->gpu, offset - palette_address, command.val);
+            } else if (offset >= bcps_address && offset <= ocpd_address) {
+                cgb_palette_write(&rt->gpu, offset, command.val);
+            }
             break;
         }
-        case 0x14: {
-            rl(cpu, &cpu->h);
+        case RENDER_LINE: {
+            render_line(&rt->gpu, rt->blocks, command.val);
             break;
         }
-        case 0x15: {
-            rl(cpu, &cpu->l);
+        case RENDER_FRAME: {
+            publish_frame(&rt->gpu);
             break;
         }
-        case 0x16: {
-            u8 val = dereference_hl(cpu);
-            rl(cpu, &val);
-            set_memory(cpu, hl(cpu), val);
-            break;
+    }
+}
+
+void *render_thread_main(void *arg) {
+    RenderThread *rt = arg;
+    RenderQueue *queue = &rt->queue;
+    size_t tail = 0;
+    int idle = 0;
+    while (!atomic_load(&rt->quit)) {
+        size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (head == tail) {
+            // Lines arrive in bursts; back off rather than burn the core
+            if (++idle < 64) {
+                sched_yield();
+            } else {
+                usleep(50);
+            }
+            continue;
         }
-        case 0x17: {
-            rl(cpu, &cpu->a);
-            break;
+        idle = 0;
+        for (; tail != head; tail++) {
+            replay(rt, queue->commands[tail % render_queue_len]);
         }
-        case 0x78: {
-            bit(cpu, 7, cpu->b);
-            break;
+        atomic_store_explicit(&queue->tail, tail, memory_order_release);
+    }
+    return NULL;
+}
+
+void remap(CPU *cpu);
+
+// A block with one reference, held by the caller
+Block *new_block() {
+    Block *block = malloc(sizeof(Block));
+    assert(block);
+    atomic_init(&block->refs, 1);
+    block->mapped = false;
+    return block;
+}
+
+void release_block(Block *block) {
+    if (atomic_fetch_sub_explicit(&block->refs, 1, memory_order_acq_rel) == 1) {
+        if (block->mapped) {
+            munmap(block, sizeof(Block));
+        } else {
+            free(block);
         }
-        case 0x79: {
-            bit(cpu, 7, cpu->c);
-            break;
+    }
+}
+
+void map_page(CPU *cpu, u8 page);
+
+// Where a page's bytes live, which only differs from the page itself for
+// echo ram and the banks a cgb has switched in
+u32 page_base(CPU *cpu, u8 page) {
+    if (page >= 0xe0 && page < 0xfe) {
+        // echo of 0xc000-0xddff
+        page -= 0x20;
+    }
+    if (page >= 0x80 && page < 0xa0 && cpu->vram_bank) {
+        return vram_bank_1 + ((page - 0x80) << 8);
+    }
+    if (page >= 0xd0 && page < 0xe0 && cpu->wram_bank > 1) {
+        return wram_banks + (cpu->wram_bank - 2) * 0x1000 + ((page - 0xd0) << 8);
+    }
+    return page << 8;
+}
+
+// Makes sure cpu holds the only reference to a block it's about to write
+void own_block(CPU *cpu, int i) {
+    if (!(cpu->shared_blocks & (1 << i))) {
+        return;
+    }
+    cpu->shared_blocks &= ~(1 << i);
+    Block *block = cpu->blocks[i];
+    if (atomic_load_explicit(&block->refs, memory_order_acquire) == 1) {
+        // Everyone else has let go already
+        return;
+    }
+    Block *copy = new_block();
+    memcpy(copy->bytes, block->bytes, block_size);
+    cpu->blocks[i] = copy;
+    release_block(block);
+    // The maps still point into the shared block
+    for (int page = 0; page < 0x100; page++) {
+        if (page_base(cpu, page) >> block_bits == i) {
+            map_page(cpu, page);
         }
-        case 0x7a: {
-            bit(cpu, 7, cpu->d);
-            break;
+    }
+}
+
+// Reads one byte of the machine's memory directly, without the bus
+u8 load(CPU *cpu, u32 offset) {
+    return cpu->blocks[offset >> block_bits]->bytes[offset & (block_size - 1)];
+}
+
+// Moves drawing for cpu onto a new thread. Frames are then published on the
+// returned thread's gpu instead of cpu->gpu.
+RenderThread *start_render_thread(CPU *cpu) {
+    RenderThread *rt = calloc(1, sizeof(RenderThread));
+    assert(rt);
+    for (int i = 0; i < block_count; i++) {
+        memcpy(rt->memory + i * block_size, cpu->blocks[i]->bytes, block_size);
+        rt->blocks[i] = rt->memory + i * block_size;
+    }
+    init_gpu(&rt->gpu);
+    for (int i = 0; i < 3; i++) {
+        update_palette(&rt->gpu, i, load(cpu, palette_address + i));
+    }
+    rt->gpu.cgb = cpu->gpu.cgb;
+    memcpy(rt->gpu.cgb_palettes, cpu->gpu.cgb_palettes, sizeof(rt->gpu.cgb_palettes));
+    memcpy(rt->gpu.cgb_palette_index, cpu->gpu.cgb_palette_index, sizeof(rt->gpu.cgb_palette_index));
+    for (int i = 0; i < 64; i++) {
+        update_cgb_color(&rt->gpu, i / 32, i % 32);
+    }
+    atomic_init(&rt->queue.head, 0);
+    atomic_init(&rt->queue.tail, 0);
+    atomic_init(&rt->quit, false);
+    cpu->render_queue = &rt->queue;
+    // vram and oam writes now have to be logged
+    remap(cpu);
+    int err = pthread_create(&rt->thread, NULL, render_thread_main, rt);
+    if (err) {
+        fprintf(stderr, "render thread: %s\n", strerror(err));
+        exit(1);
+    }
+    return rt;
+}
+
+// splitmix64's finalizer
+u64 mix64(u64 x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+// Page hashes are plain sums of these, so a store only has to swap one term
+// for another
+u64 hash_byte(u32 offset, u8 val) {
+    return mix64(((u64) offset << 8) | val);
+}
+
+// Writes one byte of the machine's memory, keeping the hashes current.
+// Anything that changes a block goes through here or own_block().
+void store(CPU *cpu, u32 offset, u8 val) {
+    own_block(cpu, offset >> block_bits);
+    u8 *byte = &cpu->blocks[offset >> block_bits]->bytes[offset & (block_size - 1)];
+    u64 delta = hash_byte(offset, val) - hash_byte(offset, *byte);
+    cpu->page_hash[offset >> 8] += delta;
+    cpu->memory_hash += delta;
+    if (*byte != val && is_tile_memory(offset)) {
+        cpu->gpu.video_writes++;
+    }
+    *byte = val;
+}
+
+// Copies len bytes into one page as that many store()s would
+void store_bytes(CPU *cpu, u32 offset, const u8 *src, int len) {
+    own_block(cpu, offset >> block_bits);
+    u8 *bytes = &cpu->blocks[offset >> block_bits]->bytes[offset & (block_size - 1)];
+    if (memcmp(bytes, src, len) == 0) {
+        return;
+    }
+    u64 delta = 0;
+    for (int i = 0; i < len; i++) {
+        delta += hash_byte(offset + i, src[i]) - hash_byte(offset + i, bytes[i]);
+    }
+    cpu->page_hash[offset >> 8] += delta;
+    cpu->memory_hash += delta;
+    if (is_tile_memory(offset)) {
+        cpu->gpu.video_writes++;
+    }
+    memcpy(bytes, src, len);
+}
+
+// Recomputes one page's hash after a bulk copy
+void rehash_page(CPU *cpu, u16 page) {
+    u64 hash = 0;
+    for (int i = 0; i < 0x100; i++) {
+        hash += hash_byte((page << 8) | i, load(cpu, (page << 8) | i));
+    }
+    cpu->memory_hash += hash - cpu->page_hash[page];
+    cpu->page_hash[page] = hash;
+}
+
+void rehash_memory(CPU *cpu) {
+    // Whatever was bulk copied in may have touched vram
+    cpu->gpu.video_writes++;
+    cpu->memory_hash = 0;
+    memset(cpu->page_hash, 0, sizeof(cpu->page_hash));
+    // Only a cgb ever switches the banks in, so they'd just be constant
+    // terms otherwise
+    int pages = cpu->cgb ? memory_len >> 8 : 0x100;
+    for (int page = 0; page < pages; page++) {
+        rehash_page(cpu, page);
+    }
+}
+
+u64 sram_hash(CPU *cpu) {
+    u64 hash = 0;
+    for (int page = 0xa0; page < 0xc0; page++) {
+        hash += cpu->page_hash[page];
+    }
+    return hash;
+}
+
+// Asks the kernel to write back cartridge ram if it changed since the last
+// flush. At frame boundaries that's just a nudge (MS_ASYNC); when the game
+// turns ram off it has finished saving, so that waits for the disk.
+void flush_save(CPU *cpu, bool sync) {
+    u64 hash = sram_hash(cpu);
+    u64 *flushed = sync ? &cpu->save_synced_hash : &cpu->save_flushed_hash;
+    if (hash != *flushed) {
+        *flushed = hash;
+        msync(cpu->save->bytes, block_size, sync ? MS_SYNC : MS_ASYNC);
+    }
+}
+
+// Fingerprint of registers and memory, for checking determinism and
+// spotting repeated states
+u64 state_hash(CPU *cpu) {
+    u64 regs = ((u64) af(cpu) << 48) | ((u64) bc(cpu) << 32) | ((u64) de(cpu) << 16) | hl(cpu);
+    u64 control = ((u64) cpu->pc << 32) | ((u64) cpu->sp << 16)
+        | (cpu->ime << 2) | (cpu->ei_pending << 1) | cpu->halted;
+    return mix64(cpu->memory_hash ^ mix64(regs) ^ mix64(~control));
+}
+
+void request_interrupt(CPU *cpu, u8 interrupt) {
+    store(cpu, interrupt_flag_address, load(cpu, interrupt_flag_address) | interrupt);
+}
+
+void set_buttons(CPU *cpu, u8 buttons) {
+    if (buttons & ~cpu->buttons) {
+        request_interrupt(cpu, joypad_interrupt);
+    }
+    cpu->buttons = buttons;
+}
+
+// Raises the STAT interrupt for whatever the current line and mode
+// enable, and schedules the hblank one if it is wanted
+void start_line(CPU *cpu, u64 when) {
+    u8 ly = load(cpu, ly_address);
+    u8 stat = load(cpu, lcd_status_address);
+    cpu->line_start = when;
+    bool raise = (stat & 0x40) && ly == load(cpu, ly_compare_address);
+    if (ly < screen_height) {
+        raise |= (stat & 0x20) != 0;
+        if (stat & 0x08) {
+            schedule_at(cpu, EVENT_HBLANK, when + hblank_start_cycles);
         }
-        case 0x7b: {
-            bit(cpu, 7, cpu->e);
-            break;
+        if (cpu->hdma_active) {
+            schedule_at(cpu, EVENT_HDMA, when + hblank_start_cycles);
         }
-        case 0x7c: {
-            bit(cpu, 7, cpu->h);
-            break;
+    } else if (ly == screen_height) {
+        raise |= (stat & 0x10) != 0;
+    }
+    if (raise) {
+        request_interrupt(cpu, lcd_status_interrupt);
+    }
+}
+
+void link_send(Link *link, LinkMessageKind kind, u8 val, u32 length, u64 time) {
+    if (link->closed) {
+        return;
+    }
+    LinkMessage message = {kind, val, length, time};
+    if (link->rx) {
+        LinkRing *ring = link->tx;
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == link_ring_len) {
+            sched_yield();
         }
-        case 0x7d: {
-            bit(cpu, 7, cpu->l);
-            break;
+        ring->messages[head % link_ring_len] = message;
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    } else if (send(link->fd, &message, sizeof(message), MSG_NOSIGNAL) != sizeof(message)) {
+        link->closed = true;
+    }
+}
+
+// Takes the next message, waiting for one if block is set. Returns false
+// if there was none or the other end is gone.
+bool link_next(Link *link, LinkMessage *message, bool block) {
+    if (link->closed) {
+        return false;
+    }
+    if (link->rx) {
+        LinkRing *ring = link->rx;
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+            if (!block) {
+                return false;
+            }
+            sched_yield();
         }
-        case 0x7e: {
-            bit(cpu, 7, dereference_hl(cpu));
+        *message = ring->messages[tail % link_ring_len];
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        return true;
+    }
+    ssize_t len = recv(link->fd, message, sizeof(*message), block ? 0 : MSG_DONTWAIT);
+    if (len == sizeof(*message)) {
+        return true;
+    }
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    link->closed = true;
+    return false;
+}
+
+// Handles one message from the partner, if any. Returns whether it did.
+bool link_receive(CPU *cpu, bool block) {
+    Link *link = cpu->link;
+    LinkMessage message;
+    if (!link_next(link, &message, block)) {
+        return false;
+    }
+    switch (message.kind) {
+        case LINK_TIME: {
+            link->partner_time = message.time;
             break;
         }
-        case 0x7f: {
-            bit(cpu, 7, cpu->a);
+        case LINK_START: {
+            // Shifted in and out as the partner's clock finishes
+            link->partner_time = message.time;
+            link->incoming = message.val;
+            schedule_at(cpu, EVENT_SERIAL_REMOTE, message.time + message.length);
             break;
         }
-        default: {
-            printf("cb prefix not yet implemented: 0x%02x\n", byte);
-            exit(1);
+        case LINK_REPLY: {
+            link->reply_ready = true;
+            link->reply = message.val;
+            break;
         }
     }
+    return true;
 }
 
-void draw(CPU *cpu) {
-    // TODO implement other tile addressing mode, use actual screen on bit here
-    if ((cpu->memory[lcd_control_address] & 0x10) == 0x10) {
-        u8 screen[32*32*8*8];
-        memset(screen, 4, 32 * 32 * 8 * 8);
-        bool print = false;
-        for (int row = 0; row < 32; row++) {
-            for (int col = 0; col < 32; col++) {
-                for (int r = 0; r < 8; r++) {
-                    for (int c = 0; c < 8; c++) {
-                        u8 tile = cpu->memory[0x9800 + row * 32 + col];
-                        u8 lo_pixels = cpu->memory[0x8000 + tile * 2 * 8 + r * 2];
-                        u8 hi_pixels = cpu->memory[0x8000 + tile * 2 * 8 + r * 2 + 1];
-                        u8 lo = (lo_pixels >> (7 - c)) & 0x1;
-                        u8 hi = (hi_pixels >> (7 - c)) & 0x1;
-                        u8 pixel = (hi << 1) | lo;
-                        if (pixel) print = true;
-                        screen[row * 8 * 32 * 8 + col * 8 + r * 8 * 32 + c] = pixel;
-                    }
-                }
+// Keeps the two machines within the lookahead of each other
+void link_sync(CPU *cpu, u64 when) {
+    Link *link = cpu->link;
+    link_send(link, LINK_TIME, 0, 0, cpu->cycles);
+    while (link_receive(cpu, false)) {
+    }
+    while (!link->closed && link->partner_time + link_lookahead < when + link_sync_cycles) {
+        link_receive(cpu, true);
+    }
+    schedule_at(cpu, EVENT_LINK_SYNC, when + link_sync_cycles);
+}
+
+void finish_transfer(CPU *cpu, u8 received) {
+    store(cpu, serial_data_address, received);
+    store(cpu, serial_control_address, load(cpu, serial_control_address) & ~0x80);
+    request_interrupt(cpu, serial_interrupt);
+}
+
+// sc was written with the start and internal clock bits set
+void start_transfer(CPU *cpu) {
+    u8 val = load(cpu, serial_data_address);
+    if (cpu->serial_out) {
+        fputc(val, cpu->serial_out);
+        fflush(cpu->serial_out);
+    }
+    // The clock runs twice as fast at double speed
+    u32 length = serial_cycles >> cpu->double_speed;
+    if (cpu->link) {
+        link_send(cpu->link, LINK_START, val, length, cpu->cycles);
+    }
+    schedule(cpu, EVENT_SERIAL, length);
+}
+
+// The partner's clock finished a byte. It only reaches sb if we were
+// waiting on an external clock; either way the partner gets an answer.
+void end_remote_transfer(CPU *cpu) {
+    u8 sent = 0xff;
+    if ((load(cpu, serial_control_address) & 0x81) == 0x80) {
+        sent = load(cpu, serial_data_address);
+        finish_transfer(cpu, cpu->link->incoming);
+    }
+    link_send(cpu->link, LINK_REPLY, sent, 0, cpu->cycles);
+}
+
+// Our clock finished a byte; whatever the partner shifted back comes in
+void end_transfer(CPU *cpu) {
+    Link *link = cpu->link;
+    u8 received = 0xff;
+    if (link) {
+        // Let the partner catch up to this point so it can answer
+        link_send(link, LINK_TIME, 0, 0, cpu->cycles);
+        while (!link->reply_ready && !link->closed) {
+            link_receive(cpu, true);
+            // The partner may be stuck the same way on a byte it clocked
+            if (cpu->event_time[EVENT_SERIAL_REMOTE] <= cpu->cycles) {
+                cpu->event_time[EVENT_SERIAL_REMOTE] = never;
+                end_remote_transfer(cpu);
             }
         }
+        if (link->reply_ready) {
+            received = link->reply;
+            link->reply_ready = false;
+        }
+    }
+    finish_transfer(cpu, received);
+}
 
-        if (print) {
-            for (int i = 0; i < 32 * 8; i++) {
-                for (int j = 0; j < 32 * 8; j++) {
-                    u8 pix = screen[i * 32 * 8 + j];
-                    char disp[] = {' ', '.', 'O', '#', 'E'};
-                    printf("%c", disp[pix]);
-                }
-                printf("\n");
-            }
+void attach_link(CPU *cpu, Link *link) {
+    cpu->link = link;
+    schedule(cpu, EVENT_LINK_SYNC, link_sync_cycles);
+}
+
+void lcd_on(CPU *cpu) {
+    store(cpu, ly_address, 0);
+    start_line(cpu, cpu->cycles);
+    schedule(cpu, EVENT_RENDER, oam_scan_cycles);
+    schedule(cpu, EVENT_LINE, line_cycles);
+}
+
+void lcd_off(CPU *cpu) {
+    store(cpu, ly_address, 0);
+    cancel(cpu, EVENT_RENDER);
+    cancel(cpu, EVENT_LINE);
+    cancel(cpu, EVENT_HBLANK);
+}
+
+u8 lcd_status(CPU *cpu) {
+    u8 stat = load(cpu, lcd_status_address) & 0x78;
+    u8 ly = load(cpu, ly_address);
+    if (!(load(cpu, lcd_control_address) & 0x80)) {
+        return 0x80 | stat;
+    }
+    if (ly == load(cpu, ly_compare_address)) {
+        stat |= 0x04;
+    }
+    u64 t = cpu->cycles - cpu->line_start;
+    if (ly >= screen_height) {
+        stat |= 1;
+    } else if (t < oam_scan_cycles) {
+        stat |= 2;
+    } else if (t < hblank_start_cycles) {
+        stat |= 3;
+    }
+    return 0x80 | stat;
+}
+
+u64 host_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void count_frame(CPU *cpu) {
+#ifndef NO_METRICS
+    CpuMetrics *metrics = &cpu->metrics;
+    u64 now = host_ns();
+    if (metrics->frames) {
+        u64 ns = now - metrics->frame_start_ns;
+        metrics->last_frame_ns = ns;
+        metrics->total_frame_ns += ns;
+        if (ns > metrics->max_frame_ns) {
+            metrics->max_frame_ns = ns;
         }
     }
+    metrics->frame_start_ns = now;
+    metrics->frames++;
+#endif
 }
 
-CPU cpu;
+// Forked machines only get a frame pool once they draw
+void ensure_frame_pool(GPU *gpu) {
+    if (!gpu->frames) {
+        gpu->frames = calloc(frame_pool_len, sizeof(Frame));
+        assert(gpu->frames);
+        gpu->back = gpu->frames;
+    }
+}
 
-int main() {
-    FILE *f = fopen("tetris.gb", "r");
-    assert(fread(rom, 1, rom_len, f) == rom_len);
-    assert(fclose(f) == 0);
+void next_line(CPU *cpu, u64 when) {
+    u8 ly = (load(cpu, ly_address) + 1) % lines_per_frame;
+    store(cpu, ly_address, ly);
+    if (ly == screen_height) {
+        if (cpu->skip_render) {
+            // Nothing was drawn
+        } else if (cpu->render_queue) {
+            queue_command(cpu->render_queue, RENDER_FRAME, 0, 0);
+            flush_commands(cpu->render_queue);
+        } else {
+            ensure_frame_pool(&cpu->gpu);
+            publish_frame(&cpu->gpu);
+        }
+        cpu->frame_done = true;
+        if (cpu->save) {
+            flush_save(cpu, false);
+        }
+        count_frame(cpu);
+        request_interrupt(cpu, vblank_interrupt);
+    }
+    start_line(cpu, when);
+    if (ly < screen_height) {
+        schedule_at(cpu, EVENT_RENDER, when + oam_scan_cycles);
+    }
+    schedule_at(cpu, EVENT_LINE, when + line_cycles);
+}
 
-    bool stopped = false;
+void draw_line(CPU *cpu) {
+    u8 ly = load(cpu, ly_address);
+    if (cpu->skip_render) {
+        return;
+    }
+    if (cpu->render_queue) {
+        // Publishing once per line keeps the atomics off the write path
+        queue_command(cpu->render_queue, RENDER_LINE, 0, ly);
+        flush_commands(cpu->render_queue);
+    } else {
+        const u8 *blocks[block_count];
+        for (int i = 0; i < block_count; i++) {
+            blocks[i] = cpu->blocks[i]->bytes;
+        }
+        ensure_frame_pool(&cpu->gpu);
+        render_line(&cpu->gpu, blocks, ly);
+    }
+}
 
-    init_cpu(&cpu);
-    while (true) {
-        draw(&cpu);
-
-        u8 byte = memory(&cpu, cpu.pc);
-        dump_regs(&cpu);
-        if (cpu.pc == 0x100) {
-            stopped = true;
-        }
-        if (stopped) {
-            char *prompt = readline("> ");
-            if (!prompt) exit(0);
-            if (strcmp(prompt, "c") == 0)
-                stopped = false;
-        }
-        printf("Running %02x [%04x]\n", byte, cpu.pc);
-        cpu.pc += 1;
-        switch (byte) {
-            case 0x01: {
-                u16 arg = parse_u16(&cpu);
-                set_bc(&cpu, arg);
-                break;
-            }
-            case 0x02: {
-                set_dereference_bc(&cpu, cpu.a);
-                break;
-            }
-            case 0x03: {
-                set_bc(&cpu, bc(&cpu) + 1);
-                break;
-            }
-            case 0x04: {
-                inc(&cpu, &cpu.b);
-                break;
-            }
-            case 0x05: {
-                dec(&cpu, &cpu.b);
-                break;
-            }
-            case 0x06: {
-                u8 arg = parse_u8(&cpu);
-                cpu.b = arg;
-                break;
-            }
-            case 0x0a: {
-                cpu.a = dereference_bc(&cpu);
-                break;
-            }
-            case 0x0b: {
-                set_bc(&cpu, bc(&cpu) - 1);
-                break;
-            }
-            case 0x0c: {
-                inc(&cpu, &cpu.c);
-                break;
+u8 io_read(CPU *cpu, u16 address);
+void io_write(CPU *cpu, u16 address, u8 val);
+u8 watch_read(CPU *cpu, u16 address);
+void watch_write(CPU *cpu, u16 address, u8 val);
+
+u8 boot_rom_read(CPU *cpu, u16 address) {
+    return boot_rom[address];
+}
+
+void rom_write(CPU *cpu, u16 address, u8 val) {
+    // Rom is read only and never banked; of the mbc registers only ram
+    // enable does anything
+    if (address < 0x2000 && ram_gated()) {
+        bool enabled = (val & 0x0f) == 0x0a;
+        if (enabled == cpu->ram_enabled) {
+            return;
+        }
+        cpu->ram_enabled = enabled;
+        if (!enabled && cpu->save) {
+            flush_save(cpu, true);
+        }
+        for (int page = 0xa0; page < 0xc0; page++) {
+            map_page(cpu, page);
+        }
+    }
+}
+
+u8 locked_read(CPU *cpu, u16 address) {
+    return 0xff;
+}
+
+void locked_write(CPU *cpu, u16 address, u8 val) {
+}
+
+// Passes a write to vram or oam, at offset in memory, to the render thread
+void queue_video_write(CPU *cpu, u32 offset, u8 val) {
+    if (offset >= vram_bank_1) {
+        queue_command(cpu->render_queue, RENDER_WRITE_BANK_1, offset - vram_bank_1 + 0x8000, val);
+    } else {
+        queue_command(cpu->render_queue, RENDER_WRITE, offset, val);
+    }
+}
+
+void video_write(CPU *cpu, u16 address, u8 val) {
+    u32 offset = page_base(cpu, address >> 8) | (address & 0xff);
+    store(cpu, offset, val);
+    queue_video_write(cpu, offset, val);
+}
+
+void resolve_page(CPU *cpu, u8 page, PageMapping *mapping) {
+    u32 base = page_base(cpu, page);
+    u8 *bytes = cpu->blocks[base >> block_bits]->bytes + (base & (block_size - 1));
+    mapping->read = bytes;
+    mapping->write = bytes;
+    mapping->store_page = base >> 8;
+    mapping->read_handler = NULL;
+    mapping->write_handler = NULL;
+    if (page < 0x80) {
+        mapping->write = NULL;
+        mapping->write_handler = rom_write;
+    }
+    if (page == 0x00 && cpu->boot_rom_enabled) {
+        mapping->read = NULL;
+        mapping->read_handler = boot_rom_read;
+    }
+    if (page >= 0xa0 && page < 0xc0 && ram_gated() && !cpu->ram_enabled) {
+        mapping->read = NULL;
+        mapping->write = NULL;
+        mapping->read_handler = locked_read;
+        mapping->write_handler = locked_write;
+    }
+    if (cpu->render_queue && ((page >= 0x80 && page < 0xa0) || page == 0xfe)) {
+        mapping->write = NULL;
+        mapping->write_handler = video_write;
+    }
+    if (page == 0xff) {
+        mapping->read = NULL;
+        mapping->write = NULL;
+        mapping->read_handler = io_read;
+        mapping->write_handler = io_write;
+    } else if (cpu->dma_active) {
+        // Only io and hram are reachable while DMA owns the bus
+        mapping->read = NULL;
+        mapping->write = NULL;
+        mapping->read_handler = locked_read;
+        mapping->write_handler = locked_write;
+    }
+}
+
+u8 page_watch_kinds(CPU *cpu, u8 page) {
+    u8 kinds = 0;
+    if (cpu->debugger) {
+        for (int i = 0; i < cpu->debugger->watchpoint_count; i++) {
+            Watchpoint *watch = &cpu->debugger->watchpoints[i];
+            if (watch->address >> 8 == page) {
+                kinds |= watch->kind;
             }
-            case 0x0d: {
-                dec(&cpu, &cpu.c);
-                break;
-            }
-            case 0x0e: {
-                u8 arg = parse_u8(&cpu);
-                cpu.c = arg;
-                break;
-            }
-            case 0x11: {
-                u16 arg = parse_u16(&cpu);
-                set_de(&cpu, arg);
-                break;
-            }
-            case 0x12: {
-                set_dereference_de(&cpu, cpu.a);
-                break;
-            }
-            case 0x13: {
-                set_de(&cpu, de(&cpu) + 1);
-                break;
-            }
-            case 0x14: {
-                inc(&cpu, &cpu.d);
-                break;
-            }
-            case 0x15: {
-                dec(&cpu, &cpu.d);
-                break;
-            }
-            case 0x16: {
-                u8 arg = parse_u8(&cpu);
-                cpu.d = arg;
-                break;
+        }
+    }
+    return kinds;
+}
+
+u8 peek(CPU *cpu, u16 address);
+void poke(CPU *cpu, u16 address, u8 val);
+
+void map_page(CPU *cpu, u8 page) {
+    PageMapping mapping;
+    resolve_page(cpu, page, &mapping);
+    if (cpu->reference_memory) {
+        mapping.read = NULL;
+        mapping.write = NULL;
+        mapping.read_handler = peek;
+        mapping.write_handler = poke;
+    }
+    // Watchpoints swap in a checking handler for just their page
+    u8 kinds = page_watch_kinds(cpu, page);
+    if (kinds & WATCH_READ) {
+        mapping.read = NULL;
+        mapping.read_handler = watch_read;
+    }
+    if (kinds & WATCH_WRITE) {
+        mapping.write = NULL;
+        mapping.write_handler = watch_write;
+    }
+    cpu->read_map[page] = mapping.read;
+    cpu->write_map[page] = mapping.write;
+    cpu->store_page[page] = mapping.store_page;
+    cpu->read_handlers[page] = mapping.read_handler;
+    cpu->write_handlers[page] = mapping.write_handler;
+}
+
+void remap(CPU *cpu) {
+    for (int page = 0; page < 0x100; page++) {
+        map_page(cpu, page);
+    }
+}
+
+// Reads without going through watchpoints
+u8 peek(CPU *cpu, u16 address) {
+    PageMapping mapping;
+    resolve_page(cpu, address >> 8, &mapping);
+    if (mapping.read) {
+        return mapping.read[address & 0xff];
+    }
+    return mapping.read_handler(cpu, address);
+}
+
+void poke(CPU *cpu, u16 address, u8 val) {
+    PageMapping mapping;
+    resolve_page(cpu, address >> 8, &mapping);
+    if (mapping.write) {
+        store(cpu, (mapping.store_page << 8) | (address & 0xff), val);
+    } else {
+        mapping.write_handler(cpu, address, val);
+    }
+}
+
+// Makes the main loop call into the debugger before the next instruction.
+// Only touches plain memory, so it's safe from a signal handler.
+void request_stop(CPU *cpu) {
+    cpu->debugger->stop_requested = 1;
+    for (int i = 0; i < 0x100; i++) {
+        ((volatile u8 *) cpu->break_pages)[i] = 1;
+    }
+}
+
+void check_watch(CPU *cpu, u16 address, WatchKind kind, u8 val) {
+    Debugger *debugger = cpu->debugger;
+    for (int i = 0; i < debugger->watchpoint_count; i++) {
+        Watchpoint *watch = &debugger->watchpoints[i];
+        if (watch->address == address && (watch->kind & kind)) {
+            if (kind == WATCH_READ) {
+                printf("watchpoint: read %04x\n", address);
+            } else {
+                printf("watchpoint: write %02x to %04x\n", val, address);
+            }
+            request_stop(cpu);
+        }
+    }
+}
+
+u8 watch_read(CPU *cpu, u16 address) {
+    check_watch(cpu, address, WATCH_READ, 0);
+    return peek(cpu, address);
+}
+
+void watch_write(CPU *cpu, u16 address, u8 val) {
+    check_watch(cpu, address, WATCH_WRITE, val);
+    poke(cpu, address, val);
+}
+
+// Where the boot rom leaves the machine: how long it takes here, and the
+// start of the line 153 it hands over in
+const u64 boot_cycles = 23580484;
+const u64 boot_line_start = 23580368;
+
+// Scales each bit of a logo nibble up to two pixels
+u8 double_nibble(u8 nibble) {
+    u8 out = 0;
+    for (int i = 0; i < 4; i++) {
+        if (nibble & (1 << i)) {
+            out |= 0x3 << (i * 2);
+        }
+    }
+    return out;
+}
+
+// Loads what running boot_rom[] would have left behind, so startup skips
+// the logo scroll. --check-boot compares it with the real thing.
+void skip_boot_rom(CPU *cpu) {
+    cpu->a = 0x01;
+    cpu->f = 0xb0;
+    cpu->b = 0x00;
+    cpu->c = 0x13;
+    cpu->d = 0x00;
+    cpu->e = 0xd8;
+    cpu->h = 0x01;
+    cpu->l = 0x4d;
+    if (cpu->cgb) {
+        // What the cgb boot rom leaves instead; a == 0x11 is how games
+        // tell they're on one
+        cpu->a = 0x11;
+        cpu->f = 0x80;
+        cpu->c = 0x00;
+        cpu->d = 0xff;
+        cpu->e = 0x56;
+        cpu->h = 0x00;
+        cpu->l = 0x0d;
+    }
+    cpu->sp = 0xfffe;
+    cpu->pc = 0x100;
+    cpu->boot_rom_enabled = false;
+    cpu->cycles = boot_cycles;
+    // The cartridge logo, each pixel doubled and each row drawn twice
+    for (int i = 0; i < 48; i++) {
+        u8 byte = load(cpu, 0x104 + i);
+        for (int row = 0; row < 4; row++) {
+            u16 address = 0x8010 + i * 8 + row * 2;
+            store(cpu, address, double_nibble(row < 2 ? byte >> 4 : byte & 0xf));
+        }
+    }
+    // The (R) mark comes from the boot rom itself
+    for (int i = 0; i < 8; i++) {
+        store(cpu, 0x8190 + i * 2, boot_rom[0xd8 + i]);
+    }
+    store(cpu, 0x9910, 0x19);
+    for (int i = 0; i < 12; i++) {
+        store(cpu, 0x9904 + i, 0x01 + i);
+        store(cpu, 0x9924 + i, 0x0d + i);
+    }
+    const u16 io[][2] = {
+        {interrupt_flag_address, 0x01},
+        {0xff11, 0x80}, {0xff12, 0xf3}, {0xff13, 0xc1}, {0xff14, 0x87},
+        {0xff24, 0x77}, {0xff25, 0xf3}, {0xff26, 0x80},
+        {lcd_control_address, 0x91},
+        {ly_address, 153},
+        {palette_address, 0xfc},
+        {disable_bootrom_address, 0x01},
+        // Left on the stack by the boot rom's last calls
+        {0xfffa, 0x39}, {0xfffb, 0x01}, {0xfffc, 0x2e},
+    };
+    for (size_t i = 0; i < sizeof(io) / sizeof(io[0]); i++) {
+        store(cpu, io[i][0], io[i][1]);
+    }
+    update_palette(&cpu->gpu, 0, 0xfc);
+    cpu->line_start = boot_line_start;
+    schedule_at(cpu, EVENT_LINE, boot_line_start + line_cycles);
+    remap(cpu);
+}
+
+void init_cpu(CPU *cpu) {
+    cpu->a = 0;
+    cpu->f = 0;
+    cpu->b = 0;
+    cpu->c = 0;
+    cpu->d = 0;
+    cpu->e = 0;
+    cpu->h = 0;
+    cpu->l = 0;
+    cpu->pc = 0;
+    cpu->sp = 0;
+    cpu->boot_rom_enabled = true;
+    cpu->ime = false;
+    cpu->ei_pending = false;
+    cpu->halted = false;
+    cpu->halt_bug = false;
+    cpu->cycles = 0;
+    cpu->line_start = 0;
+    cpu->div_base = 0;
+    cpu->timer_synced = 0;
+    cpu->double_speed = 0;
+    cpu->clock_base = 0;
+    cpu->speed_changed = 0;
+    cpu->buttons = 0;
+    cpu->link = NULL;
+    cpu->write_hash = 0;
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        cpu->event_time[i] = never;
+    }
+    cpu->next_event = never;
+    cpu->dma_active = false;
+    init_gpu(&cpu->gpu);
+    cpu->frame_done = false;
+    memset(cpu->break_pages, 0, sizeof(cpu->break_pages));
+    cpu->ram_enabled = false;
+    cpu->cgb = cpu->fast_boot && (rom[cgb_flag_address] & 0x80);
+    cpu->gpu.cgb = cpu->cgb;
+    cpu->vram_bank = 0;
+    cpu->wram_bank = 1;
+    cpu->hdma_active = false;
+    cpu->hdma_source = 0;
+    cpu->hdma_dest = 0;
+    cpu->hdma_blocks = 0;
+    // Starting over must not wipe the save file
+    if (cpu->save) {
+        release_block(cpu->save);
+        cpu->blocks[sram_block] = NULL;
+        cpu->save = NULL;
+    }
+    for (int i = 0; i < block_count; i++) {
+        if (cpu->blocks[i] && (cpu->shared_blocks & (1 << i))) {
+            release_block(cpu->blocks[i]);
+            cpu->blocks[i] = NULL;
+        }
+        if (!cpu->blocks[i]) {
+            cpu->blocks[i] = new_block();
+        }
+        memset(cpu->blocks[i]->bytes, 0, block_size);
+    }
+    cpu->shared_blocks = 0;
+    for (u32 offset = 0; offset < rom_len; offset += block_size) {
+        memcpy(cpu->blocks[offset >> block_bits]->bytes, rom + offset, block_size);
+    }
+    rehash_memory(cpu);
+    remap(cpu);
+    if (cpu->fast_boot) {
+        skip_boot_rom(cpu);
+    }
+}
+
+
+// Turns child into a copy of parent that shares all of parent's memory.
+// Whichever of them writes to a block first gets its own copy of it then,
+// so this costs a reference per block plus the rest of the machine, which
+// is small. Debugger, profiler, render thread and link stay with the parent.
+void fork_cpu(CPU *child, CPU *parent) {
+    Block *old_blocks[block_count];
+    memcpy(old_blocks, child->blocks, sizeof(old_blocks));
+    Frame *frames = child->gpu.frames;
+    *child = *parent;
+    for (int i = 0; i < block_count; i++) {
+        atomic_fetch_add_explicit(&child->blocks[i]->refs, 1, memory_order_relaxed);
+        // After taking the new reference, in case it's the same block
+        if (old_blocks[i]) {
+            release_block(old_blocks[i]);
+        }
+    }
+    // Only the parent writes through to the save file
+    if (parent->save) {
+        Block *copy = new_block();
+        memcpy(copy->bytes, parent->save->bytes, block_size);
+        release_block(child->blocks[sram_block]);
+        child->blocks[sram_block] = copy;
+        child->save = NULL;
+        for (int page = 0xa0; page < 0xc0; page++) {
+            map_page(child, page);
+        }
+    }
+    parent->shared_blocks = (1 << block_count) - 1;
+    child->shared_blocks = (1 << block_count) - 1;
+    // A frame pool of its own, made by ensure_frame_pool() when it draws
+    if (frames) {
+        for (int i = 0; i < frame_pool_len; i++) {
+            atomic_store(&frames[i].refs, 0);
+        }
+    }
+    child->gpu.frames = frames;
+    child->gpu.back = frames;
+    child->gpu.latest = NULL;
+    child->gpu.sink_count = 0;
+    child->debugger = NULL;
+    child->profiler = NULL;
+    child->render_queue = NULL;
+    child->link = NULL;
+    child->fault_jump = NULL;
+    memset(child->break_pages, 0, sizeof(child->break_pages));
+    // Otherwise the parent's maps already point at the shared blocks
+    if (parent->render_queue || parent->debugger) {
+        remap(child);
+    }
+}
+
+// Maps the first bank of a battery save file as a block, creating the file
+// if need be. NULL if that fails.
+Block *open_save(const char *path) {
+    off_t len = cartridge_ram_len();
+    if (len < block_size) {
+        len = block_size;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size < len && ftruncate(fd, len) < 0)) {
+        close(fd);
+        return NULL;
+    }
+    // Room for the whole block, then the file laid over its bytes
+    Block *block = mmap(NULL, sizeof(Block), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    if (mmap(block->bytes, block_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(block, sizeof(Block));
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    atomic_init(&block->refs, 1);
+    block->mapped = true;
+    return block;
+}
+
+// Makes save the machine's cartridge ram, taking over the caller's
+// reference
+void attach_save(CPU *cpu, Block *save) {
+    release_block(cpu->blocks[sram_block]);
+    cpu->blocks[sram_block] = save;
+    cpu->shared_blocks &= ~(1 << sram_block);
+    cpu->save = save;
+    for (int page = 0xa0; page < 0xc0; page++) {
+        rehash_page(cpu, page);
+        map_page(cpu, page);
+    }
+    cpu->save_flushed_hash = sram_hash(cpu);
+    cpu->save_synced_hash = cpu->save_flushed_hash;
+}
+
+// Lets go of everything init_cpu() or fork_cpu() allocated
+void free_cpu(CPU *cpu) {
+    for (int i = 0; i < block_count; i++) {
+        if (cpu->blocks[i]) {
+            release_block(cpu->blocks[i]);
+            cpu->blocks[i] = NULL;
+        }
+    }
+    free(cpu->gpu.frames);
+    cpu->gpu.frames = NULL;
+}
+
+void start_profiler(CPU *cpu, u64 interval) {
+    Profiler *profiler = calloc(1, sizeof(Profiler));
+    assert(profiler);
+    profiler->interval = interval;
+    // Whatever is running now is the root; it never returns
+    profiler->stack[0] = (CallFrame) {cpu->pc, 0xffff};
+    profiler->depth = 1;
+    profiler->stack_capacity = 1024;
+    profiler->stacks = calloc(profiler->stack_capacity, sizeof(StackSample));
+    assert(profiler->stacks);
+    cpu->profiler = profiler;
+    schedule(cpu, EVENT_PROFILE, interval);
+}
+
+void profile_call(CPU *cpu, u16 routine) {
+    Profiler *profiler = cpu->profiler;
+    // Calls past the maximum depth are folded into their caller
+    if (profiler->depth < max_profile_depth) {
+        profiler->stack[profiler->depth++] = (CallFrame) {routine, cpu->sp};
+    }
+}
+
+void profile_return(CPU *cpu) {
+    Profiler *profiler = cpu->profiler;
+    // Pop by stack pointer rather than one frame per ret, so code that
+    // drops its return address or jumps back instead of returning doesn't
+    // leave the shadow stack out of step
+    while (profiler->depth > 1 && profiler->stack[profiler->depth - 1].sp < cpu->sp) {
+        profiler->depth--;
+    }
+}
+
+StackSample *find_stack(StackSample *stacks, size_t capacity, u64 hash) {
+    size_t i = hash & (capacity - 1);
+    while (stacks[i].count && stacks[i].hash != hash) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &stacks[i];
+}
+
+void profile_sample(CPU *cpu) {
+    Profiler *profiler = cpu->profiler;
+    profiler->pc_samples[cpu->pc]++;
+    profiler->total_samples++;
+
+    // fnv-1a over the routines on the stack
+    u64 hash = 0xcbf29ce484222325;
+    for (int i = 0; i < profiler->depth; i++) {
+        hash = (hash ^ profiler->stack[i].routine) * 0x100000001b3;
+    }
+    hash = (hash ^ profiler->depth) * 0x100000001b3;
+
+    if (profiler->stack_count * 10 >= profiler->stack_capacity * 7) {
+        size_t capacity = profiler->stack_capacity * 2;
+        StackSample *stacks = calloc(capacity, sizeof(StackSample));
+        assert(stacks);
+        for (size_t i = 0; i < profiler->stack_capacity; i++) {
+            if (profiler->stacks[i].count) {
+                *find_stack(stacks, capacity, profiler->stacks[i].hash) = profiler->stacks[i];
             }
-            case 0x17: {
-                rla(&cpu);
-                break;
+        }
+        free(profiler->stacks);
+        profiler->stacks = stacks;
+        profiler->stack_capacity = capacity;
+    }
+
+    StackSample *sample = find_stack(profiler->stacks, profiler->stack_capacity, hash);
+    if (!sample->count) {
+        sample->hash = hash;
+        sample->depth = profiler->depth;
+        for (int i = 0; i < profiler->depth; i++) {
+            sample->routines[i] = profiler->stack[i].routine;
+        }
+        profiler->stack_count++;
+    }
+    sample->count++;
+}
+
+// The clock the cpu, divider and timer run on. It is cycles except in
+// double speed, where it goes twice as fast.
+u64 cpu_clock(CPU *cpu) {
+    return cpu->clock_base + ((cpu->cycles - cpu->speed_changed) << cpu->double_speed);
+}
+
+// The first cycle at which cpu_clock() has reached clock
+u64 clock_cycles(CPU *cpu, u64 clock) {
+    return cpu->speed_changed
+        + ((clock - cpu->clock_base + cpu->double_speed) >> cpu->double_speed);
+}
+
+// Brings TIMA up to date, counting ticks as falling edges of the divider
+// bit TAC selects, and raises the timer interrupt for any overflow
+void sync_timer(CPU *cpu) {
+    u8 tac = load(cpu, tac_address);
+    u64 now = cpu_clock(cpu);
+    if (tac & 0x04) {
+        u64 period = timer_periods[tac & 3];
+        u64 ticks = (now - cpu->div_base) / period
+            - (cpu->timer_synced - cpu->div_base) / period;
+        u8 tima = load(cpu, tima_address);
+        if (ticks >= 256u - tima) {
+            u8 tma = load(cpu, tma_address);
+            ticks -= 256 - tima;
+            tima = tma + ticks % (256 - tma);
+            request_interrupt(cpu, timer_interrupt);
+        } else {
+            tima += ticks;
+        }
+        store(cpu, tima_address, tima);
+    }
+    cpu->timer_synced = now;
+}
+
+// Schedules an event for the next TIMA overflow so the interrupt is raised
+// on time even if nobody reads the timer
+void schedule_timer(CPU *cpu) {
+    sync_timer(cpu);
+    u8 tac = load(cpu, tac_address);
+    if (tac & 0x04) {
+        u64 period = timer_periods[tac & 3];
+        u64 ticks = (cpu_clock(cpu) - cpu->div_base) / period;
+        u64 remaining = 256 - load(cpu, tima_address);
+        schedule_at(cpu, EVENT_TIMER, clock_cycles(cpu, cpu->div_base + (ticks + remaining) * period));
+    } else {
+        cancel(cpu, EVENT_TIMER);
+    }
+}
+
+void hdma_block(CPU *cpu);
+
+void handle_event(CPU *cpu, Event event, u64 when) {
+    switch (event) {
+        case EVENT_DMA_END: {
+            cpu->dma_active = false;
+            remap(cpu);
+            break;
+        }
+        case EVENT_LINE: {
+            next_line(cpu, when);
+            break;
+        }
+        case EVENT_RENDER: {
+            draw_line(cpu);
+            break;
+        }
+        case EVENT_PROFILE: {
+            profile_sample(cpu);
+            schedule_at(cpu, EVENT_PROFILE, when + cpu->profiler->interval);
+            break;
+        }
+        case EVENT_TIMER: {
+            schedule_timer(cpu);
+            break;
+        }
+        case EVENT_HBLANK: {
+            request_interrupt(cpu, lcd_status_interrupt);
+            break;
+        }
+        case EVENT_HDMA: {
+            hdma_block(cpu);
+            cpu->hdma_active = cpu->hdma_blocks > 0;
+            cpu->cycles += hdma_block_cycles;
+            break;
+        }
+        case EVENT_SERIAL: {
+            end_transfer(cpu);
+            break;
+        }
+        case EVENT_SERIAL_REMOTE: {
+            end_remote_transfer(cpu);
+            break;
+        }
+        case EVENT_LINK_SYNC: {
+            link_sync(cpu, when);
+            break;
+        }
+        default: {
+            assert(false);
+        }
+    }
+}
+
+void run_events(CPU *cpu) {
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        u64 when = cpu->event_time[i];
+        if (when <= cpu->cycles) {
+            cpu->event_time[i] = never;
+            // Handlers reschedule relative to `when` so lateness doesn't drift
+            handle_event(cpu, i, when);
+        }
+    }
+    // Handlers may have rescheduled themselves
+    cpu->next_event = never;
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        if (cpu->event_time[i] < cpu->next_event) {
+            cpu->next_event = cpu->event_time[i];
+        }
+    }
+}
+
+void start_dma(CPU *cpu, u8 val) {
+    // The whole transfer is done up front; only the bus lock is timed.
+    // Echo ram here covers 0xfe and 0xff too.
+    u32 source = page_base(cpu, val >= 0xe0 ? val - 0x20 : val);
+    const u8 *src = cpu->blocks[source >> block_bits]->bytes + (source & (block_size - 1));
+    if (source <= 0xff && cpu->boot_rom_enabled) {
+        src = boot_rom;
+    }
+    // Games DMA the same sprite table every frame; if nothing moved, oam
+    // stays clean and the render thread hears nothing
+    const u8 *oam = cpu->blocks[oam_address >> block_bits]->bytes + (oam_address & (block_size - 1));
+    if (memcmp(oam, src, oam_len) != 0) {
+        own_block(cpu, oam_address >> block_bits);
+        memcpy(cpu->blocks[oam_address >> block_bits]->bytes + (oam_address & (block_size - 1)), src, oam_len);
+        rehash_page(cpu, oam_address >> 8);
+        cpu->gpu.video_writes++;
+        if (cpu->render_queue) {
+            for (int i = 0; i < oam_len; i++) {
+                queue_command(cpu->render_queue, RENDER_WRITE, oam_address + i, src[i]);
             }
-            case 0x18: {
-                i8 arg = parse_i8(&cpu);
-                cpu.pc += arg;
-                break;
+        }
+    }
+    cpu->dma_active = true;
+    remap(cpu);
+    schedule(cpu, EVENT_DMA_END, dma_cycles >> cpu->double_speed);
+}
+
+// Copies the next 16 bytes of an HDMA into vram, in one go
+void hdma_block(CPU *cpu) {
+    u8 bytes[16];
+    const u8 *page = cpu->read_map[cpu->hdma_source >> 8];
+    if (page) {
+        memcpy(bytes, page + (cpu->hdma_source & 0xff), sizeof(bytes));
+    } else {
+        for (int i = 0; i < 16; i++) {
+            bytes[i] = cpu->read_handlers[cpu->hdma_source >> 8](cpu, cpu->hdma_source + i);
+        }
+    }
+    u32 dest = page_base(cpu, cpu->hdma_dest >> 8) | (cpu->hdma_dest & 0xff);
+    store_bytes(cpu, dest, bytes, sizeof(bytes));
+    if (cpu->render_queue) {
+        for (int i = 0; i < 16; i++) {
+            queue_video_write(cpu, dest + i, bytes[i]);
+        }
+    }
+    cpu->hdma_source += 16;
+    cpu->hdma_dest = 0x8000 | ((cpu->hdma_dest + 16) & 0x1fff);
+    cpu->hdma_blocks--;
+}
+
+// A write to HDMA5. General purpose transfers happen on the spot; hblank
+// ones are a block per EVENT_HDMA, which start_line() schedules.
+void start_hdma(CPU *cpu, u8 val) {
+    if (cpu->hdma_active && !(val & 0x80)) {
+        cpu->hdma_active = false;
+        cancel(cpu, EVENT_HDMA);
+        return;
+    }
+    cpu->hdma_source = make_u16(load(cpu, hdma_source_address),
+                                load(cpu, hdma_source_address + 1)) & 0xfff0;
+    cpu->hdma_dest = 0x8000 | (make_u16(load(cpu, hdma_dest_address),
+                                        load(cpu, hdma_dest_address + 1)) & 0x1ff0);
+    cpu->hdma_blocks = (val & 0x7f) + 1;
+    if (val & 0x80) {
+        cpu->hdma_active = true;
+        // Already in this line's hblank: the first block goes now
+        bool lcd = load(cpu, lcd_control_address) & 0x80;
+        if (lcd && load(cpu, ly_address) < screen_height
+            && cpu->cycles - cpu->line_start >= hblank_start_cycles) {
+            schedule(cpu, EVENT_HDMA, 0);
+        }
+        return;
+    }
+    u64 stall = cpu->hdma_blocks * hdma_block_cycles;
+    while (cpu->hdma_blocks) {
+        hdma_block(cpu);
+    }
+    // The stall is in real time, but step() scales what an instruction
+    // adds to cycles by the cpu's speed
+    cpu->cycles += stall << cpu->double_speed;
+}
+
+// stop with KEY1's prepare bit set switches between normal and double speed
+void switch_speed(CPU *cpu) {
+    sync_timer(cpu);
+    cpu->clock_base = cpu_clock(cpu);
+    cpu->speed_changed = cpu->cycles;
+    cpu->double_speed ^= 1;
+    store(cpu, key1_address, cpu->double_speed << 7);
+    schedule_timer(cpu);
+    // Real time, like the HDMA stall
+    cpu->cycles += speed_switch_cycles << cpu->double_speed;
+}
+
+// VBK: switches a cgb's vram bank in through the page tables
+void switch_vram_bank(CPU *cpu, u8 bank) {
+    if (bank == cpu->vram_bank) {
+        return;
+    }
+    cpu->vram_bank = bank;
+    for (int page = 0x80; page < 0xa0; page++) {
+        map_page(cpu, page);
+    }
+}
+
+// SVBK: likewise for the wram bank at 0xd000 and its echo, where 0 means 1
+void switch_wram_bank(CPU *cpu, u8 bank) {
+    if (bank == 0) {
+        bank = 1;
+    }
+    if (bank == cpu->wram_bank) {
+        return;
+    }
+    cpu->wram_bank = bank;
+    for (int page = 0xd0; page < 0xe0; page++) {
+        map_page(cpu, page);
+        if (page < 0xde) {
+            map_page(cpu, page + 0x20);
+        }
+    }
+}
+
+void fault(CPU *cpu, const char *reason);
+
+u8 io_read(CPU *cpu, u16 address) {
+    if ((address <= 0xff26 && address >= 0xff20)
+        || (address <= 0xff3f && address >= 0xff30)
+        || (address <= 0xff1e && address >= 0xff10)) {
+        // sound stuff
+    } else if (address == joypad_address) {
+        u8 select = load(cpu, joypad_address) & 0x30;
+        u8 pressed = 0;
+        if (!(select & 0x10)) {
+            pressed |= cpu->buttons & 0x0f;
+        }
+        if (!(select & 0x20)) {
+            pressed |= cpu->buttons >> 4;
+        }
+        return 0xc0 | select | (~pressed & 0x0f);
+    } else if (address == serial_data_address) {
+        goto passthrough;
+    } else if (address == serial_control_address) {
+        return load(cpu, address) | 0x7e;
+    } else if (address == div_address) {
+        return (cpu_clock(cpu) - cpu->div_base) >> 8;
+    } else if (address == tima_address) {
+        sync_timer(cpu);
+        goto passthrough;
+    } else if (address == tma_address) {
+        goto passthrough;
+    } else if (address == tac_address) {
+        return load(cpu, address) | 0xf8;
+    } else if (address == interrupt_flag_address) {
+        return load(cpu, address) | 0xe0;
+    } else if (address == lcd_status_address) {
+        return lcd_status(cpu);
+    } else if (address == ly_address || address == lcd_control_address
+        || address == ly_compare_address) {
+        goto passthrough;
+    } else if (address == palette_address || address == obj_palette_0_address
+        || address == obj_palette_1_address) {
+        goto passthrough;
+    } else if (address == scroll_y_address || address == scroll_x_address
+        || address == window_y_address || address == window_x_address) {
+        goto passthrough;
+    } else if (address == disable_bootrom_address || address == dma_address) {
+        goto passthrough;
+    } else if (address >= 0xff4c && address <= 0xff7f && !cpu->cgb) {
+        // The cgb's registers, which a dmg doesn't have
+        return 0xff;
+    } else if (address == key1_address) {
+        return load(cpu, address) | 0x7e;
+    } else if (address == vbk_address) {
+        return 0xfe | cpu->vram_bank;
+    } else if (address == hdma_control_address) {
+        if (!cpu->hdma_blocks) {
+            return 0xff;
+        }
+        return (cpu->hdma_active ? 0x00 : 0x80) | (cpu->hdma_blocks - 1);
+    } else if (address >= bcps_address && address <= ocpd_address) {
+        return cgb_palette_read(&cpu->gpu, address);
+    } else if (address == svbk_address) {
+        return load(cpu, address) | 0xf8;
+    } else if (address >= 0xff4c && address <= 0xff7f) {
+        // HDMA1-4 are write only; the rest is infrared or undocumented
+        return 0xff;
+    } else if (address >= 0xff00 && address <= 0xff7f) {
+        fault(cpu, "unmapped io read");
+    }
+passthrough:
+    return load(cpu, address);
+}
+
+void io_write(CPU *cpu, u16 address, u8 val) {
+    if ((address <= 0xff26 && address >= 0xff20)
+        || (address <= 0xff3f && address >= 0xff30)
+        || (address <= 0xff1e && address >= 0xff10)) {
+        // sound stuff
+    } else if (address == 0xff7f) {
+        // Nothing is here, but tetris clears it anyway
+    } else if (address == joypad_address) {
+        store(cpu, address, val & 0x30);
+        return;
+    } else if (address == serial_data_address) {
+        goto passthrough;
+    } else if (address == serial_control_address) {
+        store(cpu, address, val & 0x81);
+        if ((val & 0x81) == 0x81) {
+            start_transfer(cpu);
+        } else {
+            cancel(cpu, EVENT_SERIAL);
+        }
+        return;
+    } else if (address == div_address) {
+        sync_timer(cpu);
+        cpu->div_base = cpu_clock(cpu);
+        cpu->timer_synced = cpu->div_base;
+        schedule_timer(cpu);
+        return;
+    } else if (address == tima_address || address == tma_address
+        || address == tac_address) {
+        sync_timer(cpu);
+        store(cpu, address, val);
+        schedule_timer(cpu);
+        return;
+    } else if (address == interrupt_flag_address) {
+        store(cpu, address, val & 0x1f);
+        return;
+    } else if (address == lcd_status_address) {
+        store(cpu, address, val & 0x78);
+        return;
+    } else if (address == ly_compare_address) {
+        goto passthrough;
+    } else if (address == palette_address || address == obj_palette_0_address
+        || address == obj_palette_1_address) {
+        update_palette(&cpu->gpu, address - palette_address, val);
+    } else if (address == scroll_y_address || address == scroll_x_address
+        || address == window_y_address || address == window_x_address) {
+        goto passthrough;
+    } else if (address == lcd_control_address) {
+        bool was_on = load(cpu, lcd_control_address) & 0x80;
+        if ((val & 0x80) && !was_on) {
+            lcd_on(cpu);
+        } else if (!(val & 0x80) && was_on) {
+            lcd_off(cpu);
+        }
+    } else if (address == ly_address) {
+        // Read only
+        return;
+    } else if (address == disable_bootrom_address) {
+        if (val == 1) {
+            cpu->boot_rom_enabled = false;
+            map_page(cpu, 0x00);
+        }
+        goto passthrough;
+    } else if (address == dma_address) {
+        start_dma(cpu, val);
+        goto passthrough;
+    } else if (address >= 0xff4c && address <= 0xff7f && !cpu->cgb) {
+        return;
+    } else if (address == key1_address) {
+        // Only the prepare bit is writable; stop does the switch
+        store(cpu, address, (load(cpu, address) & 0x80) | (val & 0x01));
+        return;
+    } else if (address == vbk_address) {
+        switch_vram_bank(cpu, val & 0x01);
+        goto passthrough;
+    } else if (address >= hdma_source_address && address < hdma_control_address) {
+        goto passthrough;
+    } else if (address == hdma_control_address) {
+        start_hdma(cpu, val);
+        return;
+    } else if (address >= bcps_address && address <= ocpd_address) {
+        cgb_palette_write(&cpu->gpu, address, val);
+        if (cpu->render_queue) {
+            queue_command(cpu->render_queue, RENDER_WRITE, address, val);
+        }
+        return;
+    } else if (address == svbk_address) {
+        switch_wram_bank(cpu, val & 0x07);
+        goto passthrough;
+    } else if (address >= 0xff4c && address <= 0xff7f) {
+        // Infrared and undocumented registers
+        goto passthrough;
+    } else if (address >= 0xff00 && address <= 0xff7f) {
+        fault(cpu, "unmapped io write");
+    }
+passthrough:
+    store(cpu, address, val);
+    if (cpu->render_queue && is_video_address(address)) {
+        queue_command(cpu->render_queue, RENDER_WRITE, address, val);
+    }
+}
+
+u8 memory(CPU *cpu, u16 address) {
+    u8 *page = cpu->read_map[address >> 8];
+    if (page) {
+        count_metric(cpu->metrics.fast_reads);
+        return page[address & 0xff];
+    }
+    count_metric(cpu->metrics.slow_reads);
+    return cpu->read_handlers[address >> 8](cpu, address);
+}
+
+void set_memory(CPU *cpu, u16 address, u8 val) {
+    cpu->write_hash = (cpu->write_hash ^ ((address << 8) | val)) * 0x100000001b3;
+    u8 *page = cpu->write_map[address >> 8];
+    if (page) {
+        count_metric(cpu->metrics.fast_writes);
+        store(cpu, (cpu->store_page[address >> 8] << 8) | (address & 0xff), val);
+        return;
+    }
+    count_metric(cpu->metrics.slow_writes);
+    cpu->write_handlers[address >> 8](cpu, address, val);
+}
+
+i8 parse_i8(CPU *cpu) {
+    i8 ret = (i8) memory(cpu, cpu->pc);
+    cpu->pc += 1;
+    return ret;
+}
+
+u8 parse_u8(CPU *cpu) {
+    u16 ret = memory(cpu, cpu->pc);
+    cpu->pc += 1;
+    return ret;
+}
+
+u16 parse_u16(CPU *cpu) {
+    u16 ret = make_u16(memory(cpu, cpu->pc + 1), memory(cpu, cpu->pc));
+    cpu->pc += 2;
+    return ret;
+}
+
+u8 hi(u16 val) {
+    return val >> 8;
+}
+
+u8 lo(u16 val) {
+    return val & 0xFF;
+}
+
+void set_bc(CPU *cpu, u16 val) {
+    cpu->b = hi(val);
+    cpu->c = lo(val);
+}
+
+void set_de(CPU *cpu, u16 val) {
+    cpu->d = hi(val);
+    cpu->e = lo(val);
+}
+
+void set_hl(CPU *cpu, u16 val) {
+    cpu->h = hi(val);
+    cpu->l = lo(val);
+}
+
+void set_af(CPU *cpu, u16 val) {
+    cpu->a = hi(val);
+    cpu->f = lo(val) & 0xF0;
+}
+
+
+void set_dereference_bc(CPU *cpu, u8 val) {
+    set_memory(cpu, bc(cpu), val);
+}
+
+void set_dereference_de(CPU *cpu, u8 val) {
+    set_memory(cpu, de(cpu), val);
+}
+
+void set_dereference_hl(CPU *cpu, u8 val) {
+    set_memory(cpu, hl(cpu), val);
+}
+
+u8 dereference_bc(CPU *cpu) {
+    return memory(cpu, bc(cpu));
+}
+
+u8 dereference_de(CPU *cpu) {
+    return memory(cpu, de(cpu));
+}
+
+u8 dereference_hl(CPU *cpu) {
+    return memory(cpu, hl(cpu));
+}
+
+void set_z(CPU *cpu, bool val) {
+    cpu->f = (cpu->f & ~Z_MASK) | (val << Z_INDEX);
+    assert((cpu->f & 0xF) == 0);
+}
+
+void set_n(CPU *cpu, bool val) {
+    cpu->f = (cpu->f & ~N_MASK) | (val << N_INDEX);
+    assert((cpu->f & 0xF) == 0);
+}
+
+void set_h(CPU *cpu, bool val) {
+    cpu->f = (cpu->f & ~H_MASK) | (val << H_INDEX);
+    assert((cpu->f & 0xF) == 0);
+}
+
+void set_c(CPU *cpu, bool val) {
+    cpu->f = (cpu->f & ~C_MASK) | (val << C_INDEX);
+    assert((cpu->f & 0xF) == 0);
+}
+
+void set_flags(CPU *cpu, bool z, bool n, bool h, bool c) {
+    cpu->f = (z << Z_INDEX) | (n << N_INDEX) | (h << H_INDEX) | (c << C_INDEX);
+}
+
+void and(CPU *cpu, u8 val) {
+    cpu->a &= val;
+    set_flags(cpu, cpu->a == 0, 0, 1, 0);
+}
+
+void or(CPU *cpu, u8 val) {
+    cpu->a |= val;
+    set_flags(cpu, cpu->a == 0, 0, 0, 0);
+}
+
+void xor(CPU *cpu, u8 val) {
+    cpu->a ^= val;
+    set_flags(cpu, cpu->a == 0, 0, 0, 0);
+}
+
+void bit(CPU *cpu, int n, u8 val) {
+    u8 res = val & (1 << n);
+    set_z(cpu, res == 0);
+    set_n(cpu, 0);
+    set_h(cpu, 1);
+}
+
+void inc(CPU *cpu, u8 *loc) {
+    u8 half_carry = ((*loc & 0xf) + 1) & 0x10;
+    *loc += 1;
+    set_z(cpu, *loc == 0);
+    set_n(cpu, 0);
+    set_h(cpu, half_carry != 0);
+}
+
+void dec(CPU *cpu, u8 *loc) {
+    u8 half_carry = ((*loc & 0xf) - 1) & 0x10;
+    *loc -= 1;
+    set_z(cpu, *loc == 0);
+    set_n(cpu, 1);
+    set_h(cpu, half_carry != 0);
+}
+
+void push(CPU *cpu, u16 val) {
+    cpu->sp -= 2;
+    set_memory(cpu, cpu->sp, lo(val));
+    set_memory(cpu, cpu->sp + 1, hi(val));
+}
+
+u16 pop(CPU *cpu) {
+    u16 ret = make_u16(memory(cpu, cpu->sp + 1), memory(cpu, cpu->sp));
+    cpu->sp += 2;
+    return ret;
+}
+
+void rla(CPU *cpu) {
+    u8 carry = cpu->a & 0x80;
+    cpu->a <<= 1;
+    cpu->a |= c(cpu);
+    set_z(cpu, 0);
+    set_n(cpu, 0);
+    set_h(cpu, 0);
+    set_c(cpu, carry != 0);
+}
+
+void rlca(CPU *cpu) {
+    u8 carry = cpu->a >> 7;
+    cpu->a = (cpu->a << 1) | carry;
+    set_flags(cpu, 0, 0, 0, carry);
+}
+
+void rrca(CPU *cpu) {
+    u8 carry = cpu->a & 1;
+    cpu->a = (cpu->a >> 1) | (carry << 7);
+    set_flags(cpu, 0, 0, 0, carry);
+}
+
+void rra(CPU *cpu) {
+    u8 carry = cpu->a & 1;
+    cpu->a = (cpu->a >> 1) | (c(cpu) << 7);
+    set_flags(cpu, 0, 0, 0, carry);
+}
+
+void rl(CPU *cpu, u8 *loc) {
+    u8 carry = *loc & 0x80;
+    *loc <<= 1;
+    *loc |= c(cpu);
+    set_z(cpu, *loc == 0);
+    set_n(cpu, 0);
+    set_h(cpu, 0);
+    set_c(cpu, carry != 0);
+}
+
+void rlc(CPU *cpu, u8 *loc) {
+    u8 carry = *loc >> 7;
+    *loc = (*loc << 1) | carry;
+    set_flags(cpu, *loc == 0, 0, 0, carry);
+}
+
+void rrc(CPU *cpu, u8 *loc) {
+    u8 carry = *loc & 1;
+    *loc = (*loc >> 1) | (carry << 7);
+    set_flags(cpu, *loc == 0, 0, 0, carry);
+}
+
+void rr(CPU *cpu, u8 *loc) {
+    u8 carry = *loc & 1;
+    *loc = (*loc >> 1) | (c(cpu) << 7);
+    set_flags(cpu, *loc == 0, 0, 0, carry);
+}
+
+void sla(CPU *cpu, u8 *loc) {
+    u8 carry = *loc >> 7;
+    *loc <<= 1;
+    set_flags(cpu, *loc == 0, 0, 0, carry);
+}
+
+void sra(CPU *cpu, u8 *loc) {
+    u8 carry = *loc & 1;
+    *loc = (*loc >> 1) | (*loc & 0x80);
+    set_flags(cpu, *loc == 0, 0, 0, carry);
+}
+
+void swap(CPU *cpu, u8 *loc) {
+    *loc = (*loc << 4) | (*loc >> 4);
+    set_flags(cpu, *loc == 0, 0, 0, 0);
+}
+
+void srl(CPU *cpu, u8 *loc) {
+    u8 carry = *loc & 1;
+    *loc >>= 1;
+    set_flags(cpu, *loc == 0, 0, 0, carry);
+}
+
+u8 add(CPU *cpu, u8 val) {
+    u8 res = cpu->a + val;
+    u8 half_carry = (cpu->a & 0xf) + (val & 0xf);
+    set_z(cpu, res == 0);
+    set_n(cpu, 0);
+    set_h(cpu, (half_carry & 0x10) != 0);
+    set_c(cpu, cpu->a > 0xff - val);
+    return res;
+}
+
+u8 adc(CPU *cpu, u8 val) {
+    u8 carry = c(cpu);
+    u8 res = cpu->a + val + carry;
+    set_flags(cpu, res == 0, 0,
+              (cpu->a & 0xf) + (val & 0xf) + carry > 0xf,
+              cpu->a + val + carry > 0xff);
+    return res;
+}
+
+u8 sub(CPU *cpu, u8 val) {
+    u8 res = cpu->a - val;
+    set_z(cpu, res == 0);
+    set_n(cpu, 1);
+    set_h(cpu, (cpu->a & 0xf) < (val & 0xf));
+    set_c(cpu, cpu->a < val);
+    return res;
+}
+
+u8 sbc(CPU *cpu, u8 val) {
+    u8 carry = c(cpu);
+    u8 res = cpu->a - val - carry;
+    set_flags(cpu, res == 0, 1,
+              (cpu->a & 0xf) < (val & 0xf) + carry,
+              cpu->a < val + carry);
+    return res;
+}
+
+void add_hl(CPU *cpu, u16 val) {
+    u16 hl_val = hl(cpu);
+    set_n(cpu, 0);
+    set_h(cpu, (hl_val & 0xfff) + (val & 0xfff) > 0xfff);
+    set_c(cpu, hl_val + val > 0xffff);
+    set_hl(cpu, hl_val + val);
+}
+
+// sp + offset as used by ADD SP,e8 and LD HL,SP+e8. The flags come from
+// the unsigned low byte add.
+u16 offset_sp(CPU *cpu, i8 offset) {
+    u8 low = offset;
+    set_flags(cpu, 0, 0,
+              (cpu->sp & 0xf) + (low & 0xf) > 0xf,
+              (cpu->sp & 0xff) + low > 0xff);
+    return cpu->sp + offset;
+}
+
+// Turns a after a bcd add or subtract back into bcd
+void daa(CPU *cpu) {
+    u8 adjust = 0;
+    bool carry = c(cpu);
+    if (n(cpu)) {
+        if (carry) {
+            adjust |= 0x60;
+        }
+        if (h(cpu)) {
+            adjust |= 0x06;
+        }
+        cpu->a -= adjust;
+    } else {
+        if (carry || cpu->a > 0x99) {
+            adjust |= 0x60;
+            carry = true;
+        }
+        if (h(cpu) || (cpu->a & 0xf) > 0x9) {
+            adjust |= 0x06;
+        }
+        cpu->a += adjust;
+    }
+    set_flags(cpu, cpu->a == 0, n(cpu), 0, carry);
+}
+
+// Operand encoding shared by the cb opcodes: b, c, d, e, h, l, (hl), a
+u8 read_r8(CPU *cpu, u8 index) {
+    switch (index) {
+        case 0: {
+            return cpu->b;
+        }
+        case 1: {
+            return cpu->c;
+        }
+        case 2: {
+            return cpu->d;
+        }
+        case 3: {
+            return cpu->e;
+        }
+        case 4: {
+            return cpu->h;
+        }
+        case 5: {
+            return cpu->l;
+        }
+        case 6: {
+            return dereference_hl(cpu);
+        }
+        default: {
+            return cpu->a;
+        }
+    }
+}
+
+void write_r8(CPU *cpu, u8 index, u8 val) {
+    switch (index) {
+        case 0: {
+            cpu->b = val;
+            break;
+        }
+        case 1: {
+            cpu->c = val;
+            break;
+        }
+        case 2: {
+            cpu->d = val;
+            break;
+        }
+        case 3: {
+            cpu->e = val;
+            break;
+        }
+        case 4: {
+            cpu->h = val;
+            break;
+        }
+        case 5: {
+            cpu->l = val;
+            break;
+        }
+        case 6: {
+            set_dereference_hl(cpu, val);
+            break;
+        }
+        default: {
+            cpu->a = val;
+            break;
+        }
+    }
+}
+
+void call(CPU *cpu, u16 address) {
+    push(cpu, cpu->pc);
+    cpu->pc = address;
+    if (cpu->profiler) {
+        profile_call(cpu, address);
+    }
+}
+
+u8 pending_interrupts(CPU *cpu) {
+    return load(cpu, interrupt_enable_address) & load(cpu, interrupt_flag_address) & 0x1f;
+}
+
+void halt(CPU *cpu) {
+    if (!cpu->ime && pending_interrupts(cpu)) {
+        cpu->halt_bug = true;
+    } else {
+        cpu->halted = true;
+    }
+}
+
+// Inlined into each step variant, which fixes trace
+static inline __attribute__((always_inline)) void cb_prefix(CPU *cpu, bool trace) {
+    u8 byte = memory(cpu, cpu->pc);
+    if (trace) {
+        printf("  %02x\n", byte);
+    }
+    cpu->pc += 1;
+    cpu->cycles += cb_opcodes[byte].cycles;
+    count_metric(cpu->metrics.cb_opcodes[byte]);
+    // The low three bits pick the operand, the rest the operation
+    u8 index = byte & 7;
+    u8 n = (byte >> 3) & 7;
+    u8 val = read_r8(cpu, index);
+    switch (byte >> 6) {
+        case 0: {
+            switch (n) {
+                case 0: {
+                    rlc(cpu, &val);
+                    break;
+                }
+                case 1: {
+                    rrc(cpu, &val);
+                    break;
+                }
+                case 2: {
+                    rl(cpu, &val);
+                    break;
+                }
+                case 3: {
+                    rr(cpu, &val);
+                    break;
+                }
+                case 4: {
+                    sla(cpu, &val);
+                    break;
+                }
+                case 5: {
+                    sra(cpu, &val);
+                    break;
+                }
+                case 6: {
+                    swap(cpu, &val);
+                    break;
+                }
+                case 7: {
+                    srl(cpu, &val);
+                    break;
+                }
             }
-            case 0x1a: {
-                cpu.a = dereference_de(&cpu);
-                break;
+            break;
+        }
+        case 1: {
+            // bit only reads
+            bit(cpu, n, val);
+            return;
+        }
+        case 2: {
+            val &= ~(1 << n);
+            break;
+        }
+        case 3: {
+            val |= 1 << n;
+            break;
+        }
+    }
+    write_r8(cpu, index, val);
+}
+
+// Something the guest did that a real machine can't continue from
+void fault(CPU *cpu, const char *reason) {
+    if (cpu->fault_jump) {
+        cpu->fault_reason = reason;
+        longjmp(*cpu->fault_jump, 1);
+    }
+    dump_regs(cpu);
+    printf("%s at %04x\n", reason, cpu->pc);
+    exit(1);
+}
+
+// JR, JP and CALL, whose edges the fuzzer tracks
+bool branch_opcodes[256];
+
+void init_branch_opcodes() {
+    for (int i = 0; i < 256; i++) {
+        const char *name = opcodes[i].name;
+        branch_opcodes[i] = strncmp(name, "JR", 2) == 0 || strncmp(name, "JP", 2) == 0
+            || strncmp(name, "CALL", 4) == 0;
+    }
+}
+
+// AFL style: the edge from a branch site to wherever it went bumps one byte
+void cover_edge(CPU *cpu, u16 site) {
+    u16 location = (site * 0x9e3779b1u) >> 16;
+    u16 target = (cpu->pc * 0x9e3779b1u) >> 16;
+    cpu->coverage[location ^ (target >> 1)]++;
+}
+
+// Dispatches the highest priority pending interrupt, if ime allows it
+bool interrupt(CPU *cpu) {
+    u8 pending = pending_interrupts(cpu);
+    if (!pending) {
+        return false;
+    }
+    cpu->halted = false;
+    if (!cpu->ime) {
+        return false;
+    }
+    int i = __builtin_ctz(pending);
+    store(cpu, interrupt_flag_address, load(cpu, interrupt_flag_address) & ~(1 << i));
+    cpu->ime = false;
+    call(cpu, 0x40 + i * 8);
+    cpu->cycles += 20;
+    return true;
+}
+
+// The interpreter, instantiated below once per combination of modes that
+// would otherwise be checked on every instruction. trace and coverage are
+// always constants, so each variant only has the code its modes need.
+static inline __attribute__((always_inline)) void step_as(CPU *cpu, bool trace, bool coverage) {
+    u64 start = cpu->cycles;
+    if (interrupt(cpu)) {
+        goto scale;
+    }
+    if (cpu->halted) {
+        // Nothing happens until an event raises an interrupt, so skip there
+        if (cpu->next_event == never) {
+            fault(cpu, "halted with nothing to wake up");
+        }
+        cpu->cycles = cpu->next_event;
+        goto done;
+    }
+    if (cpu->ei_pending) {
+        cpu->ei_pending = false;
+        cpu->ime = true;
+    }
+    u16 site = cpu->pc;
+    u8 byte = memory(cpu, cpu->pc);
+    if (trace) {
+        dump_regs(cpu);
+        printf("Running %02x [%04x]\n", byte, cpu->pc);
+    }
+    if (cpu->halt_bug) {
+        cpu->halt_bug = false;
+    } else {
+        cpu->pc += 1;
+    }
+    count_metric(cpu->metrics.instructions);
+    count_metric(cpu->metrics.opcodes[byte]);
+    switch (byte) {
+        case 0x00: {
+            break;
+        }
+        case 0x01: {
+            u16 arg = parse_u16(cpu);
+            set_bc(cpu, arg);
+            break;
+        }
+        case 0x02: {
+            set_dereference_bc(cpu, cpu->a);
+            break;
+        }
+        case 0x03: {
+            set_bc(cpu, bc(cpu) + 1);
+            break;
+        }
+        case 0x04: {
+            inc(cpu, &cpu->b);
+            break;
+        }
+        case 0x05: {
+            dec(cpu, &cpu->b);
+            break;
+        }
+        case 0x06: {
+            u8 arg = parse_u8(cpu);
+            cpu->b = arg;
+            break;
+        }
+        case 0x07: {
+            rlca(cpu);
+            break;
+        }
+        case 0x08: {
+            u16 arg = parse_u16(cpu);
+            set_memory(cpu, arg, lo(cpu->sp));
+            set_memory(cpu, arg + 1, hi(cpu->sp));
+            break;
+        }
+        case 0x09: {
+            add_hl(cpu, bc(cpu));
+            break;
+        }
+        case 0x0a: {
+            cpu->a = dereference_bc(cpu);
+            break;
+        }
+        case 0x0b: {
+            set_bc(cpu, bc(cpu) - 1);
+            break;
+        }
+        case 0x0c: {
+            inc(cpu, &cpu->c);
+            break;
+        }
+        case 0x0d: {
+            dec(cpu, &cpu->c);
+            break;
+        }
+        case 0x0e: {
+            u8 arg = parse_u8(cpu);
+            cpu->c = arg;
+            break;
+        }
+        case 0x0f: {
+            rrca(cpu);
+            break;
+        }
+        case 0x10: {
+            // The operand byte is ignored
+            parse_u8(cpu);
+            if (cpu->cgb && (load(cpu, key1_address) & 0x01)) {
+                switch_speed(cpu);
             }
-            case 0x1b: {
-                set_de(&cpu, de(&cpu) - 1);
-                break;
+            break;
+        }
+        case 0x11: {
+            u16 arg = parse_u16(cpu);
+            set_de(cpu, arg);
+            break;
+        }
+        case 0x12: {
+            set_dereference_de(cpu, cpu->a);
+            break;
+        }
+        case 0x13: {
+            set_de(cpu, de(cpu) + 1);
+            break;
+        }
+        case 0x14: {
+            inc(cpu, &cpu->d);
+            break;
+        }
+        case 0x15: {
+            dec(cpu, &cpu->d);
+            break;
+        }
+        case 0x16: {
+            u8 arg = parse_u8(cpu);
+            cpu->d = arg;
+            break;
+        }
+        case 0x17: {
+            rla(cpu);
+            break;
+        }
+        case 0x18: {
+            i8 arg = parse_i8(cpu);
+            cpu->pc += arg;
+            break;
+        }
+        case 0x19: {
+            add_hl(cpu, de(cpu));
+            break;
+        }
+        case 0x1a: {
+            cpu->a = dereference_de(cpu);
+            break;
+        }
+        case 0x1b: {
+            set_de(cpu, de(cpu) - 1);
+            break;
+        }
+        case 0x1c: {
+            inc(cpu, &cpu->e);
+            break;
+        }
+        case 0x1d: {
+            dec(cpu, &cpu->e);
+            break;
+        }
+        case 0x1e: {
+            u8 arg = parse_u8(cpu);
+            cpu->e = arg;
+            break;
+        }
+        case 0x1f: {
+            rra(cpu);
+            break;
+        }
+        case 0x20: {
+            i8 arg = parse_i8(cpu);
+            if (!z(cpu)) {
+                cpu->pc += arg;
+                cpu->cycles += 4;
             }
-            case 0x1c: {
-                inc(&cpu, &cpu.e);
-                break;
+            break;
+        }
+        case 0x21: {
+            u16 arg = parse_u16(cpu);
+            set_hl(cpu, arg);
+            break;
+        }
+        case 0x22: {
+            set_dereference_hl(cpu, cpu->a);
+            set_hl(cpu, hl(cpu) + 1);
+            break;
+        }
+        case 0x23: {
+            set_hl(cpu, hl(cpu) + 1);
+            break;
+        }
+        case 0x24: {
+            inc(cpu, &cpu->h);
+            break;
+        }
+        case 0x25: {
+            dec(cpu, &cpu->h);
+            break;
+        }
+        case 0x26: {
+            u8 arg = parse_u8(cpu);
+            cpu->h = arg;
+            break;
+        }
+        case 0x27: {
+            daa(cpu);
+            break;
+        }
+        case 0x28: {
+            i8 arg = parse_i8(cpu);
+            if (z(cpu)) {
+                cpu->pc += arg;
+                cpu->cycles += 4;
             }
-            case 0x1d: {
-                dec(&cpu, &cpu.e);
-                break;
+            break;
+        }
+        case 0x29: {
+            add_hl(cpu, hl(cpu));
+            break;
+        }
+        case 0x2a: {
+            cpu->a = dereference_hl(cpu);
+            set_hl(cpu, hl(cpu) + 1);
+            break;
+        }
+        case 0x2b: {
+            set_hl(cpu, hl(cpu) - 1);
+            break;
+        }
+        case 0x2c: {
+            inc(cpu, &cpu->l);
+            break;
+        }
+        case 0x2d: {
+            dec(cpu, &cpu->l);
+            break;
+        }
+        case 0x2e: {
+            u8 arg = parse_u8(cpu);
+            cpu->l = arg;
+            break;
+        }
+        case 0x2f: {
+            cpu->a = ~cpu->a;
+            set_n(cpu, 1);
+            set_h(cpu, 1);
+            break;
+        }
+        case 0x30: {
+            i8 arg = parse_i8(cpu);
+            if (!c(cpu)) {
+                cpu->pc += arg;
+                cpu->cycles += 4;
             }
-            case 0x1e: {
-                u8 arg = parse_u8(&cpu);
-                cpu.e = arg;
-                break;
+            break;
+        }
+        case 0x31: {
+            u16 arg = parse_u16(cpu);
+            cpu->sp = arg;
+            break;
+        }
+        case 0x32: {
+            set_dereference_hl(cpu, cpu->a);
+            set_hl(cpu, hl(cpu) - 1);
+            break;
+        }
+        case 0x33: {
+            cpu->sp += 1;
+            break;
+        }
+        case 0x34: {
+            u8 val = dereference_hl(cpu);
+            inc(cpu, &val);
+            set_memory(cpu, hl(cpu), val);
+            break;
+        }
+        case 0x35: {
+            u8 val = dereference_hl(cpu);
+            dec(cpu, &val);
+            set_memory(cpu, hl(cpu), val);
+            break;
+        }
+        case 0x36: {
+            u8 arg = parse_u8(cpu);
+            set_dereference_hl(cpu, arg);
+            break;
+        }
+        case 0x37: {
+            set_n(cpu, 0);
+            set_h(cpu, 0);
+            set_c(cpu, 1);
+            break;
+        }
+        case 0x38: {
+            i8 arg = parse_i8(cpu);
+            if (c(cpu)) {
+                cpu->pc += arg;
+                cpu->cycles += 4;
             }
-            case 0x20: {
-                i8 arg = parse_i8(&cpu);
-                if (!z(&cpu)) {
-                    cpu.pc += arg;
+            break;
+        }
+        case 0x39: {
+            add_hl(cpu, cpu->sp);
+            break;
+        }
+        case 0x3a: {
+            cpu->a = dereference_hl(cpu);
+            set_hl(cpu, hl(cpu) - 1);
+            break;
+        }
+        case 0x3b: {
+            cpu->sp -= 1;
+            break;
+        }
+        case 0x3c: {
+            inc(cpu, &cpu->a);
+            break;
+        }
+        case 0x3d: {
+            dec(cpu, &cpu->a);
+            break;
+        }
+        case 0x3e: {
+            u8 arg = parse_u8(cpu);
+            cpu->a = arg;
+            break;
+        }
+        case 0x3f: {
+            set_n(cpu, 0);
+            set_h(cpu, 0);
+            set_c(cpu, !c(cpu));
+            break;
+        }
+        case 0x40: {
+            cpu->b = cpu->b;
+            break;
+        }
+        case 0x41: {
+            cpu->b = cpu->c;
+            break;
+        }
+        case 0x42: {
+            cpu->b = cpu->d;
+            break;
+        }
+        case 0x43: {
+            cpu->b = cpu->e;
+            break;
+        }
+        case 0x44: {
+            cpu->b = cpu->h;
+            break;
+        }
+        case 0x45: {
+            cpu->b = cpu->l;
+            break;
+        }
+        case 0x46: {
+            cpu->b = dereference_hl(cpu);
+            break;
+        }
+        case 0x47: {
+            cpu->b = cpu->a;
+            break;
+        }
+        case 0x48: {
+            cpu->c = cpu->b;
+            break;
+        }
+        case 0x49: {
+            cpu->c = cpu->c;
+            break;
+        }
+        case 0x4a: {
+            cpu->c = cpu->d;
+            break;
+        }
+        case 0x4b: {
+            cpu->c = cpu->e;
+            break;
+        }
+        case 0x4c: {
+            cpu->c = cpu->h;
+            break;
+        }
+        case 0x4d: {
+            cpu->c = cpu->l;
+            break;
+        }
+        case 0x4e: {
+            cpu->c = dereference_hl(cpu);
+            break;
+        }
+        case 0x4f: {
+            cpu->c = cpu->a;
+            break;
+        }
+        case 0x50: {
+            cpu->d = cpu->b;
+            break;
+        }
+        case 0x51: {
+            cpu->d = cpu->c;
+            break;
+        }
+        case 0x52: {
+            cpu->d = cpu->d;
+            break;
+        }
+        case 0x53: {
+            cpu->d = cpu->e;
+            break;
+        }
+        case 0x54: {
+            cpu->d = cpu->h;
+            break;
+        }
+        case 0x55: {
+            cpu->d = cpu->l;
+            break;
+        }
+        case 0x56: {
+            cpu->d = dereference_hl(cpu);
+            break;
+        }
+        case 0x57: {
+            cpu->d = cpu->a;
+            break;
+        }
+        case 0x58: {
+            cpu->e = cpu->b;
+            break;
+        }
+        case 0x59: {
+            cpu->e = cpu->c;
+            break;
+        }
+        case 0x5a: {
+            cpu->e = cpu->d;
+            break;
+        }
+        case 0x5b: {
+            cpu->e = cpu->e;
+            break;
+        }
+        case 0x5c: {
+            cpu->e = cpu->h;
+            break;
+        }
+        case 0x5d: {
+            cpu->e = cpu->l;
+            break;
+        }
+        case 0x5e: {
+            cpu->e = dereference_hl(cpu);
+            break;
+        }
+        case 0x5f: {
+            cpu->e = cpu->a;
+            break;
+        }
+        case 0x60: {
+            cpu->h = cpu->b;
+            break;
+        }
+        case 0x61: {
+            cpu->h = cpu->c;
+            break;
+        }
+        case 0x62: {
+            cpu->h = cpu->d;
+            break;
+        }
+        case 0x63: {
+            cpu->h = cpu->e;
+            break;
+        }
+        case 0x64: {
+            cpu->h = cpu->h;
+            break;
+        }
+        case 0x65: {
+            cpu->h = cpu->l;
+            break;
+        }
+        case 0x66: {
+            cpu->h = dereference_hl(cpu);
+            break;
+        }
+        case 0x67: {
+            cpu->h = cpu->a;
+            break;
+        }
+        case 0x68: {
+            cpu->l = cpu->b;
+            break;
+        }
+        case 0x69: {
+            cpu->l = cpu->c;
+            break;
+        }
+        case 0x6a: {
+            cpu->l = cpu->d;
+            break;
+        }
+        case 0x6b: {
+            cpu->l = cpu->e;
+            break;
+        }
+        case 0x6c: {
+            cpu->l = cpu->h;
+            break;
+        }
+        case 0x6d: {
+            cpu->l = cpu->l;
+            break;
+        }
+        case 0x6e: {
+            cpu->l = dereference_hl(cpu);
+            break;
+        }
+        case 0x6f: {
+            cpu->l = cpu->a;
+            break;
+        }
+        case 0x70: {
+            set_dereference_hl(cpu, cpu->b);
+            break;
+        }
+        case 0x71: {
+            set_dereference_hl(cpu, cpu->c);
+            break;
+        }
+        case 0x72: {
+            set_dereference_hl(cpu, cpu->d);
+            break;
+        }
+        case 0x73: {
+            set_dereference_hl(cpu, cpu->e);
+            break;
+        }
+        case 0x74: {
+            set_dereference_hl(cpu, cpu->h);
+            break;
+        }
+        case 0x75: {
+            set_dereference_hl(cpu, cpu->l);
+            break;
+        }
+        case 0x76: {
+            halt(cpu);
+            break;
+        }
+        case 0x77: {
+            set_dereference_hl(cpu, cpu->a);
+            break;
+        }
+        case 0x78: {
+            cpu->a = cpu->b;
+            break;
+        }
+        case 0x79: {
+            cpu->a = cpu->c;
+            break;
+        }
+        case 0x7a: {
+            cpu->a = cpu->d;
+            break;
+        }
+        case 0x7b: {
+            cpu->a = cpu->e;
+            break;
+        }
+        case 0x7c: {
+            cpu->a = cpu->h;
+            break;
+        }
+        case 0x7d: {
+            cpu->a = cpu->l;
+            break;
+        }
+        case 0x7e: {
+            cpu->a = dereference_hl(cpu);
+            break;
+        }
+        case 0x7f: {
+            cpu->a = cpu->a;
+            break;
+        }
+        case 0x80: {
+            cpu->a = add(cpu, cpu->b);
+            break;
+        }
+        case 0x81: {
+            cpu->a = add(cpu, cpu->c);
+            break;
+        }
+        case 0x82: {
+            cpu->a = add(cpu, cpu->d);
+            break;
+        }
+        case 0x83: {
+            cpu->a = add(cpu, cpu->e);
+            break;
+        }
+        case 0x84: {
+            cpu->a = add(cpu, cpu->h);
+            break;
+        }
+        case 0x85: {
+            cpu->a = add(cpu, cpu->l);
+            break;
+        }
+        case 0x86: {
+            cpu->a = add(cpu, dereference_hl(cpu));
+            break;
+        }
+        case 0x87: {
+            cpu->a = add(cpu, cpu->a);
+            break;
+        }
+        case 0x88: {
+            cpu->a = adc(cpu, cpu->b);
+            break;
+        }
+        case 0x89: {
+            cpu->a = adc(cpu, cpu->c);
+            break;
+        }
+        case 0x8a: {
+            cpu->a = adc(cpu, cpu->d);
+            break;
+        }
+        case 0x8b: {
+            cpu->a = adc(cpu, cpu->e);
+            break;
+        }
+        case 0x8c: {
+            cpu->a = adc(cpu, cpu->h);
+            break;
+        }
+        case 0x8d: {
+            cpu->a = adc(cpu, cpu->l);
+            break;
+        }
+        case 0x8e: {
+            cpu->a = adc(cpu, dereference_hl(cpu));
+            break;
+        }
+        case 0x8f: {
+            cpu->a = adc(cpu, cpu->a);
+            break;
+        }
+        case 0x90: {
+            cpu->a = sub(cpu, cpu->b);
+            break;
+        }
+        case 0x91: {
+            cpu->a = sub(cpu, cpu->c);
+            break;
+        }
+        case 0x92: {
+            cpu->a = sub(cpu, cpu->d);
+            break;
+        }
+        case 0x93: {
+            cpu->a = sub(cpu, cpu->e);
+            break;
+        }
+        case 0x94: {
+            cpu->a = sub(cpu, cpu->h);
+            break;
+        }
+        case 0x95: {
+            cpu->a = sub(cpu, cpu->l);
+            break;
+        }
+        case 0x96: {
+            cpu->a = sub(cpu, dereference_hl(cpu));
+            break;
+        }
+        case 0x97: {
+            cpu->a = sub(cpu, cpu->a);
+            break;
+        }
+        case 0x98: {
+            cpu->a = sbc(cpu, cpu->b);
+            break;
+        }
+        case 0x99: {
+            cpu->a = sbc(cpu, cpu->c);
+            break;
+        }
+        case 0x9a: {
+            cpu->a = sbc(cpu, cpu->d);
+            break;
+        }
+        case 0x9b: {
+            cpu->a = sbc(cpu, cpu->e);
+            break;
+        }
+        case 0x9c: {
+            cpu->a = sbc(cpu, cpu->h);
+            break;
+        }
+        case 0x9d: {
+            cpu->a = sbc(cpu, cpu->l);
+            break;
+        }
+        case 0x9e: {
+            cpu->a = sbc(cpu, dereference_hl(cpu));
+            break;
+        }
+        case 0x9f: {
+            cpu->a = sbc(cpu, cpu->a);
+            break;
+        }
+        case 0xa0: {
+            and(cpu, cpu->b);
+            break;
+        }
+        case 0xa1: {
+            and(cpu, cpu->c);
+            break;
+        }
+        case 0xa2: {
+            and(cpu, cpu->d);
+            break;
+        }
+        case 0xa3: {
+            and(cpu, cpu->e);
+            break;
+        }
+        case 0xa4: {
+            and(cpu, cpu->h);
+            break;
+        }
+        case 0xa5: {
+            and(cpu, cpu->l);
+            break;
+        }
+        case 0xa6: {
+            and(cpu, dereference_hl(cpu));
+            break;
+        }
+        case 0xa7: {
+            and(cpu, cpu->a);
+            break;
+        }
+        case 0xa8: {
+            xor(cpu, cpu->b);
+            break;
+        }
+        case 0xa9: {
+            xor(cpu, cpu->c);
+            break;
+        }
+        case 0xaa: {
+            xor(cpu, cpu->d);
+            break;
+        }
+        case 0xab: {
+            xor(cpu, cpu->e);
+            break;
+        }
+        case 0xac: {
+            xor(cpu, cpu->h);
+            break;
+        }
+        case 0xad: {
+            xor(cpu, cpu->l);
+            break;
+        }
+        case 0xae: {
+            xor(cpu, dereference_hl(cpu));
+            break;
+        }
+        case 0xaf: {
+            xor(cpu, cpu->a);
+            break;
+        }
+        case 0xb0: {
+            or(cpu, cpu->b);
+            break;
+        }
+        case 0xb1: {
+            or(cpu, cpu->c);
+            break;
+        }
+        case 0xb2: {
+            or(cpu, cpu->d);
+            break;
+        }
+        case 0xb3: {
+            or(cpu, cpu->e);
+            break;
+        }
+        case 0xb4: {
+            or(cpu, cpu->h);
+            break;
+        }
+        case 0xb5: {
+            or(cpu, cpu->l);
+            break;
+        }
+        case 0xb6: {
+            or(cpu, dereference_hl(cpu));
+            break;
+        }
+        case 0xb7: {
+            or(cpu, cpu->a);
+            break;
+        }
+        case 0xb8: {
+            sub(cpu, cpu->b);
+            break;
+        }
+        case 0xb9: {
+            sub(cpu, cpu->c);
+            break;
+        }
+        case 0xba: {
+            sub(cpu, cpu->d);
+            break;
+        }
+        case 0xbb: {
+            sub(cpu, cpu->e);
+            break;
+        }
+        case 0xbc: {
+            sub(cpu, cpu->h);
+            break;
+        }
+        case 0xbd: {
+            sub(cpu, cpu->l);
+            break;
+        }
+        case 0xbe: {
+            sub(cpu, dereference_hl(cpu));
+            break;
+        }
+        case 0xbf: {
+            sub(cpu, cpu->a);
+            break;
+        }
+        case 0xc0: {
+            if (!z(cpu)) {
+                cpu->pc = pop(cpu);
+                cpu->cycles += 12;
+                if (cpu->profiler) {
+                    profile_return(cpu);
                 }
-                break;
             }
-            case 0x21: {
-                u16 arg = parse_u16(&cpu);
-                set_hl(&cpu, arg);
-                break;
-            }
-            case 0x22: {
-                set_dereference_hl(&cpu, cpu.a);
-                set_hl(&cpu, hl(&cpu) + 1);
-                break;
-            }
-            case 0x23: {
-                set_hl(&cpu, hl(&cpu) + 1);
-                break;
-            }
-            case 0x24: {
-                inc(&cpu, &cpu.h);
-                break;
-            }
-            case 0x25: {
-                dec(&cpu, &cpu.h);
-                break;
+            break;
+        }
+        case 0xc1: {
+            set_bc(cpu, pop(cpu));
+            break;
+        }
+        case 0xc2: {
+            u16 arg = parse_u16(cpu);
+            if (!z(cpu)) {
+                cpu->pc = arg;
+                cpu->cycles += 4;
             }
-            case 0x26: {
-                u8 arg = parse_u8(&cpu);
-                cpu.h = arg;
-                break;
+            break;
+        }
+        case 0xc3: {
+            u16 arg = parse_u16(cpu);
+            cpu->pc = arg;
+            break;
+        }
+        case 0xc4: {
+            u16 arg = parse_u16(cpu);
+            if (!z(cpu)) {
+                call(cpu, arg);
+                cpu->cycles += 12;
             }
-            case 0x28: {
-                i8 arg = parse_i8(&cpu);
-                if (z(&cpu)) {
-                    cpu.pc += arg;
+            break;
+        }
+        case 0xc5: {
+            push(cpu, bc(cpu));
+            break;
+        }
+        case 0xc6: {
+            u8 arg = parse_u8(cpu);
+            cpu->a = add(cpu, arg);
+            break;
+        }
+        case 0xc7: {
+            call(cpu, 0x00);
+            break;
+        }
+        case 0xc8: {
+            if (z(cpu)) {
+                cpu->pc = pop(cpu);
+                cpu->cycles += 12;
+                if (cpu->profiler) {
+                    profile_return(cpu);
                 }
-                break;
-            }
-            case 0x2a: {
-                cpu.a = dereference_hl(&cpu);
-                set_hl(&cpu, hl(&cpu) + 1);
-                break;
-            }
-            case 0x2b: {
-                set_hl(&cpu, hl(&cpu) - 1);
-                break;
             }
-            case 0x2c: {
-                inc(&cpu, &cpu.l);
-                break;
+            break;
+        }
+        case 0xc9: {
+            cpu->pc = pop(cpu);
+            if (cpu->profiler) {
+                profile_return(cpu);
             }
-            case 0x2d: {
-                dec(&cpu, &cpu.l);
-                break;
+            break;
+        }
+        case 0xca: {
+            u16 arg = parse_u16(cpu);
+            if (z(cpu)) {
+                cpu->pc = arg;
+                cpu->cycles += 4;
             }
-            case 0x2e: {
-                u8 arg = parse_u8(&cpu);
-                cpu.l = arg;
-                break;
+            break;
+        }
+        case 0xcb: {
+            cb_prefix(cpu, trace);
+            break;
+        }
+        case 0xcc: {
+            u16 arg = parse_u16(cpu);
+            if (z(cpu)) {
+                call(cpu, arg);
+                cpu->cycles += 12;
             }
-            case 0x30: {
-                i8 arg = parse_i8(&cpu);
-                if (!c(&cpu)) {
-                    cpu.pc += arg;
+            break;
+        }
+        case 0xcd: {
+            u16 arg = parse_u16(cpu);
+            call(cpu, arg);
+            break;
+        }
+        case 0xce: {
+            u8 arg = parse_u8(cpu);
+            cpu->a = adc(cpu, arg);
+            break;
+        }
+        case 0xcf: {
+            call(cpu, 0x08);
+            break;
+        }
+        case 0xd0: {
+            if (!c(cpu)) {
+                cpu->pc = pop(cpu);
+                cpu->cycles += 12;
+                if (cpu->profiler) {
+                    profile_return(cpu);
                 }
-                break;
-            }
-            case 0x31: {
-                u16 arg = parse_u16(&cpu);
-                cpu.sp = arg;
-                break;
-            }
-            case 0x32: {
-                set_dereference_hl(&cpu, cpu.a);
-                set_hl(&cpu, hl(&cpu) - 1);
-                break;
-            }
-            case 0x33: {
-                cpu.sp += 1;
-                break;
-            }
-            case 0x34: {
-                u8 val = dereference_hl(&cpu);
-                inc(&cpu, &val);
-                set_memory(&cpu, hl(&cpu), val);
-                break;
             }
-            case 0x35: {
-                u8 val = dereference_hl(&cpu);
-                dec(&cpu, &val);
-                set_memory(&cpu, hl(&cpu), val);
-                break;
+            break;
+        }
+        case 0xd1: {
+            set_de(cpu, pop(cpu));
+            break;
+        }
+        case 0xd2: {
+            u16 arg = parse_u16(cpu);
+            if (!c(cpu)) {
+                cpu->pc = arg;
+                cpu->cycles += 4;
             }
-            case 0x36: {
-                u8 arg = parse_u8(&cpu);
-                set_dereference_hl(&cpu, arg);
-                break;
+            break;
+        }
+        case 0xd4: {
+            u16 arg = parse_u16(cpu);
+            if (!c(cpu)) {
+                call(cpu, arg);
+                cpu->cycles += 12;
             }
-            case 0x38: {
-                i8 arg = parse_i8(&cpu);
-                if (c(&cpu)) {
-                    cpu.pc += arg;
+            break;
+        }
+        case 0xd5: {
+            push(cpu, de(cpu));
+            break;
+        }
+        case 0xd6: {
+            u8 arg = parse_u8(cpu);
+            cpu->a = sub(cpu, arg);
+            break;
+        }
+        case 0xd7: {
+            call(cpu, 0x10);
+            break;
+        }
+        case 0xd8: {
+            if (c(cpu)) {
+                cpu->pc = pop(cpu);
+                cpu->cycles += 12;
+                if (cpu->profiler) {
+                    profile_return(cpu);
                 }
-                break;
-            }
-            case 0x3a: {
-                cpu.a = dereference_hl(&cpu);
-                set_hl(&cpu, hl(&cpu) - 1);
-                break;
-            }
-            case 0x3b: {
-                cpu.sp -= 1;
-                break;
-            }
-            case 0x3c: {
-                inc(&cpu, &cpu.a);
-                break;
-            }
-            case 0x3d: {
-                dec(&cpu, &cpu.a);
-                break;
-            }
-            case 0x3e: {
-                u8 arg = parse_u8(&cpu);
-                cpu.a = arg;
-                break;
-            }
-            case 0x40: {
-                cpu.b = cpu.b;
-                break;
-            }
-            case 0x41: {
-                cpu.b = cpu.c;
-                break;
-            }
-            case 0x42: {
-                cpu.b = cpu.d;
-                break;
-            }
-            case 0x43: {
-                cpu.b = cpu.e;
-                break;
-            }
-            case 0x44: {
-                cpu.b = cpu.h;
-                break;
-            }
-            case 0x45: {
-                cpu.b = cpu.l;
-                break;
-            }
-            case 0x46: {
-                cpu.b = dereference_hl(&cpu);
-                break;
-            }
-            case 0x47: {
-                cpu.b = cpu.a;
-                break;
-            }
-            case 0x48: {
-                cpu.c = cpu.b;
-                break;
-            }
-            case 0x49: {
-                cpu.c = cpu.c;
-                break;
-            }
-            case 0x4a: {
-                cpu.c = cpu.d;
-                break;
-            }
-            case 0x4b: {
-                cpu.c = cpu.e;
-                break;
-            }
-            case 0x4c: {
-                cpu.c = cpu.h;
-                break;
             }
-            case 0x4d: {
-                cpu.c = cpu.l;
-                break;
-            }
-            case 0x4e: {
-                cpu.c = dereference_hl(&cpu);
-                break;
-            }
-            case 0x4f: {
-                cpu.c = cpu.a;
-                break;
-            }
-            case 0x50: {
-                cpu.d = cpu.b;
-                break;
-            }
-            case 0x51: {
-                cpu.d = cpu.c;
-                break;
-            }
-            case 0x52: {
-                cpu.d = cpu.d;
-                break;
-            }
-            case 0x53: {
-                cpu.d = cpu.e;
-                break;
-            }
-            case 0x54: {
-                cpu.d = cpu.h;
-                break;
-            }
-            case 0x55: {
-                cpu.d = cpu.l;
-                break;
-            }
-            case 0x56: {
-                cpu.d = dereference_hl(&cpu);
-                break;
-            }
-            case 0x57: {
-                cpu.d = cpu.a;
-                break;
-            }
-            case 0x58: {
-                cpu.e = cpu.b;
-                break;
-            }
-            case 0x59: {
-                cpu.e = cpu.c;
-                break;
-            }
-            case 0x5a: {
-                cpu.e = cpu.d;
-                break;
-            }
-            case 0x5b: {
-                cpu.e = cpu.e;
-                break;
-            }
-            case 0x5c: {
-                cpu.e = cpu.h;
-                break;
-            }
-            case 0x5d: {
-                cpu.e = cpu.l;
-                break;
-            }
-            case 0x5e: {
-                cpu.e = dereference_hl(&cpu);
-                break;
-            }
-            case 0x5f: {
-                cpu.e = cpu.a;
-                break;
-            }
-            case 0x60: {
-                cpu.h = cpu.b;
-                break;
-            }
-            case 0x61: {
-                cpu.h = cpu.c;
-                break;
-            }
-            case 0x62: {
-                cpu.h = cpu.d;
-                break;
+            break;
+        }
+        case 0xd9: {
+            cpu->pc = pop(cpu);
+            cpu->ime = true;
+            if (cpu->profiler) {
+                profile_return(cpu);
             }
-            case 0x63: {
-                cpu.h = cpu.e;
-                break;
+            break;
+        }
+        case 0xda: {
+            u16 arg = parse_u16(cpu);
+            if (c(cpu)) {
+                cpu->pc = arg;
+                cpu->cycles += 4;
             }
-            case 0x64: {
-                cpu.h = cpu.h;
-                break;
+            break;
+        }
+        case 0xdc: {
+            u16 arg = parse_u16(cpu);
+            if (c(cpu)) {
+                call(cpu, arg);
+                cpu->cycles += 12;
             }
-            case 0x65: {
-                cpu.h = cpu.l;
+            break;
+        }
+        case 0xde: {
+            u8 arg = parse_u8(cpu);
+            cpu->a = sbc(cpu, arg);
+            break;
+        }
+        case 0xdf: {
+            call(cpu, 0x18);
+            break;
+        }
+        case 0xe0: {
+            u8 arg = parse_u8(cpu);
+            set_memory(cpu, 0xff00 + arg, cpu->a);
+            break;
+        }
+        case 0xe1: {
+            set_hl(cpu, pop(cpu));
+            break;
+        }
+        case 0xe2: {
+            set_memory(cpu, 0xff00 + cpu->c, cpu->a);
+            break;
+        }
+        case 0xe5: {
+            push(cpu, hl(cpu));
+            break;
+        }
+        case 0xe6: {
+            u8 arg = parse_u8(cpu);
+            and(cpu, arg);
+            break;
+        }
+        case 0xe7: {
+            call(cpu, 0x20);
+            break;
+        }
+        case 0xe8: {
+            i8 arg = parse_i8(cpu);
+            cpu->sp = offset_sp(cpu, arg);
+            break;
+        }
+        case 0xe9: {
+            cpu->pc = hl(cpu);
+            break;
+        }
+        case 0xea: {
+            u16 arg = parse_u16(cpu);
+            set_memory(cpu, arg, cpu->a);
+            break;
+        }
+        case 0xee: {
+            u8 arg = parse_u8(cpu);
+            xor(cpu, arg);
+            break;
+        }
+        case 0xef: {
+            call(cpu, 0x28);
+            break;
+        }
+        case 0xf0: {
+            u8 arg = parse_u8(cpu);
+            cpu->a = memory(cpu, 0xff00 + arg);
+            break;
+        }
+        case 0xf1: {
+            set_af(cpu, pop(cpu));
+            break;
+        }
+        case 0xf2: {
+            cpu->a = memory(cpu, 0xff00 + cpu->c);
+            break;
+        }
+        case 0xf3: {
+            cpu->ime = false;
+            cpu->ei_pending = false;
+            break;
+        }
+        case 0xf5: {
+            push(cpu, af(cpu));
+            break;
+        }
+        case 0xf6: {
+            u8 arg = parse_u8(cpu);
+            or(cpu, arg);
+            break;
+        }
+        case 0xf7: {
+            call(cpu, 0x30);
+            break;
+        }
+        case 0xf8: {
+            i8 arg = parse_i8(cpu);
+            set_hl(cpu, offset_sp(cpu, arg));
+            break;
+        }
+        case 0xf9: {
+            cpu->sp = hl(cpu);
+            break;
+        }
+        case 0xfa: {
+            u16 arg = parse_u16(cpu);
+            cpu->a = memory(cpu, arg);
+            break;
+        }
+        case 0xfb: {
+            // Takes effect after the next instruction
+            cpu->ei_pending = true;
+            break;
+        }
+        case 0xfe: {
+            u8 arg = parse_u8(cpu);
+            sub(cpu, arg);
+            break;
+        }
+        case 0xff: {
+            call(cpu, 0x38);
+            break;
+        }
+        default: {
+            // The real cpu locks up
+            cpu->pc = site;
+            fault(cpu, "illegal opcode");
+        }
+    }
+    if (coverage && branch_opcodes[byte]) {
+        cover_edge(cpu, site);
+    }
+    cpu->cycles += opcodes[byte].cycles;
+scale:
+    // Costs above are in cpu clocks, which double speed fits twice into a
+    // cycle. Branch free, so dmg titles pay a shift and no more.
+    cpu->cycles = start + ((cpu->cycles - start) >> cpu->double_speed);
+done:
+    if (cpu->cycles >= cpu->next_event) {
+        run_events(cpu);
+    }
+}
+
+typedef void (*Core)(CPU *cpu);
+
+void step_plain(CPU *cpu) {
+    step_as(cpu, false, false);
+}
+
+void step_traced(CPU *cpu) {
+    step_as(cpu, true, false);
+}
+
+void step_covered(CPU *cpu) {
+    step_as(cpu, false, true);
+}
+
+void step_traced_covered(CPU *cpu) {
+    step_as(cpu, true, true);
+}
+
+// The variant for cpu's current modes. Loops pick it once and again only
+// when a mode may have changed.
+Core step_core(CPU *cpu) {
+    static const Core cores[2][2] = {
+        {step_plain, step_covered},
+        {step_traced, step_traced_covered},
+    };
+    return cores[cpu->trace][cpu->coverage != NULL];
+}
+
+// One instruction in whatever modes cpu is in, for callers that don't
+// loop
+void step(CPU *cpu) {
+    step_core(cpu)(cpu);
+}
+
+// Runs until vblank or, with a debugger, a page with a breakpoint. The run
+// loop's own variants, so there's no breakpoint check without a debugger.
+#define define_run_frame(name, core, debugger) \
+    void name(CPU *cpu) { \
+        while (!cpu->frame_done && !(debugger && cpu->break_pages[cpu->pc >> 8])) { \
+            core(cpu); \
+        } \
+    }
+
+define_run_frame(run_frame_plain, step_plain, false)
+define_run_frame(run_frame_traced, step_traced, false)
+define_run_frame(run_frame_debugged, step_plain, true)
+define_run_frame(run_frame_traced_debugged, step_traced, true)
+
+Core run_frame_core(CPU *cpu) {
+    static const Core cores[2][2] = {
+        {run_frame_plain, run_frame_debugged},
+        {run_frame_traced, run_frame_traced_debugged},
+    };
+    return cores[cpu->trace][cpu->debugger != NULL];
+}
+
+// Labels from an RGBDS / no$gmb style .sym file, sorted by bank << 16 | address
+typedef struct Symbol {
+    u32 key;
+    char *name;
+} Symbol;
+
+typedef struct Symbols {
+    Symbol *entries;
+    int count;
+} Symbols;
+
+Symbols symbols;
+
+int compare_symbols(const void *a, const void *b) {
+    u32 x = ((const Symbol *) a)->key;
+    u32 y = ((const Symbol *) b)->key;
+    return (x > y) - (x < y);
+}
+
+bool load_symbols(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    int capacity = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned bank;
+        unsigned address;
+        char name[128];
+        // Lines look like "01:4a3f Label"; ';' starts a comment
+        if (line[0] == ';' || sscanf(line, "%x:%x %127s", &bank, &address, name) != 3) {
+            continue;
+        }
+        if (symbols.count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            symbols.entries = realloc(symbols.entries, capacity * sizeof(Symbol));
+            assert(symbols.entries);
+        }
+        symbols.entries[symbols.count++] = (Symbol) {(bank & 0xff) << 16 | (address & 0xffff), strdup(name)};
+    }
+    bool ok = !ferror(f);
+    ok &= fclose(f) == 0;
+    qsort(symbols.entries, symbols.count, sizeof(Symbol), compare_symbols);
+    return ok;
+}
+
+const char *symbol_at(u8 bank, u16 address) {
+    u32 key = bank << 16 | address;
+    int lo = 0;
+    int hi = symbols.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (symbols.entries[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < symbols.count && symbols.entries[lo].key == key) {
+        return symbols.entries[lo].name;
+    }
+    return NULL;
+}
+
+bool symbol_address(const char *name, u16 *address) {
+    for (int i = 0; i < symbols.count; i++) {
+        if (strcmp(symbols.entries[i].name, name) == 0) {
+            *address = symbols.entries[i].key & 0xffff;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Which rom bank a cpu address is in, for symbol lookups
+u8 bank_of(u16 address, u8 current_bank) {
+    if (address < 0x4000) {
+        return 0;
+    } else if (address < 0x8000) {
+        return current_bank;
+    }
+    return 0;
+}
+
+#define instruction_text_len 64
+
+char *append_text(char *out, const char *text) {
+    while (*text) {
+        *out++ = *text++;
+    }
+    return out;
+}
+
+char *append_hex(char *out, u32 val, int digits) {
+    for (int i = digits - 1; i >= 0; i--) {
+        *out++ = "0123456789abcdef"[(val >> (i * 4)) & 0xf];
+    }
+    return out;
+}
+
+char *append_address(char *out, u16 address, u8 bank) {
+    const char *name = symbol_at(bank_of(address, bank), address);
+    if (name) {
+        return append_text(out, name);
+    }
+    *out++ = '$';
+    return append_hex(out, address, 4);
+}
+
+// Formats the instruction whose bytes start at bytes, which lives at
+// address in the given rom bank, into out (instruction_text_len long).
+// Returns the instruction length. Written by hand rather than with printf so
+// a whole rom streams through in milliseconds.
+int format_instruction(const u8 *bytes, u16 address, u8 bank, char *out) {
+    if (bytes[0] == 0xcb) {
+        *append_text(out, cb_opcodes[bytes[1]].name) = '\0';
+        return 2;
+    }
+    const Opcode *opcode = &opcodes[bytes[0]];
+    if (opcode->name[0] == '-') {
+        out = append_text(out, "db $");
+        *append_hex(out, bytes[0], 2) = '\0';
+        return 1;
+    }
+    for (const char *c = opcode->name; *c; c++) {
+        if (*c != '%') {
+            *out++ = *c;
+            continue;
+        }
+        switch (opcode->operand) {
+            case OPERAND_D8: {
+                *out++ = '$';
+                out = append_hex(out, bytes[1], 2);
                 break;
             }
-            case 0x66: {
-                cpu.h = dereference_hl(&cpu);
+            case OPERAND_D16: {
+                *out++ = '$';
+                out = append_hex(out, make_u16(bytes[2], bytes[1]), 4);
                 break;
             }
-            case 0x67: {
-                cpu.h = cpu.a;
+            case OPERAND_A8: {
+                out = append_address(out, 0xff00 + bytes[1], bank);
                 break;
             }
-            case 0x68: {
-                cpu.l = cpu.b;
+            case OPERAND_A16: {
+                out = append_address(out, make_u16(bytes[2], bytes[1]), bank);
                 break;
             }
-            case 0x69: {
-                cpu.l = cpu.c;
+            case OPERAND_R8: {
+                out = append_address(out, address + 2 + (i8) bytes[1], bank);
                 break;
             }
-            case 0x6a: {
-                cpu.l = cpu.d;
+            case OPERAND_S8: {
+                i8 offset = bytes[1];
+                *out++ = offset < 0 ? '-' : '+';
+                *out++ = '$';
+                out = append_hex(out, offset < 0 ? -offset : offset, 2);
                 break;
             }
-            case 0x6b: {
-                cpu.l = cpu.e;
-                break;
+        }
+    }
+    *out = '\0';
+    return opcode->length;
+}
+
+// Writes the instruction at address into out (instruction_text_len long)
+// and returns its length
+int disassemble(CPU *cpu, u16 address, char *out) {
+    u8 bytes[3];
+    for (int i = 0; i < 3; i++) {
+        bytes[i] = peek(cpu, address + i);
+    }
+    return format_instruction(bytes, address, 1, out);
+}
+
+void print_instruction(CPU *cpu, u16 address) {
+    char text[instruction_text_len];
+    disassemble(cpu, address, text);
+    const char *label = symbol_at(bank_of(address, 1), address);
+    if (label) {
+        printf("%s:\n", label);
+    }
+    printf("%04x: %s\n", address, text);
+}
+
+// Streams a linear disassembly of a whole rom file to stdout. Returns
+// false, with errno set, if the file can't be read.
+bool disassemble_rom(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    long len = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    if (len < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return false;
+    }
+    // Padded so the last instruction can read past the end
+    u8 *data = calloc(len + 3, 1);
+    assert(data);
+    bool ok = fread(data, 1, len, f) == (size_t) len;
+    ok &= fclose(f) == 0;
+    if (!ok) {
+        free(data);
+        return false;
+    }
+
+    static char buffer[1 << 16];
+    size_t used = 0;
+    for (long offset = 0; offset < len;) {
+        if (used > sizeof(buffer) - 256) {
+            fwrite(buffer, 1, used, stdout);
+            used = 0;
+        }
+        u8 bank = offset >> 14;
+        u16 address = bank ? 0x4000 | (offset & 0x3fff) : offset;
+        char *out = buffer + used;
+        const char *label = symbol_at(bank, address);
+        if (label) {
+            out = append_text(out, label);
+            out = append_text(out, ":\n");
+        }
+        char text[instruction_text_len];
+        int length = format_instruction(data + offset, address, bank, text);
+        out = append_hex(out, bank, 2);
+        *out++ = ':';
+        out = append_hex(out, address, 4);
+        *out++ = ' ';
+        for (int i = 0; i < 3; i++) {
+            if (i < length) {
+                *out++ = ' ';
+                out = append_hex(out, data[offset + i], 2);
+            } else {
+                out = append_text(out, "   ");
             }
-            case 0x6c: {
-                cpu.l = cpu.h;
-                break;
+        }
+        out = append_text(out, "  ");
+        out = append_text(out, text);
+        *out++ = '\n';
+        used = out - buffer;
+        offset += length;
+    }
+    fwrite(buffer, 1, used, stdout);
+    free(data);
+    return true;
+}
+
+void routine_name(u16 routine, char *out, size_t len) {
+    const char *label = symbol_at(bank_of(routine, 1), routine);
+    if (label) {
+        snprintf(out, len, "%s", label);
+    } else {
+        snprintf(out, len, "$%04x", routine);
+    }
+}
+
+u32 *sort_keys;
+
+int compare_by_count(const void *a, const void *b) {
+    u32 x = sort_keys[*(const u16 *) a];
+    u32 y = sort_keys[*(const u16 *) b];
+    return (x < y) - (x > y);
+}
+
+// Sorts all 64K addresses by descending count into order
+void rank(u32 *counts, u16 *order) {
+    for (int i = 0; i < 0x10000; i++) {
+        order[i] = i;
+    }
+    sort_keys = counts;
+    qsort(order, 0x10000, sizeof(u16), compare_by_count);
+}
+
+// Prints the flat and per-routine reports to stderr and writes the sampled
+// stacks in the folded format flamegraph.pl and speedscope read
+void report_profile(CPU *cpu, const char *folded_path) {
+    Profiler *profiler = cpu->profiler;
+    double total = profiler->total_samples ? profiler->total_samples : 1;
+    static u16 order[0x10000];
+
+    fprintf(stderr, "%llu samples, one per %llu cycles\n",
+            (unsigned long long) profiler->total_samples, (unsigned long long) profiler->interval);
+    fprintf(stderr, "\nhot instructions:\n");
+    rank(profiler->pc_samples, order);
+    for (int i = 0; i < 20 && profiler->pc_samples[order[i]]; i++) {
+        u16 pc = order[i];
+        char text[instruction_text_len];
+        disassemble(cpu, pc, text);
+        fprintf(stderr, "%6.2f%% %8u  %04x  %s\n",
+                100 * profiler->pc_samples[pc] / total, profiler->pc_samples[pc], pc, text);
+    }
+
+    static u32 self[0x10000];
+    static u32 inclusive[0x10000];
+    memset(self, 0, sizeof(self));
+    memset(inclusive, 0, sizeof(inclusive));
+    FILE *folded = folded_path ? fopen(folded_path, "w") : NULL;
+    if (folded_path && !folded) {
+        perror(folded_path);
+    }
+    for (size_t i = 0; i < profiler->stack_capacity; i++) {
+        StackSample *sample = &profiler->stacks[i];
+        if (!sample->count) {
+            continue;
+        }
+        self[sample->routines[sample->depth - 1]] += sample->count;
+        for (int j = 0; j < sample->depth; j++) {
+            // Count recursive routines once per stack
+            bool seen = false;
+            for (int k = 0; k < j; k++) {
+                seen |= sample->routines[k] == sample->routines[j];
             }
-            case 0x6d: {
-                cpu.l = cpu.l;
-                break;
+            if (!seen) {
+                inclusive[sample->routines[j]] += sample->count;
             }
-            case 0x6e: {
-                cpu.l = dereference_hl(&cpu);
-                break;
+            if (folded) {
+                char name[64];
+                routine_name(sample->routines[j], name, sizeof(name));
+                fprintf(folded, j ? ";%s" : "%s", name);
             }
-            case 0x6f: {
-                cpu.l = cpu.a;
-                break;
+        }
+        if (folded) {
+            fprintf(folded, " %u\n", sample->count);
+        }
+    }
+    if (folded) {
+        // A full disk only shows up once the buffered stacks are flushed
+        if (fclose(folded) != 0) {
+            perror(folded_path);
+        } else {
+            fprintf(stderr, "\nwrote folded stacks to %s\n", folded_path);
+        }
+    }
+
+    fprintf(stderr, "\nhot routines:\n   self%%  total%%  routine\n");
+    rank(self, order);
+    for (int i = 0; i < 20 && self[order[i]]; i++) {
+        char name[64];
+        routine_name(order[i], name, sizeof(name));
+        fprintf(stderr, "%7.2f %7.2f  %s\n",
+                100 * self[order[i]] / total, 100 * inclusive[order[i]] / total, name);
+    }
+}
+
+typedef enum MetricsFormat {
+    METRICS_NONE,
+    METRICS_JSON,
+    METRICS_PROMETHEUS,
+} MetricsFormat;
+
+// video is the GPU that actually renders, which is the render thread's in
+// threaded mode
+void dump_metrics(CPU *cpu, GPU *video, MetricsFormat format, FILE *out) {
+#ifndef NO_METRICS
+    CpuMetrics *m = &cpu->metrics;
+    u64 lines = atomic_load_explicit(&video->metrics.lines, memory_order_relaxed);
+    u64 tile_rows = atomic_load_explicit(&video->metrics.tile_rows, memory_order_relaxed);
+    u64 reused_lines = atomic_load_explicit(&video->metrics.reused_lines, memory_order_relaxed);
+    // The first vblank only starts the clock
+    u64 timed_frames = m->frames > 1 ? m->frames - 1 : 1;
+    if (format == METRICS_JSON) {
+        fprintf(out, "{\"instructions\": %llu, \"cycles\": %llu, "
+                "\"memory\": {\"fast_reads\": %llu, \"fast_writes\": %llu, "
+                "\"slow_reads\": %llu, \"slow_writes\": %llu}, "
+                "\"frames\": %llu, \"lines\": %llu, \"reused_lines\": %llu, \"tile_rows\": %llu, "
+                "\"frame_ns\": {\"last\": %llu, \"max\": %llu, \"mean\": %llu}",
+                (unsigned long long) m->instructions, (unsigned long long) cpu->cycles,
+                (unsigned long long) m->fast_reads, (unsigned long long) m->fast_writes,
+                (unsigned long long) m->slow_reads, (unsigned long long) m->slow_writes,
+                (unsigned long long) m->frames, (unsigned long long) lines,
+                (unsigned long long) reused_lines,
+                (unsigned long long) tile_rows, (unsigned long long) m->last_frame_ns,
+                (unsigned long long) m->max_frame_ns,
+                (unsigned long long) (m->total_frame_ns / timed_frames));
+        for (int cb = 0; cb < 2; cb++) {
+            u64 *counts = cb ? m->cb_opcodes : m->opcodes;
+            fprintf(out, cb ? ", \"cb_opcodes\": {" : ", \"opcodes\": {");
+            bool first = true;
+            for (int i = 0; i < 0x100; i++) {
+                if (counts[i]) {
+                    fprintf(out, "%s\"%02x\": %llu", first ? "" : ", ", i,
+                            (unsigned long long) counts[i]);
+                    first = false;
+                }
             }
-            case 0x70: {
-                set_dereference_hl(&cpu, cpu.b);
-                break;
+            fprintf(out, "}");
+        }
+        fprintf(out, "}\n");
+    } else if (format == METRICS_PROMETHEUS) {
+        fprintf(out, "# TYPE gameboy_instructions_total counter\n"
+                "gameboy_instructions_total %llu\n"
+                "# TYPE gameboy_cycles_total counter\n"
+                "gameboy_cycles_total %llu\n"
+                "# TYPE gameboy_memory_accesses_total counter\n"
+                "gameboy_memory_accesses_total{path=\"fast\",kind=\"read\"} %llu\n"
+                "gameboy_memory_accesses_total{path=\"fast\",kind=\"write\"} %llu\n"
+                "gameboy_memory_accesses_total{path=\"slow\",kind=\"read\"} %llu\n"
+                "gameboy_memory_accesses_total{path=\"slow\",kind=\"write\"} %llu\n"
+                "# TYPE gameboy_frames_total counter\n"
+                "gameboy_frames_total %llu\n"
+                "# TYPE gameboy_lines_rendered_total counter\n"
+                "gameboy_lines_rendered_total %llu\n"
+                "# TYPE gameboy_lines_reused_total counter\n"
+                "gameboy_lines_reused_total %llu\n"
+                "# TYPE gameboy_tile_rows_decoded_total counter\n"
+                "gameboy_tile_rows_decoded_total %llu\n"
+                "# TYPE gameboy_frame_host_seconds gauge\n"
+                "gameboy_frame_host_seconds{stat=\"last\"} %.9f\n"
+                "gameboy_frame_host_seconds{stat=\"max\"} %.9f\n"
+                "gameboy_frame_host_seconds{stat=\"mean\"} %.9f\n",
+                (unsigned long long) m->instructions, (unsigned long long) cpu->cycles,
+                (unsigned long long) m->fast_reads, (unsigned long long) m->fast_writes,
+                (unsigned long long) m->slow_reads, (unsigned long long) m->slow_writes,
+                (unsigned long long) m->frames, (unsigned long long) lines,
+                (unsigned long long) reused_lines,
+                (unsigned long long) tile_rows, m->last_frame_ns / 1e9,
+                m->max_frame_ns / 1e9, m->total_frame_ns / 1e9 / timed_frames);
+        fprintf(out, "# TYPE gameboy_opcode_executions_total counter\n");
+        for (int cb = 0; cb < 2; cb++) {
+            u64 *counts = cb ? m->cb_opcodes : m->opcodes;
+            for (int i = 0; i < 0x100; i++) {
+                if (counts[i]) {
+                    fprintf(out, "gameboy_opcode_executions_total{opcode=\"%s%02x\"} %llu\n",
+                            cb ? "cb" : "", i, (unsigned long long) counts[i]);
+                }
             }
-            case 0x71: {
-                set_dereference_hl(&cpu, cpu.c);
-                break;
+        }
+    }
+    fflush(out);
+#else
+    (void) cpu;
+    (void) video;
+    (void) format;
+    (void) out;
+#endif
+}
+
+// Accepts a label or a hex address
+u16 parse_address(const char *text) {
+    u16 address;
+    if (symbol_address(text, &address)) {
+        return address;
+    }
+    return strtol(text, NULL, 16);
+}
+
+void refresh_break_pages(CPU *cpu) {
+    Debugger *debugger = cpu->debugger;
+    if (debugger->stop_requested || debugger->finishing) {
+        // Has to look at every instruction
+        memset(cpu->break_pages, 1, sizeof(cpu->break_pages));
+        return;
+    }
+    memset(cpu->break_pages, 0, sizeof(cpu->break_pages));
+    for (int i = 0; i < debugger->breakpoint_count; i++) {
+        cpu->break_pages[debugger->breakpoints[i] >> 8] = 1;
+    }
+    if (debugger->stepping_over) {
+        cpu->break_pages[debugger->step_over_address >> 8] = 1;
+    }
+}
+
+void add_breakpoint(CPU *cpu, u16 address) {
+    Debugger *debugger = cpu->debugger;
+    if (debugger->breakpoint_count == max_breakpoints) {
+        printf("too many breakpoints\n");
+        return;
+    }
+    debugger->breakpoints[debugger->breakpoint_count++] = address;
+    refresh_break_pages(cpu);
+}
+
+void delete_breakpoint(CPU *cpu, u16 address) {
+    Debugger *debugger = cpu->debugger;
+    for (int i = 0; i < debugger->breakpoint_count; i++) {
+        if (debugger->breakpoints[i] == address) {
+            debugger->breakpoints[i] = debugger->breakpoints[--debugger->breakpoint_count];
+            break;
+        }
+    }
+    refresh_break_pages(cpu);
+}
+
+void add_watchpoint(CPU *cpu, u16 address, u8 kind) {
+    Debugger *debugger = cpu->debugger;
+    if (debugger->watchpoint_count == max_watchpoints) {
+        printf("too many watchpoints\n");
+        return;
+    }
+    debugger->watchpoints[debugger->watchpoint_count++] = (Watchpoint) {address, kind};
+    map_page(cpu, address >> 8);
+}
+
+void delete_watchpoint(CPU *cpu, u16 address) {
+    Debugger *debugger = cpu->debugger;
+    for (int i = 0; i < debugger->watchpoint_count; i++) {
+        if (debugger->watchpoints[i].address == address) {
+            debugger->watchpoints[i] = debugger->watchpoints[--debugger->watchpoint_count];
+            break;
+        }
+    }
+    map_page(cpu, address >> 8);
+}
+
+bool is_call(u8 byte) {
+    // call, call cc and rst
+    return byte == 0xcd || (byte & 0xe7) == 0xc4 || (byte & 0xc7) == 0xc7;
+}
+
+void print_debug_help() {
+    printf("c                 continue\n");
+    printf("s                 step one instruction\n");
+    printf("n                 step over calls\n");
+    printf("f                 run until the current function returns\n");
+    printf("ADDR is hex or a label from the symbol file\n");
+    printf("b ADDR            set a breakpoint\n");
+    printf("d ADDR            delete a breakpoint\n");
+    printf("w ADDR [r|w|rw]   watch reads and/or writes (default w)\n");
+    printf("uw ADDR           delete a watchpoint\n");
+    printf("i                 list breakpoints and watchpoints\n");
+    printf("r                 show registers\n");
+    printf("x ADDR [N]        dump N bytes of memory\n");
+    printf("l [ADDR] [N]      disassemble N instructions\n");
+    printf("q                 quit\n");
+    printf("An empty line repeats the last command.\n");
+}
+
+// Runs one debugger command, returning whether execution should resume
+bool debug_command(CPU *cpu, const char *line) {
+    Debugger *debugger = cpu->debugger;
+    char command[16] = "";
+    char arg1[32] = "";
+    char arg2[32] = "";
+    sscanf(line, "%15s %31s %31s", command, arg1, arg2);
+    u16 addr1 = parse_address(arg1);
+    if (strcmp(command, "c") == 0) {
+        return true;
+    } else if (strcmp(command, "s") == 0) {
+        debugger->stop_requested = 1;
+        return true;
+    } else if (strcmp(command, "n") == 0) {
+        if (is_call(peek(cpu, cpu->pc))) {
+            char text[instruction_text_len];
+            debugger->stepping_over = true;
+            debugger->step_over_address = cpu->pc + disassemble(cpu, cpu->pc, text);
+        } else {
+            debugger->stop_requested = 1;
+        }
+        return true;
+    } else if (strcmp(command, "f") == 0) {
+        debugger->finishing = true;
+        debugger->finish_sp = cpu->sp;
+        return true;
+    } else if (strcmp(command, "b") == 0 && *arg1) {
+        add_breakpoint(cpu, addr1);
+    } else if (strcmp(command, "d") == 0 && *arg1) {
+        delete_breakpoint(cpu, addr1);
+    } else if (strcmp(command, "w") == 0 && *arg1) {
+        u8 kind = WATCH_WRITE;
+        if (strcmp(arg2, "r") == 0) {
+            kind = WATCH_READ;
+        } else if (strcmp(arg2, "rw") == 0) {
+            kind = WATCH_READ | WATCH_WRITE;
+        }
+        add_watchpoint(cpu, addr1, kind);
+    } else if (strcmp(command, "uw") == 0 && *arg1) {
+        delete_watchpoint(cpu, addr1);
+    } else if (strcmp(command, "i") == 0) {
+        for (int i = 0; i < debugger->breakpoint_count; i++) {
+            printf("breakpoint %04x\n", debugger->breakpoints[i]);
+        }
+        for (int i = 0; i < debugger->watchpoint_count; i++) {
+            Watchpoint *watch = &debugger->watchpoints[i];
+            printf("watchpoint %04x %s%s\n", watch->address,
+                   (watch->kind & WATCH_READ) ? "r" : "",
+                   (watch->kind & WATCH_WRITE) ? "w" : "");
+        }
+    } else if (strcmp(command, "r") == 0) {
+        dump_regs(cpu);
+    } else if (strcmp(command, "x") == 0 && *arg1) {
+        int count = *arg2 ? atoi(arg2) : 16;
+        for (int i = 0; i < count; i++) {
+            if (i % 16 == 0) {
+                printf(i ? "\n%04x:" : "%04x:", (u16) (addr1 + i));
             }
-            case 0x72: {
-                set_dereference_hl(&cpu, cpu.d);
-                break;
+            printf(" %02x", peek(cpu, addr1 + i));
+        }
+        printf("\n");
+    } else if (strcmp(command, "l") == 0) {
+        u16 address = *arg1 ? addr1 : cpu->pc;
+        int count = *arg2 ? atoi(arg2) : 8;
+        for (int i = 0; i < count; i++) {
+            print_instruction(cpu, address);
+            address += opcodes[peek(cpu, address)].length;
+        }
+    } else if (strcmp(command, "q") == 0) {
+        exit(0);
+    } else {
+        print_debug_help();
+    }
+    return false;
+}
+
+// Called before an instruction on a page flagged in break_pages
+void debug(CPU *cpu) {
+    Debugger *debugger = cpu->debugger;
+    bool stop = debugger->stop_requested;
+    if (debugger->finishing && cpu->sp > debugger->finish_sp) {
+        stop = true;
+    }
+    if (debugger->stepping_over && cpu->pc == debugger->step_over_address) {
+        stop = true;
+    }
+    for (int i = 0; i < debugger->breakpoint_count; i++) {
+        if (debugger->breakpoints[i] == cpu->pc) {
+            stop = true;
+        }
+    }
+    if (!stop) {
+        return;
+    }
+
+    debugger->stop_requested = 0;
+    debugger->finishing = false;
+    debugger->stepping_over = false;
+    print_instruction(cpu, cpu->pc);
+    while (true) {
+        char *line = readline("> ");
+        if (!line) exit(0);
+        if (*line) {
+            add_history(line);
+            snprintf(debugger->last_command, sizeof(debugger->last_command), "%s", line);
+        }
+        bool resume = debug_command(cpu, debugger->last_command);
+        free(line);
+        if (resume) {
+            break;
+        }
+    }
+    refresh_break_pages(cpu);
+}
+
+CPU *interrupt_target;
+
+void handle_sigint(int sig) {
+    request_stop(interrupt_target);
+}
+
+void start_debugger(CPU *cpu) {
+    cpu->debugger = calloc(1, sizeof(Debugger));
+    assert(cpu->debugger);
+    interrupt_target = cpu;
+    signal(SIGINT, handle_sigint);
+}
+
+// Test harness. Per-opcode vectors come as JSON in the SingleStepTests
+// sm83 layout: an array of {"name", "initial", "final", "cycles"} where
+// the states hold the registers, ime, ie and a "ram" list of [address, value].
+#define max_test_ram 64
+
+typedef struct TestState {
+    u16 pc;
+    u16 sp;
+    u8 a, b, c, d, e, f, h, l;
+    u8 ime;
+    u8 ie;
+    int ram_count;
+    u16 ram_address[max_test_ram];
+    u8 ram_value[max_test_ram];
+} TestState;
+
+void json_space(const char **p) {
+    while (**p == ' ' || **p == '\n' || **p == '\r' || **p == '\t') {
+        (*p)++;
+    }
+}
+
+bool json_consume(const char **p, char ch) {
+    json_space(p);
+    if (**p != ch) {
+        return false;
+    }
+    (*p)++;
+    return true;
+}
+
+long json_number(const char **p) {
+    json_space(p);
+    char *end;
+    long val = strtol(*p, &end, 10);
+    *p = end;
+    return val;
+}
+
+bool json_string(const char **p, char *out, size_t len) {
+    json_space(p);
+    if (**p != '"') {
+        return false;
+    }
+    (*p)++;
+    size_t i = 0;
+    while (**p && **p != '"') {
+        if (**p == '\\') {
+            (*p)++;
+        }
+        if (i + 1 < len) {
+            out[i++] = **p;
+        }
+        (*p)++;
+    }
+    out[i] = '\0';
+    if (!**p) {
+        return false;
+    }
+    (*p)++;
+    return true;
+}
+
+// Skips any value, returning how many elements it had if it was an array
+int json_skip(const char **p) {
+    json_space(p);
+    if (**p == '"') {
+        char ignored[1];
+        json_string(p, ignored, sizeof(ignored));
+        return 0;
+    }
+    if (**p != '[' && **p != '{') {
+        while (**p && !strchr(",]}", **p)) {
+            (*p)++;
+        }
+        return 0;
+    }
+    char close = **p == '[' ? ']' : '}';
+    (*p)++;
+    int count = 0;
+    while (!json_consume(p, close)) {
+        if (**p == '\0') {
+            return count;
+        }
+        json_consume(p, ',');
+        if (close == '}') {
+            json_skip(p);
+            json_consume(p, ':');
+        }
+        json_skip(p);
+        count++;
+    }
+    return count;
+}
+
+// Returns false if the json isn't a state
+bool parse_test_state(const char **p, TestState *state) {
+    memset(state, 0, sizeof(*state));
+    if (!json_consume(p, '{')) {
+        return false;
+    }
+    while (!json_consume(p, '}')) {
+        json_consume(p, ',');
+        char key[16];
+        if (!json_string(p, key, sizeof(key)) || !json_consume(p, ':')) {
+            return false;
+        }
+        if (strcmp(key, "ram") == 0) {
+            if (!json_consume(p, '[')) {
+                return false;
+            }
+            while (!json_consume(p, ']')) {
+                json_consume(p, ',');
+                if (!json_consume(p, '[')) {
+                    return false;
+                }
+                u16 address = json_number(p);
+                if (!json_consume(p, ',')) {
+                    return false;
+                }
+                u8 val = json_number(p);
+                if (!json_consume(p, ']') || state->ram_count == max_test_ram) {
+                    return false;
+                }
+                state->ram_address[state->ram_count] = address;
+                state->ram_value[state->ram_count] = val;
+                state->ram_count++;
             }
-            case 0x73: {
-                set_dereference_hl(&cpu, cpu.e);
-                break;
+            continue;
+        }
+        long val = json_number(p);
+        if (strcmp(key, "pc") == 0) {
+            state->pc = val;
+        } else if (strcmp(key, "sp") == 0) {
+            state->sp = val;
+        } else if (strcmp(key, "a") == 0) {
+            state->a = val;
+        } else if (strcmp(key, "b") == 0) {
+            state->b = val;
+        } else if (strcmp(key, "c") == 0) {
+            state->c = val;
+        } else if (strcmp(key, "d") == 0) {
+            state->d = val;
+        } else if (strcmp(key, "e") == 0) {
+            state->e = val;
+        } else if (strcmp(key, "f") == 0) {
+            state->f = val;
+        } else if (strcmp(key, "h") == 0) {
+            state->h = val;
+        } else if (strcmp(key, "l") == 0) {
+            state->l = val;
+        } else if (strcmp(key, "ime") == 0) {
+            state->ime = val;
+        } else if (strcmp(key, "ie") == 0) {
+            state->ie = val;
+        }
+    }
+    return true;
+}
+
+// Prints every difference between the cpu and the expected state
+int compare_test_state(CPU *cpu, TestState *expected, const char *name) {
+    int mismatches = 0;
+    struct {
+        const char *name;
+        u16 actual;
+        u16 expected;
+    } fields[] = {
+        {"pc", cpu->pc, expected->pc}, {"sp", cpu->sp, expected->sp},
+        {"a", cpu->a, expected->a}, {"f", cpu->f, expected->f},
+        {"b", cpu->b, expected->b}, {"c", cpu->c, expected->c},
+        {"d", cpu->d, expected->d}, {"e", cpu->e, expected->e},
+        {"h", cpu->h, expected->h}, {"l", cpu->l, expected->l},
+        {"ime", cpu->ime || cpu->ei_pending, expected->ime},
+    };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (fields[i].actual != fields[i].expected) {
+            printf("  %s: %s is %04x, expected %04x\n", name, fields[i].name,
+                   fields[i].actual, fields[i].expected);
+            mismatches++;
+        }
+    }
+    for (int i = 0; i < expected->ram_count; i++) {
+        u16 address = expected->ram_address[i];
+        if (load(cpu, address) != expected->ram_value[i]) {
+            printf("  %s: (%04x) is %02x, expected %02x\n", name, address,
+                   load(cpu, address), expected->ram_value[i]);
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+// Runs one file of vectors on a cpu with flat ram and no io, returning the
+// number of failed tests
+int run_test_vectors(CPU *cpu, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    long len = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    if (len < 0) {
+        perror(path);
+        fclose(f);
+        return 1;
+    }
+    rewind(f);
+    char *text = malloc(len + 1);
+    assert(text);
+    bool read = fread(text, 1, len, f) == (size_t) len;
+    read &= fclose(f) == 0;
+    if (!read) {
+        perror(path);
+        free(text);
+        return 1;
+    }
+    text[len] = '\0';
+
+    int total = 0;
+    int failed = 0;
+    const char *p = text;
+    bool ok = json_consume(&p, '[');
+    while (ok && !json_consume(&p, ']')) {
+        json_consume(&p, ',');
+        char name[64] = "";
+        TestState initial;
+        TestState expected;
+        int machine_cycles = 0;
+        ok = json_consume(&p, '{');
+        while (ok && !json_consume(&p, '}')) {
+            json_consume(&p, ',');
+            char key[16];
+            if (!json_string(&p, key, sizeof(key)) || !json_consume(&p, ':')) {
+                ok = false;
+            } else if (strcmp(key, "name") == 0) {
+                ok = json_string(&p, name, sizeof(name));
+            } else if (strcmp(key, "initial") == 0) {
+                ok = parse_test_state(&p, &initial);
+            } else if (strcmp(key, "final") == 0) {
+                ok = parse_test_state(&p, &expected);
+            } else if (strcmp(key, "cycles") == 0) {
+                machine_cycles = json_skip(&p);
+            } else {
+                json_skip(&p);
             }
-            case 0x74: {
-                set_dereference_hl(&cpu, cpu.h);
-                break;
+        }
+        if (!ok) {
+            break;
+        }
+
+        init_cpu(cpu);
+        for (int i = 0; i < block_count; i++) {
+            memset(cpu->blocks[i]->bytes, 0, block_size);
+        }
+        rehash_memory(cpu);
+        for (int page = 0; page < 0x100; page++) {
+            u8 *bytes = cpu->blocks[page >> (block_bits - 8)]->bytes + ((page << 8) & (block_size - 1));
+            cpu->read_map[page] = bytes;
+            cpu->write_map[page] = bytes;
+            cpu->store_page[page] = page;
+        }
+        cpu->pc = initial.pc;
+        cpu->sp = initial.sp;
+        cpu->a = initial.a;
+        cpu->f = initial.f;
+        cpu->b = initial.b;
+        cpu->c = initial.c;
+        cpu->d = initial.d;
+        cpu->e = initial.e;
+        cpu->h = initial.h;
+        cpu->l = initial.l;
+        cpu->ime = initial.ime;
+        store(cpu, interrupt_enable_address, initial.ie);
+        for (int i = 0; i < initial.ram_count; i++) {
+            store(cpu, initial.ram_address[i], initial.ram_value[i]);
+        }
+
+        step(cpu);
+        int mismatches = compare_test_state(cpu, &expected, name);
+        if (cpu->cycles != (u64) machine_cycles * 4) {
+            printf("  %s: took %llu cycles, expected %d\n", name,
+                   (unsigned long long) cpu->cycles, machine_cycles * 4);
+            mismatches++;
+        }
+        failed += mismatches != 0;
+        total++;
+    }
+    if (ok) {
+        printf("%s: %d/%d passed\n", path, total - failed, total);
+    } else {
+        // Whatever follows can't be trusted, so the file fails as a whole
+        printf("%s: malformed json at byte %ld, after %d tests\n", path, (long) (p - text), total);
+        failed++;
+    }
+    free(text);
+    return failed;
+}
+
+// Video capture. A Capture is a frame sink whose frames are copied into a
+// bounded queue at each vblank and encoded by a pool of worker threads, so
+// the emulation thread only pays for the copy. Y4M goes to one file, in
+// frame order; PNG writes frame_000000.png and on into a directory.
+typedef enum CaptureFormat {
+    CAPTURE_PNG,
+    CAPTURE_Y4M,
+} CaptureFormat;
+
+// What capture_frame() does when every slot is still being encoded
+typedef enum CapturePolicy {
+    CAPTURE_BLOCK,
+    CAPTURE_DROP,
+} CapturePolicy;
+
+#define capture_queue_len 16
+#define max_capture_workers 16
+
+typedef struct CaptureSlot {
+    // Position in the output, which skips dropped frames
+    u64 sequence;
+    bool busy;
+    u32 pixels[screen_height][screen_width];
+} CaptureSlot;
+
+typedef struct Capture {
+    FrameSink sink;
+    CaptureFormat format;
+    CapturePolicy policy;
+    const char *path;
+    FILE *out;
+    CaptureSlot slots[capture_queue_len];
+    pthread_t workers[max_capture_workers];
+    int worker_count;
+    pthread_mutex_t lock;
+    // Signalled when a frame is queued, a slot frees up or a y4m frame is
+    // written, respectively
+    pthread_cond_t queued_cond;
+    pthread_cond_t free_cond;
+    pthread_cond_t written_cond;
+    // Frames queued, taken by a worker and (y4m only) written so far. Slot
+    // sequence % capture_queue_len holds frame sequence.
+    u64 queued;
+    u64 taken;
+    u64 written;
+    u64 dropped;
+    bool quit;
+} Capture;
+
+void png_chunk(FILE *out, const char *type, const u8 *data, u32 len) {
+    u8 header[8] = {len >> 24, len >> 16, len >> 8, len, type[0], type[1], type[2], type[3]};
+    fwrite(header, 1, 8, out);
+    fwrite(data, 1, len, out);
+    u32 crc = crc32(crc32(0, header + 4, 4), data, len);
+    u8 trailer[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+    fwrite(trailer, 1, 4, out);
+}
+
+bool write_png(const char *path, const u32 pixels[screen_height][screen_width]) {
+    // Unfiltered rgb rows, each led by its filter type byte
+    u8 raw[screen_height][1 + screen_width * 3];
+    for (int y = 0; y < screen_height; y++) {
+        u8 *row = raw[y];
+        row[0] = 0;
+        for (int x = 0; x < screen_width; x++) {
+            memcpy(row + 1 + x * 3, &pixels[y][x], 3);
+        }
+    }
+    uLongf compressed_len = compressBound(sizeof(raw));
+    u8 *compressed = malloc(compressed_len);
+    assert(compressed);
+    // With compressBound's room, compress2 only fails for want of memory.
+    // errno says so for the caller to report.
+    if (compress2(compressed, &compressed_len, &raw[0][0], sizeof(raw), Z_BEST_SPEED) != Z_OK) {
+        free(compressed);
+        errno = ENOMEM;
+        return false;
+    }
+
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        free(compressed);
+        return false;
+    }
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, out);
+    // 8 bit rgb, no interlacing
+    u8 ihdr[13] = {0, 0, 0, screen_width, 0, 0, 0, screen_height, 8, 2, 0, 0, 0};
+    png_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+    png_chunk(out, "IDAT", compressed, compressed_len);
+    png_chunk(out, "IEND", (const u8 *) "", 0);
+    free(compressed);
+    return fclose(out) == 0;
+}
+
+// Full range rgb to studio range bt.601, without chroma subsampling
+void rgba_to_yuv444(const u32 pixels[screen_height][screen_width], u8 *out) {
+    const int plane = screen_width * screen_height;
+    for (int i = 0; i < plane; i++) {
+        const u8 *rgba = (const u8 *) &pixels[0][0] + i * 4;
+        int r = rgba[0], g = rgba[1], b = rgba[2];
+        out[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        out[plane + i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        out[2 * plane + i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+}
+
+void *capture_worker(void *arg) {
+    Capture *capture = arg;
+    u8 yuv[3 * screen_width * screen_height];
+    pthread_mutex_lock(&capture->lock);
+    while (true) {
+        while (capture->taken == capture->queued && !capture->quit) {
+            pthread_cond_wait(&capture->queued_cond, &capture->lock);
+        }
+        if (capture->taken == capture->queued) {
+            break;
+        }
+        CaptureSlot *slot = &capture->slots[capture->taken++ % capture_queue_len];
+        pthread_mutex_unlock(&capture->lock);
+
+        u64 sequence = slot->sequence;
+        if (capture->format == CAPTURE_PNG) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/frame_%06llu.png", capture->path,
+                     (unsigned long long) sequence);
+            if (!write_png(path, slot->pixels)) {
+                perror(path);
             }
-            case 0x75: {
-                set_dereference_hl(&cpu, cpu.l);
-                break;
+        } else {
+            rgba_to_yuv444(slot->pixels, yuv);
+        }
+
+        pthread_mutex_lock(&capture->lock);
+        // The pixels aren't needed any more, even if the y4m frame still has
+        // to wait its turn
+        slot->busy = false;
+        pthread_cond_signal(&capture->free_cond);
+        if (capture->format == CAPTURE_Y4M) {
+            while (capture->written != sequence) {
+                pthread_cond_wait(&capture->written_cond, &capture->lock);
+            }
+            pthread_mutex_unlock(&capture->lock);
+            fputs("FRAME\n", capture->out);
+            fwrite(yuv, 1, sizeof(yuv), capture->out);
+            pthread_mutex_lock(&capture->lock);
+            capture->written++;
+            pthread_cond_broadcast(&capture->written_cond);
+        }
+    }
+    pthread_mutex_unlock(&capture->lock);
+    return NULL;
+}
+
+// Captures to path: a .y4m file, or otherwise a directory of pngs. The
+// capture's sink still has to be added to the gpu that renders.
+Capture *start_capture(const char *path, CapturePolicy policy, int workers) {
+    Capture *capture = calloc(1, sizeof(Capture));
+    assert(capture);
+    const char *extension = strrchr(path, '.');
+    capture->format = extension && strcmp(extension, ".y4m") == 0 ? CAPTURE_Y4M : CAPTURE_PNG;
+    capture->policy = policy;
+    capture->path = path;
+    if (capture->format == CAPTURE_Y4M) {
+        capture->out = fopen(path, "wb");
+        if (!capture->out) {
+            free(capture);
+            return NULL;
+        }
+        // 4194304 / 70224 frames a second, square pixels
+        fprintf(capture->out, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C444\n",
+                screen_width, screen_height, 1 << 22, (int) (line_cycles * lines_per_frame));
+    } else if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        free(capture);
+        return NULL;
+    }
+    pthread_mutex_init(&capture->lock, NULL);
+    pthread_cond_init(&capture->queued_cond, NULL);
+    pthread_cond_init(&capture->free_cond, NULL);
+    pthread_cond_init(&capture->written_cond, NULL);
+    capture->worker_count = workers;
+    for (int i = 0; i < workers; i++) {
+        int err = pthread_create(&capture->workers[i], NULL, capture_worker, capture);
+        if (err) {
+            fprintf(stderr, "capture worker: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    return capture;
+}
+
+// Called once a frame on the emulation thread. Copies out the newest frame
+// if there is one and queues it.
+void capture_frame(Capture *capture) {
+    Frame *frame = take_frame(&capture->sink);
+    if (!frame) {
+        return;
+    }
+    pthread_mutex_lock(&capture->lock);
+    CaptureSlot *slot = &capture->slots[capture->queued % capture_queue_len];
+    if (capture->policy == CAPTURE_BLOCK) {
+        while (slot->busy) {
+            pthread_cond_wait(&capture->free_cond, &capture->lock);
+        }
+    } else if (slot->busy) {
+        capture->dropped++;
+        pthread_mutex_unlock(&capture->lock);
+        release_frame(frame);
+        return;
+    }
+    slot->busy = true;
+    slot->sequence = capture->queued;
+    pthread_mutex_unlock(&capture->lock);
+
+    // Nobody else touches a busy slot until it's queued
+    memcpy(slot->pixels, frame->pixels, sizeof(slot->pixels));
+    release_frame(frame);
+
+    pthread_mutex_lock(&capture->lock);
+    capture->queued++;
+    pthread_cond_signal(&capture->queued_cond);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+// Encodes whatever is still queued, then stops the workers
+void finish_capture(Capture *capture) {
+    pthread_mutex_lock(&capture->lock);
+    capture->quit = true;
+    pthread_cond_broadcast(&capture->queued_cond);
+    pthread_mutex_unlock(&capture->lock);
+    for (int i = 0; i < capture->worker_count; i++) {
+        pthread_join(capture->workers[i], NULL);
+    }
+    if (capture->out) {
+        fclose(capture->out);
+    }
+    if (capture->dropped) {
+        fprintf(stderr, "capture: dropped %llu of %llu frames\n",
+                (unsigned long long) capture->dropped,
+                (unsigned long long) (capture->queued + capture->dropped));
+    }
+}
+
+// Frame streaming for remote viewers. A server thread takes finished frames
+// from its sink and sends every viewer the 8x8 tiles that changed since the
+// last frame that viewer got, at two bits a pixel. A viewer that can't keep
+// up misses frames; emulation never waits on the network.
+//
+// Each message is a little endian u32 length of the rest, the u64 frame
+// number, a u16 tile count and then the tiles: x and y in tiles, followed
+// by 8 rows of 2 bytes with the leftmost pixel in the top bits. A viewer's
+// first message has every tile.
+#define stream_tiles_x (screen_width / 8)
+#define stream_tiles_y (screen_height / 8)
+#define stream_tile_len (2 + 16)
+#define stream_header_len (4 + 8 + 2)
+#define stream_message_max (stream_header_len + stream_tiles_x * stream_tiles_y * stream_tile_len)
+#define max_viewers 8
+
+typedef struct Viewer {
+    // -1 for a free slot
+    int fd;
+    bool has_frame;
+    // The picture as the viewer will have it once out is sent
+    u8 shades[screen_height][screen_width];
+    u8 out[stream_message_max];
+    size_t out_len;
+    size_t out_sent;
+} Viewer;
+
+typedef struct Streamer {
+    FrameSink sink;
+    int listen_fd;
+    Viewer viewers[max_viewers];
+    atomic_bool quit;
+    pthread_t thread;
+} Streamer;
+
+void put_le(u8 *out, u64 val, int len) {
+    for (int i = 0; i < len; i++) {
+        out[i] = val >> (i * 8);
+    }
+}
+
+u64 get_le(const u8 *in, int len) {
+    u64 val = 0;
+    for (int i = 0; i < len; i++) {
+        val |= (u64) in[i] << (i * 8);
+    }
+    return val;
+}
+
+// Writes the message taking from the viewer's picture to frame, and moves
+// the picture on. Returns its length.
+size_t encode_delta(Viewer *viewer, const Frame *frame, u8 *out) {
+    u8 *tile = out + stream_header_len;
+    int count = 0;
+    for (int ty = 0; ty < stream_tiles_y; ty++) {
+        for (int tx = 0; tx < stream_tiles_x; tx++) {
+            bool changed = !viewer->has_frame;
+            for (int r = 0; r < 8 && !changed; r++) {
+                changed = memcmp(&viewer->shades[ty * 8 + r][tx * 8],
+                                 &frame->shades[ty * 8 + r][tx * 8], 8) != 0;
+            }
+            if (!changed) {
+                continue;
+            }
+            tile[0] = tx;
+            tile[1] = ty;
+            for (int r = 0; r < 8; r++) {
+                const u8 *row = &frame->shades[ty * 8 + r][tx * 8];
+                tile[2 + r * 2] = row[0] << 6 | row[1] << 4 | row[2] << 2 | row[3];
+                tile[3 + r * 2] = row[4] << 6 | row[5] << 4 | row[6] << 2 | row[7];
+                memcpy(&viewer->shades[ty * 8 + r][tx * 8], row, 8);
+            }
+            tile += stream_tile_len;
+            count++;
+        }
+    }
+    viewer->has_frame = true;
+    size_t len = tile - out;
+    put_le(out, len - 4, 4);
+    put_le(out + 4, frame->number, 8);
+    put_le(out + 12, count, 2);
+    return len;
+}
+
+void drop_viewer(Viewer *viewer) {
+    close(viewer->fd);
+    viewer->fd = -1;
+}
+
+// Sends as much of the viewer's pending message as the socket takes now
+void flush_viewer(Viewer *viewer) {
+    while (viewer->out_sent < viewer->out_len) {
+        ssize_t n = send(viewer->fd, viewer->out + viewer->out_sent,
+                         viewer->out_len - viewer->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                drop_viewer(viewer);
+            }
+            return;
+        }
+        viewer->out_sent += n;
+    }
+    viewer->out_len = 0;
+    viewer->out_sent = 0;
+}
+
+void *stream_thread_main(void *arg) {
+    Streamer *streamer = arg;
+    while (!atomic_load(&streamer->quit)) {
+        struct pollfd fds[2 + max_viewers];
+        fds[0] = (struct pollfd) {.fd = streamer->listen_fd, .events = POLLIN};
+        for (int i = 0; i < max_viewers; i++) {
+            Viewer *viewer = &streamer->viewers[i];
+            fds[1 + i] = (struct pollfd) {
+                .fd = viewer->fd,
+                .events = POLLIN | (viewer->out_len ? POLLOUT : 0),
+            };
+        }
+        // Nothing to do until a viewer, a frame or stop_streamer() turns up
+        fds[1 + max_viewers] = (struct pollfd) {.fd = streamer->sink.wake_fd, .events = POLLIN};
+        poll(fds, 2 + max_viewers, -1);
+        if (fds[1 + max_viewers].revents & POLLIN) {
+            u64 count;
+            ssize_t got = read(streamer->sink.wake_fd, &count, sizeof(count));
+            (void) got;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(streamer->listen_fd, NULL, NULL);
+            Viewer *viewer = NULL;
+            for (int i = 0; i < max_viewers && fd >= 0 && !viewer; i++) {
+                if (streamer->viewers[i].fd < 0) {
+                    viewer = &streamer->viewers[i];
+                }
             }
-            case 0x77: {
-                set_dereference_hl(&cpu, cpu.a);
-                break;
+            if (viewer) {
+                viewer->fd = fd;
+                viewer->has_frame = false;
+                viewer->out_len = 0;
+                viewer->out_sent = 0;
+            } else if (fd >= 0) {
+                close(fd);
             }
-            case 0x78: {
-                cpu.a = cpu.b;
-                break;
+        }
+        for (int i = 0; i < max_viewers; i++) {
+            Viewer *viewer = &streamer->viewers[i];
+            short revents = fds[1 + i].revents;
+            if (viewer->fd < 0 || fds[1 + i].fd != viewer->fd) {
+                continue;
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                // Viewers have nothing to say, so this is them leaving
+                u8 discard[256];
+                if (recv(viewer->fd, discard, sizeof(discard), MSG_DONTWAIT) <= 0) {
+                    drop_viewer(viewer);
+                    continue;
+                }
             }
-            case 0x79: {
-                cpu.a = cpu.c;
-                break;
+            if (revents & POLLOUT) {
+                flush_viewer(viewer);
             }
-            case 0x7a: {
-                cpu.a = cpu.d;
-                break;
+        }
+
+        Frame *frame = take_frame(&streamer->sink);
+        if (!frame) {
+            continue;
+        }
+        for (int i = 0; i < max_viewers; i++) {
+            Viewer *viewer = &streamer->viewers[i];
+            // Still sending an older frame: this one is skipped, and the
+            // next delta is taken from what the viewer will actually have
+            if (viewer->fd < 0 || viewer->out_len) {
+                continue;
+            }
+            viewer->out_len = encode_delta(viewer, frame, viewer->out);
+            flush_viewer(viewer);
+        }
+        release_frame(frame);
+    }
+    return NULL;
+}
+
+// "tcp:PORT" for localhost tcp, anything else is a unix socket path. Fills
+// in the address and returns the socket family, or -1.
+int stream_address(const char *address, struct sockaddr_storage *out, socklen_t *len) {
+    memset(out, 0, sizeof(*out));
+    if (strncmp(address, "tcp:", 4) == 0) {
+        struct sockaddr_in *in = (struct sockaddr_in *) out;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(atoi(address + 4));
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *len = sizeof(*in);
+        return AF_INET;
+    }
+    struct sockaddr_un *un = (struct sockaddr_un *) out;
+    if (strlen(address) >= sizeof(un->sun_path)) {
+        return -1;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, address);
+    *len = sizeof(*un);
+    return AF_UNIX;
+}
+
+// Listens on address and serves frames from the returned streamer's sink,
+// which still has to be added to the gpu that renders. NULL on failure.
+Streamer *start_streamer(const char *address) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int family = stream_address(address, &addr, &addr_len);
+    if (family < 0) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    int fd = socket(family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (family == AF_INET) {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    } else {
+        // Left over from an earlier run
+        unlink(address);
+    }
+    if (bind(fd, (struct sockaddr *) &addr, addr_len) < 0 || listen(fd, max_viewers) < 0) {
+        close(fd);
+        return NULL;
+    }
+    int wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        close(fd);
+        return NULL;
+    }
+    Streamer *streamer = calloc(1, sizeof(Streamer));
+    assert(streamer);
+    streamer->listen_fd = fd;
+    streamer->sink.wakes = true;
+    streamer->sink.wake_fd = wake_fd;
+    for (int i = 0; i < max_viewers; i++) {
+        streamer->viewers[i].fd = -1;
+    }
+    atomic_init(&streamer->quit, false);
+    int err = pthread_create(&streamer->thread, NULL, stream_thread_main, streamer);
+    if (err) {
+        close(wake_fd);
+        close(fd);
+        free(streamer);
+        errno = err;
+        return NULL;
+    }
+    return streamer;
+}
+
+// Stops the thread and disconnects everyone. The sink stays valid, since a
+// render thread may still publish to it.
+void stop_streamer(Streamer *streamer) {
+    atomic_store(&streamer->quit, true);
+    u64 one = 1;
+    ssize_t written = write(streamer->sink.wake_fd, &one, sizeof(one));
+    (void) written;
+    int err = pthread_join(streamer->thread, NULL);
+    if (err) {
+        // The thread may still be using the viewers, so leave them be
+        fprintf(stderr, "stream thread: %s\n", strerror(err));
+        return;
+    }
+    for (int i = 0; i < max_viewers; i++) {
+        if (streamer->viewers[i].fd >= 0) {
+            drop_viewer(&streamer->viewers[i]);
+        }
+    }
+    close(streamer->listen_fd);
+}
+
+bool read_fully(int fd, u8 *out, size_t len) {
+    while (len) {
+        ssize_t n = read(fd, out, len);
+        if (n <= 0) {
+            return false;
+        }
+        out += n;
+        len -= n;
+    }
+    return true;
+}
+
+// The viewer side, for checking a stream: connects to address and prints
+// every frame it's sent until the server goes away
+int watch_stream(const char *address) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int family = stream_address(address, &addr, &addr_len);
+    int fd = family < 0 ? -1 : socket(family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, addr_len) < 0) {
+        perror(address);
+        return 1;
+    }
+    static u8 shades[screen_height][screen_width];
+    u8 message[stream_message_max];
+    while (read_fully(fd, message, 4)) {
+        u32 len = get_le(message, 4);
+        if (len < stream_header_len - 4 || len > stream_message_max - 4
+            || !read_fully(fd, message + 4, len)) {
+            break;
+        }
+        u64 number = get_le(message + 4, 8);
+        int count = get_le(message + 12, 2);
+        if (stream_header_len + count * stream_tile_len != 4 + len) {
+            fprintf(stderr, "bad frame message\n");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            const u8 *tile = message + stream_header_len + i * stream_tile_len;
+            if (tile[0] >= stream_tiles_x || tile[1] >= stream_tiles_y) {
+                continue;
+            }
+            for (int r = 0; r < 8; r++) {
+                u16 bits = tile[2 + r * 2] << 8 | tile[3 + r * 2];
+                for (int c = 0; c < 8; c++) {
+                    shades[tile[1] * 8 + r][tile[0] * 8 + c] = (bits >> (14 - c * 2)) & 3;
+                }
             }
-            case 0x7b: {
-                cpu.a = cpu.e;
-                break;
+        }
+        printf("frame %llu, %d tiles\n", (unsigned long long) number, count);
+        for (int y = 0; y < screen_height; y++) {
+            for (int x = 0; x < screen_width; x++) {
+                putchar(" .O#"[shades[y][x]]);
             }
-            case 0x7c: {
-                cpu.a = cpu.h;
-                break;
+            putchar('\n');
+        }
+        fflush(stdout);
+    }
+    close(fd);
+    return 0;
+}
+
+bool print_fingerprints;
+u64 fingerprint_frames;
+MetricsFormat metrics_format = METRICS_NONE;
+// The gpu frames are published on, which is the render thread's with -r
+GPU *video;
+// Set by SIGUSR1, served at the next frame
+volatile sig_atomic_t metrics_requested;
+// Set by --capture
+Capture *capture;
+// Set by --stream
+Streamer *streamer;
+
+// Called at each vblank with -F
+void print_fingerprint(CPU *cpu) {
+    fprintf(stderr, "frame %llu state %016llx\n",
+            (unsigned long long) fingerprint_frames++, (unsigned long long) state_hash(cpu));
+}
+
+// Runs a test rom with no video output until it reports a result over the
+// serial port the way blargg's roms do, echoing what it sends. Returns the
+// process exit status: 0 passed, 1 failed, 2 gave up after max_cycles.
+// max_cycles counts from where the run starts, which is past the boot rom
+// with fast boot.
+int run_headless(CPU *cpu, u64 max_cycles) {
+    char *serial = NULL;
+    size_t serial_len = 0;
+    size_t echoed = 0;
+    cpu->serial_out = open_memstream(&serial, &serial_len);
+    assert(cpu->serial_out);
+    u64 next_check = 0;
+    u64 start = cpu->cycles;
+    Core core = step_core(cpu);
+    while (!max_cycles || cpu->cycles - start < max_cycles) {
+        core(cpu);
+        if (cpu->frame_done) {
+            cpu->frame_done = false;
+            if (print_fingerprints) {
+                print_fingerprint(cpu);
+            }
+            if (capture) {
+                capture_frame(capture);
+            }
+            if (metrics_requested) {
+                metrics_requested = 0;
+                dump_metrics(cpu, video, metrics_format, stderr);
             }
-            case 0x7d: {
-                cpu.a = cpu.l;
-                break;
+        }
+        if (cpu->cycles < next_check) {
+            continue;
+        }
+        // Looking about once a frame is plenty
+        next_check = cpu->cycles + line_cycles * lines_per_frame;
+        fwrite(serial + echoed, 1, serial_len - echoed, stdout);
+        echoed = serial_len;
+        if (serial_len && strstr(serial, "Passed")) {
+            return 0;
+        }
+        if (serial_len && strstr(serial, "Failed")) {
+            return 1;
+        }
+    }
+    printf("\ngave up after %llu cycles\n", (unsigned long long) (cpu->cycles - start));
+    return 2;
+}
+
+// Runs the machine on the far end of the cable until it's unplugged
+void run_partner(CPU *cpu) {
+    cpu->skip_render = true;
+    Core core = step_core(cpu);
+    while (!cpu->link->closed) {
+        core(cpu);
+    }
+}
+
+void *partner_thread(void *arg) {
+    run_partner(arg);
+    return NULL;
+}
+
+// Plugs a second machine running the same rom into cpu, on a thread of its
+// own and joined by a pair of rings
+void link_thread(CPU *cpu, CPU *partner) {
+    static LinkRing rings[2];
+    static Link links[2];
+    links[0] = (Link) {.rx = &rings[0], .tx = &rings[1], .fd = -1};
+    links[1] = (Link) {.rx = &rings[1], .tx = &rings[0], .fd = -1};
+    partner->fast_boot = cpu->fast_boot;
+    init_cpu(partner);
+    attach_link(cpu, &links[0]);
+    attach_link(partner, &links[1]);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, partner_thread, partner);
+    if (!err) {
+        err = pthread_detach(thread);
+    }
+    if (err) {
+        fprintf(stderr, "link partner thread: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+// Same, but the partner is a forked process on the other end of a
+// socketpair. It exits once we do.
+void link_process(CPU *cpu) {
+    static Link link;
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    link = (Link) {.fd = fds[pid == 0 ? 1 : 0]};
+    close(fds[pid == 0 ? 0 : 1]);
+    attach_link(cpu, &link);
+    if (pid == 0) {
+        run_partner(cpu);
+        exit(0);
+    }
+}
+
+// Boots one machine through boot_rom[] and starts the other straight at
+// 0x100, then reports everything that differs. Returns 0 if nothing does.
+int check_fast_boot(CPU *booted, CPU *fast) {
+    booted->skip_render = true;
+    init_cpu(booted);
+    // A bad logo locks the boot rom up for good
+    while (booted->boot_rom_enabled && booted->cycles < 2 * boot_cycles) {
+        step(booted);
+    }
+    fast->skip_render = true;
+    fast->fast_boot = true;
+    init_cpu(fast);
+    struct {
+        const char *name;
+        u64 booted;
+        u64 fast;
+    } fields[] = {
+        {"pc", booted->pc, fast->pc}, {"sp", booted->sp, fast->sp},
+        {"a", booted->a, fast->a}, {"f", booted->f, fast->f},
+        {"b", booted->b, fast->b}, {"c", booted->c, fast->c},
+        {"d", booted->d, fast->d}, {"e", booted->e, fast->e},
+        {"h", booted->h, fast->h}, {"l", booted->l, fast->l},
+        {"ime", booted->ime, fast->ime}, {"halted", booted->halted, fast->halted},
+        {"boot rom", booted->boot_rom_enabled, fast->boot_rom_enabled},
+        {"cycles", booted->cycles, fast->cycles},
+        {"line start", booted->line_start, fast->line_start},
+        {"div base", booted->div_base, fast->div_base},
+        {"timer synced", booted->timer_synced, fast->timer_synced},
+        {"state hash", state_hash(booted), state_hash(fast)},
+    };
+    int differences = 0;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (fields[i].booted != fields[i].fast) {
+            printf("%s differs: boot rom %llx, fast boot %llx\n", fields[i].name,
+                   (unsigned long long) fields[i].booted, (unsigned long long) fields[i].fast);
+            differences++;
+        }
+    }
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        if (booted->event_time[i] != fast->event_time[i]) {
+            printf("event %d differs: boot rom %llx, fast boot %llx\n", i,
+                   (unsigned long long) booted->event_time[i],
+                   (unsigned long long) fast->event_time[i]);
+            differences++;
+        }
+    }
+    for (int address = 0; address < 0x10000; address++) {
+        if (load(booted, address) != load(fast, address)) {
+            printf("%04x differs: boot rom %02x, fast boot %02x\n", address,
+                   load(booted, address), load(fast, address));
+            differences++;
+        }
+    }
+    printf("fast boot %s\n", differences ? "differs" : "matches");
+    return differences != 0;
+}
+
+// Lockstep differential execution. Two machines run the same rom, one on
+// the reference core and one on the core under test, and are compared after
+// every block (a run of instructions ending in a control transfer).
+
+typedef struct TraceEntry {
+    u64 cycles;
+    u16 pc;
+    u16 sp;
+    u8 a, f, b, c, d, e, h, l;
+} TraceEntry;
+
+#define trace_window 16
+
+typedef struct CoreTrace {
+    TraceEntry entries[trace_window];
+    u64 count;
+} CoreTrace;
+
+void record_trace(CoreTrace *trace, CPU *cpu) {
+    trace->entries[trace->count++ % trace_window] = (TraceEntry) {
+        cpu->cycles, cpu->pc, cpu->sp,
+        cpu->a, cpu->f, cpu->b, cpu->c, cpu->d, cpu->e, cpu->h, cpu->l,
+    };
+}
+
+void print_trace(CoreTrace *trace, CPU *cpu, const char *name) {
+    printf("last %s instructions:\n", name);
+    u64 start = trace->count > trace_window ? trace->count - trace_window : 0;
+    for (u64 i = start; i < trace->count; i++) {
+        TraceEntry *entry = &trace->entries[i % trace_window];
+        char text[instruction_text_len];
+        disassemble(cpu, entry->pc, text);
+        printf("  %10llu %04x  %-20s a=%02x f=%02x bc=%02x%02x de=%02x%02x hl=%02x%02x sp=%04x\n",
+               (unsigned long long) entry->cycles, entry->pc, text, entry->a, entry->f,
+               entry->b, entry->c, entry->d, entry->e, entry->h, entry->l, entry->sp);
+    }
+}
+
+// Prints every field that differs and returns how many did
+int compare_cores(CPU *reference, CPU *candidate) {
+    struct {
+        const char *name;
+        u64 reference;
+        u64 candidate;
+    } fields[] = {
+        {"pc", reference->pc, candidate->pc}, {"sp", reference->sp, candidate->sp},
+        {"a", reference->a, candidate->a}, {"f", reference->f, candidate->f},
+        {"b", reference->b, candidate->b}, {"c", reference->c, candidate->c},
+        {"d", reference->d, candidate->d}, {"e", reference->e, candidate->e},
+        {"h", reference->h, candidate->h}, {"l", reference->l, candidate->l},
+        {"ime", reference->ime, candidate->ime},
+        {"cycles", reference->cycles, candidate->cycles},
+        {"write hash", reference->write_hash, candidate->write_hash},
+        {"state hash", state_hash(reference), state_hash(candidate)},
+    };
+    int differences = 0;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (fields[i].reference != fields[i].candidate) {
+            printf("%s differs: reference %llx, candidate %llx\n", fields[i].name,
+                   (unsigned long long) fields[i].reference,
+                   (unsigned long long) fields[i].candidate);
+            differences++;
+        }
+    }
+    return differences;
+}
+
+// Runs both cores until they diverge or max_cycles (0 for no limit) pass.
+// Returns 0 if they agreed throughout.
+int lockstep(CPU *reference, Core reference_step, CPU *candidate, Core candidate_step,
+             u64 max_cycles) {
+    static CoreTrace reference_trace;
+    static CoreTrace candidate_trace;
+    u64 blocks = 0;
+    u64 start = reference->cycles;
+    while (!max_cycles || reference->cycles - start < max_cycles) {
+        // The reference decides where the block ends; the candidate then
+        // runs the same number of instructions
+        int length = 0;
+        bool sequential = true;
+        while (sequential) {
+            u16 pc = reference->pc;
+            u8 byte = peek(reference, pc);
+            u8 size = opcodes[byte].length;
+            record_trace(&reference_trace, reference);
+            reference_step(reference);
+            length++;
+            sequential = reference->pc == (u16) (pc + size) && !reference->halted;
+        }
+        for (int i = 0; i < length; i++) {
+            record_trace(&candidate_trace, candidate);
+            candidate_step(candidate);
+        }
+        blocks++;
+        if (compare_cores(reference, candidate)) {
+            printf("diverged in block %llu after %llu instructions\n",
+                   (unsigned long long) blocks, (unsigned long long) reference_trace.count);
+            print_trace(&reference_trace, reference, "reference");
+            print_trace(&candidate_trace, candidate, "candidate");
+            return 1;
+        }
+    }
+    printf("no divergence in %llu blocks, %llu instructions, %llu cycles\n",
+           (unsigned long long) blocks, (unsigned long long) reference_trace.count,
+           (unsigned long long) (reference->cycles - start));
+    return 0;
+}
+
+// Coverage guided fuzzing. An input is the joypad state for each frame.
+// Every execution starts from a snapshot taken when the boot rom hands over,
+// forked from instead of booting again.
+#define max_corpus 4096
+// A run that goes this long without a vblank counts as hung
+#define hang_frames 10
+
+typedef struct Fuzzer {
+    CPU *snapshot;
+    int frames;
+    u8 *corpus[max_corpus];
+    int corpus_len;
+    // Hit count buckets seen so far for every edge, AFL style
+    u8 seen[0x10000];
+    u8 coverage[0x10000];
+    int edges;
+    // (reason, pc) of every distinct fault so far
+    u64 faults[256];
+    int fault_count;
+    u64 rng;
+    u64 execs;
+    const char *out_dir;
+} Fuzzer;
+
+u64 fuzz_random(Fuzzer *fuzzer) {
+    fuzzer->rng ^= fuzzer->rng << 13;
+    fuzzer->rng ^= fuzzer->rng >> 7;
+    fuzzer->rng ^= fuzzer->rng << 17;
+    return fuzzer->rng;
+}
+
+// Runs one input from the snapshot; returns why it faulted or NULL
+const char *fuzz_run(CPU *cpu, Fuzzer *fuzzer, const u8 *input) {
+    fork_cpu(cpu, fuzzer->snapshot);
+    memset(fuzzer->coverage, 0, sizeof(fuzzer->coverage));
+    fuzzer->execs++;
+    jmp_buf jump;
+    cpu->fault_jump = &jump;
+    if (setjmp(jump)) {
+        return cpu->fault_reason;
+    }
+    Core core = step_core(cpu);
+    for (int frame = 0; frame < fuzzer->frames; frame++) {
+        set_buttons(cpu, input[frame]);
+        u64 deadline = cpu->cycles + hang_frames * line_cycles * lines_per_frame;
+        while (!cpu->frame_done) {
+            core(cpu);
+            if (cpu->cycles > deadline) {
+                return "hang";
             }
-            case 0x7e: {
-                cpu.a = dereference_hl(&cpu);
+        }
+        cpu->frame_done = false;
+    }
+    return NULL;
+}
+
+// Folds the last run's coverage into what's been seen; returns whether it
+// hit a new edge or a new hit count bucket
+bool fuzz_new_coverage(Fuzzer *fuzzer) {
+    bool new_coverage = false;
+    for (int i = 0; i < 0x10000; i++) {
+        u8 count = fuzzer->coverage[i];
+        if (!count) {
+            continue;
+        }
+        // 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+        u8 bucket = count < 4 ? 1 << (count - 1) : count < 8 ? 8 : count < 16 ? 16
+            : count < 32 ? 32 : count < 128 ? 64 : 128;
+        if (!(fuzzer->seen[i] & bucket)) {
+            fuzzer->edges += fuzzer->seen[i] == 0;
+            fuzzer->seen[i] |= bucket;
+            new_coverage = true;
+        }
+    }
+    return new_coverage;
+}
+
+void fuzz_mutate(Fuzzer *fuzzer, u8 *input) {
+    int mutations = 1 + fuzz_random(fuzzer) % 4;
+    for (int i = 0; i < mutations; i++) {
+        int frame = fuzz_random(fuzzer) % fuzzer->frames;
+        switch (fuzz_random(fuzzer) % 4) {
+            case 0: {
+                input[frame] ^= 1 << (fuzz_random(fuzzer) % 8);
                 break;
             }
-            case 0x7f: {
-                cpu.a = cpu.a;
+            case 1: {
+                input[frame] = fuzz_random(fuzzer);
                 break;
             }
-            case 0x80: {
-                cpu.a = add(&cpu, cpu.b);
+            case 2: {
+                // Hold whatever this frame has for a while
+                int len = 1 + fuzz_random(fuzzer) % 16;
+                for (int j = 1; j < len && frame + j < fuzzer->frames; j++) {
+                    input[frame + j] = input[frame];
+                }
                 break;
             }
-            case 0x81: {
-                cpu.a = add(&cpu, cpu.c);
+            case 3: {
+                // Take the rest from another corpus entry
+                const u8 *other = fuzzer->corpus[fuzz_random(fuzzer) % fuzzer->corpus_len];
+                memcpy(input + frame, other + frame, fuzzer->frames - frame);
                 break;
             }
-            case 0x82: {
-                cpu.a = add(&cpu, cpu.d);
-                break;
+        }
+    }
+}
+
+void fuzz_save(Fuzzer *fuzzer, const char *kind, int number, const u8 *input) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s-%04d", fuzzer->out_dir, kind, number);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return;
+    }
+    bool ok = fwrite(input, 1, fuzzer->frames, f) == (size_t) fuzzer->frames;
+    ok &= fclose(f) == 0;
+    if (!ok) {
+        perror(path);
+    }
+}
+
+// Fuzzes until max_execs runs (0 for no limit); returns 1 if anything faulted
+int fuzz(CPU *cpu, int frames, u64 max_execs, const char *out_dir) {
+    static Fuzzer fuzzer;
+    fuzzer.frames = frames;
+    fuzzer.out_dir = out_dir;
+    fuzzer.rng = 0x2545f4914f6cdd1d;
+    mkdir(out_dir, 0755);
+    init_branch_opcodes();
+
+    cpu->skip_render = true;
+    cpu->coverage = fuzzer.coverage;
+    while (cpu->boot_rom_enabled) {
+        step(cpu);
+    }
+    fuzzer.snapshot = calloc(1, sizeof(CPU));
+    assert(fuzzer.snapshot);
+    fork_cpu(fuzzer.snapshot, cpu);
+
+    fuzzer.corpus[fuzzer.corpus_len++] = calloc(frames, 1);
+    u8 *input = malloc(frames);
+    assert(input);
+    u64 start = host_ns();
+    u64 next_report = start;
+    for (u64 i = 0; !max_execs || i < max_execs; i++) {
+        // The first run is the empty seed itself
+        memcpy(input, fuzzer.corpus[fuzz_random(&fuzzer) % fuzzer.corpus_len], frames);
+        if (i) {
+            fuzz_mutate(&fuzzer, input);
+        }
+        const char *reason = fuzz_run(cpu, &fuzzer, input);
+        if (reason) {
+            u64 key = (u64) (uintptr_t) reason << 16 | cpu->pc;
+            bool known = false;
+            for (int j = 0; j < fuzzer.fault_count; j++) {
+                known |= fuzzer.faults[j] == key;
+            }
+            if (!known && fuzzer.fault_count < 256) {
+                fuzzer.faults[fuzzer.fault_count++] = key;
+                printf("fault: %s at %04x, saved as %s/crash-%04d\n",
+                       reason, cpu->pc, out_dir, fuzzer.fault_count);
+                fuzz_save(&fuzzer, "crash", fuzzer.fault_count, input);
+            }
+        } else if (fuzz_new_coverage(&fuzzer) && fuzzer.corpus_len < max_corpus) {
+            u8 *entry = malloc(frames);
+            assert(entry);
+            memcpy(entry, input, frames);
+            fuzzer.corpus[fuzzer.corpus_len++] = entry;
+            fuzz_save(&fuzzer, "queue", fuzzer.corpus_len, input);
+        }
+        u64 now = host_ns();
+        if (now >= next_report) {
+            double seconds = (now - start) / 1e9;
+            printf("%llu execs (%.0f/s), corpus %d, edges %d, faults %d\n",
+                   (unsigned long long) fuzzer.execs, seconds > 0 ? fuzzer.execs / seconds : 0,
+                   fuzzer.corpus_len, fuzzer.edges, fuzzer.fault_count);
+            fflush(stdout);
+            next_report = now + 1000000000;
+        }
+    }
+    free(input);
+    free_cpu(fuzzer.snapshot);
+    free(fuzzer.snapshot);
+    return fuzzer.fault_count != 0;
+}
+
+// Experimental N-wide core for running many instances of one rom, as in
+// search or training workloads. Lanes that agree on pc are kept together
+// in groups between instructions, and the group with the lowest pc runs
+// next, so lanes that fall behind catch up with the ones ahead and join
+// them. A group runs until its pc passes the next group's.
+//
+// A group's lanes go lane-wide for as long as their opcodes touch nothing
+// but registers and plain memory: their register files are copied into
+// structure-of-arrays rows, each opcode runs once across the rows, and a
+// conditional branch that splits them does so under a mask. Anything else,
+// and a lane on its own, goes through step() on the lane's own registers.
+#define batch_max_lanes 256
+
+// Register rows use the r8 encoding (b, c, d, e, h, l, (hl), a), with the
+// unused (hl) slot holding f
+#define batch_f 6
+#define batch_a 7
+// The most instructions in one lane-wide run, so their opcodes can be
+// counted for each lane at the end
+#define batch_max_run 64
+
+typedef struct Batch {
+    int lanes;
+    CPU *cpus;
+    // The registers of the group running lane-wide, a column per lane
+    u8 regs[8][batch_max_lanes];
+    u16 sp[batch_max_lanes];
+    // Where the memory opcode being run reaches, a column per lane
+    u16 addresses[batch_max_lanes];
+    // Each group is a list of lanes through next_lane, named by its first
+    // lane. All its lanes are at that lane's pc.
+    int next_lane[batch_max_lanes];
+    int group_size[batch_max_lanes];
+    // Groups waiting to run, as a min-heap on pc
+    int queue[batch_max_lanes];
+    int queued;
+    // Instructions run through a lane-wide handler and lane by lane
+    u64 wide;
+    u64 scalar;
+} Batch;
+
+// How each opcode can run across a group. Memory opcodes only run lane-wide
+// where every lane reaches plain memory.
+typedef enum {
+    BATCH_SCALAR,
+    BATCH_REGISTERS,
+    BATCH_READ,
+    BATCH_WRITE,
+    BATCH_READ_WRITE,
+} BatchKind;
+
+u8 batch_opcodes[256];
+
+void init_batch_opcodes() {
+    for (int byte = 0; byte < 256; byte++) {
+        int x = byte >> 6;
+        int y = (byte >> 3) & 7;
+        int z = byte & 7;
+        bool wide = false;
+        if (x == 1) {
+            // ld r, r
+            wide = y != 6 && z != 6;
+        } else if (x == 2) {
+            // alu a, r
+            wide = z != 6;
+        } else if (x == 0) {
+            // inc r, dec r, ld r, d8
+            wide = (z == 4 || z == 5 || z == 6) && y != 6;
+            // ld rr, d16, inc rr, dec rr, rotates of a, cpl, scf, ccf
+            wide = wide || z == 3 || (z == 1 && !(y & 1)) || z == 7;
+            // nop, jr, jr cc
+            wide = wide || byte == 0x00 || byte == 0x18 || (z == 0 && y >= 4);
+        } else {
+            // alu a, d8, jp, jp cc
+            wide = z == 6 || byte == 0xc3 || (z == 2 && y < 4);
+        }
+        batch_opcodes[byte] = wide ? BATCH_REGISTERS : BATCH_SCALAR;
+        if (x == 1 && (y == 6) != (z == 6)) {
+            // ld r, (hl), ld (hl), r
+            batch_opcodes[byte] = z == 6 ? BATCH_READ : BATCH_WRITE;
+        } else if (x == 2 && z == 6) {
+            // alu a, (hl)
+            batch_opcodes[byte] = BATCH_READ;
+        } else if (x == 0 && z == 2) {
+            // ld (bc), a, ld a, (bc) and the same through de, hl+ and hl-
+            batch_opcodes[byte] = (y & 1) ? BATCH_READ : BATCH_WRITE;
+        } else if (x == 3 && !(y & 1) && (z == 1 || z == 5)) {
+            // pop rr, push rr
+            batch_opcodes[byte] = z == 1 ? BATCH_READ : BATCH_WRITE;
+        }
+    }
+    // daa is register only but not worth a lane-wide copy
+    batch_opcodes[0x27] = BATCH_SCALAR;
+    // ld (hl), d8, inc (hl), dec (hl)
+    batch_opcodes[0x36] = BATCH_WRITE;
+    batch_opcodes[0x34] = BATCH_READ_WRITE;
+    batch_opcodes[0x35] = BATCH_READ_WRITE;
+    // ldh and ld through (c) and a16, and call
+    batch_opcodes[0xe0] = BATCH_WRITE;
+    batch_opcodes[0xe2] = BATCH_WRITE;
+    batch_opcodes[0xea] = BATCH_WRITE;
+    batch_opcodes[0xf0] = BATCH_READ;
+    batch_opcodes[0xf2] = BATCH_READ;
+    batch_opcodes[0xfa] = BATCH_READ;
+    batch_opcodes[0xcd] = BATCH_WRITE;
+}
+
+void batch_push(Batch *batch, int group) {
+    u16 pc = batch->cpus[group].pc;
+    int i = batch->queued++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (batch->cpus[batch->queue[parent]].pc <= pc) {
+            break;
+        }
+        batch->queue[i] = batch->queue[parent];
+        i = parent;
+    }
+    batch->queue[i] = group;
+}
+
+int batch_pop(Batch *batch) {
+    int top = batch->queue[0];
+    int last = batch->queue[--batch->queued];
+    u16 pc = batch->cpus[last].pc;
+    int i = 0;
+    while (2 * i + 1 < batch->queued) {
+        int child = 2 * i + 1;
+        if (child + 1 < batch->queued
+            && batch->cpus[batch->queue[child + 1]].pc < batch->cpus[batch->queue[child]].pc) {
+            child++;
+        }
+        if (batch->cpus[batch->queue[child]].pc >= pc) {
+            break;
+        }
+        batch->queue[i] = batch->queue[child];
+        i = child;
+    }
+    batch->queue[i] = last;
+    return top;
+}
+
+// Moves other's lanes onto the end of group
+void batch_join(Batch *batch, int group, int other) {
+    int tail = group;
+    while (batch->next_lane[tail] >= 0) {
+        tail = batch->next_lane[tail];
+    }
+    batch->next_lane[tail] = other;
+    batch->group_size[group] += batch->group_size[other];
+}
+
+// Queues group's lanes again as groups by pc, leaving out lanes that have
+// reached until
+void batch_requeue(Batch *batch, int group, u64 until) {
+    int *next = batch->next_lane;
+    int rest = group;
+    while (rest >= 0) {
+        // Peels off the lanes at the first remaining lane's pc
+        u16 pc = batch->cpus[rest].pc;
+        int lead = -1;
+        int others = -1;
+        int *lead_end = &lead;
+        int *others_end = &others;
+        int size = 0;
+        for (int i = rest; i >= 0;) {
+            int after = next[i];
+            CPU *cpu = &batch->cpus[i];
+            if (cpu->cycles >= until) {
+                // Done
+            } else if (cpu->pc == pc) {
+                *lead_end = i;
+                lead_end = &next[i];
+                size++;
+            } else {
+                *others_end = i;
+                others_end = &next[i];
+            }
+            i = after;
+        }
+        *lead_end = -1;
+        *others_end = -1;
+        if (lead >= 0) {
+            batch->group_size[lead] = size;
+            batch_push(batch, lead);
+        }
+        rest = others;
+    }
+}
+
+void init_batch(Batch *batch, int lanes, bool fast_boot) {
+    assert(lanes > 0 && lanes <= batch_max_lanes);
+    init_batch_opcodes();
+    batch->lanes = lanes;
+    batch->cpus = calloc(lanes, sizeof(CPU));
+    assert(batch->cpus);
+    // Every lane starts as a fork of the first, sharing its rom, so they
+    // all start as one group
+    batch->cpus[0].skip_render = true;
+    batch->cpus[0].fast_boot = fast_boot;
+    init_cpu(&batch->cpus[0]);
+    for (int i = 0; i < lanes; i++) {
+        if (i) {
+            fork_cpu(&batch->cpus[i], &batch->cpus[0]);
+        }
+        batch->next_lane[i] = i + 1 < lanes ? i + 1 : -1;
+    }
+    batch->group_size[0] = lanes;
+    batch->queued = 0;
+    batch_push(batch, 0);
+    batch->wide = 0;
+    batch->scalar = 0;
+}
+
+void free_batch(Batch *batch) {
+    for (int i = 0; i < batch->lanes; i++) {
+        free_cpu(&batch->cpus[i]);
+    }
+    free(batch->cpus);
+    batch->cpus = NULL;
+}
+
+// Whether nothing step() does before or around the opcode itself is due
+bool batch_lane_ready(CPU *cpu) {
+    return !cpu->dma_active && !cpu->halted && !cpu->halt_bug && !cpu->ei_pending
+        && !(cpu->ime && pending_interrupts(cpu))
+        && !cpu->trace && !cpu->coverage && !cpu->profiler;
+}
+
+// Where cpu fetches code on page from, or NULL if it goes through a
+// handler other than the boot rom's
+const u8 *batch_code(CPU *cpu, u8 page) {
+    if (cpu->read_map[page]) {
+        return cpu->read_map[page];
+    }
+    return page == 0 && cpu->read_handlers[0] == boot_rom_read ? boot_rom : NULL;
+}
+
+// Whether cpu fetches the instruction at pc from the same memory as
+// leader, which holds for the shared rom and for ram blocks still shared
+// since the fork
+bool batch_same_code(CPU *cpu, CPU *leader, u16 pc) {
+    u8 first = pc >> 8;
+    u8 last = (u16) (pc + 2) >> 8;
+    const u8 *code = batch_code(cpu, first);
+    return code && code == batch_code(leader, first)
+        && batch_code(cpu, last) && batch_code(cpu, last) == batch_code(leader, last);
+}
+
+// An instruction byte from a page batch_same_code() has vouched for
+u8 batch_fetch(CPU *leader, u16 address) {
+    return batch_code(leader, address >> 8)[address & 0xff];
+}
+
+// Copies the registers of the lanes, all at one pc, into the rows, a
+// column each, and sets *room to the cycles they can all run before one
+// has an event due or reaches until. Returns false, part way through, if
+// a lane isn't ready to go lane-wide.
+bool batch_gather(Batch *batch, const int *lanes, int n, u64 until, u64 *room) {
+    u8 (*r)[batch_max_lanes] = batch->regs;
+    CPU *leader = &batch->cpus[lanes[0]];
+    *room = never;
+    for (int k = 0; k < n; k++) {
+        CPU *cpu = &batch->cpus[lanes[k]];
+        if (!batch_lane_ready(cpu) || cpu->double_speed != leader->double_speed
+            || !batch_same_code(cpu, leader, leader->pc)) {
+            return false;
+        }
+        r[0][k] = cpu->b;
+        r[1][k] = cpu->c;
+        r[2][k] = cpu->d;
+        r[3][k] = cpu->e;
+        r[4][k] = cpu->h;
+        r[5][k] = cpu->l;
+        r[batch_f][k] = cpu->f;
+        r[batch_a][k] = cpu->a;
+        batch->sp[k] = cpu->sp;
+        u64 end = cpu->next_event < until ? cpu->next_event : until;
+        if (end - cpu->cycles < *room) {
+            *room = end - cpu->cycles;
+        }
+    }
+    return true;
+}
+
+void batch_scatter(Batch *batch, const int *lanes, int n) {
+    u8 (*r)[batch_max_lanes] = batch->regs;
+    for (int k = 0; k < n; k++) {
+        CPU *cpu = &batch->cpus[lanes[k]];
+        cpu->b = r[0][k];
+        cpu->c = r[1][k];
+        cpu->d = r[2][k];
+        cpu->e = r[3][k];
+        cpu->h = r[4][k];
+        cpu->l = r[5][k];
+        cpu->f = r[batch_f][k];
+        cpu->a = r[batch_a][k];
+        cpu->sp = batch->sp[k];
+    }
+}
+
+// Lane-wide versions of the alu helpers over the first n columns, one loop
+// per op so each can vectorise
+void batch_alu(Batch *batch, int n, int op, const u8 *vals) {
+    u8 *a = batch->regs[batch_a];
+    u8 *f = batch->regs[batch_f];
+    switch (op) {
+        case 0: {
+            for (int k = 0; k < n; k++) {
+                u8 x = a[k];
+                u8 v = vals[k];
+                u8 res = x + v;
+                f[k] = ((res == 0) << Z_INDEX) | (((x & 0xf) + (v & 0xf) > 0xf) << H_INDEX)
+                    | ((x + v > 0xff) << C_INDEX);
+                a[k] = res;
             }
-            case 0x83: {
-                cpu.a = add(&cpu, cpu.e);
-                break;
+            break;
+        }
+        case 1: {
+            for (int k = 0; k < n; k++) {
+                u8 x = a[k];
+                u8 v = vals[k];
+                u8 carry = (f[k] >> C_INDEX) & 1;
+                u8 res = x + v + carry;
+                f[k] = ((res == 0) << Z_INDEX) | (((x & 0xf) + (v & 0xf) + carry > 0xf) << H_INDEX)
+                    | ((x + v + carry > 0xff) << C_INDEX);
+                a[k] = res;
             }
-            case 0x84: {
-                cpu.a = add(&cpu, cpu.h);
-                break;
+            break;
+        }
+        case 2:
+        case 7: {
+            for (int k = 0; k < n; k++) {
+                u8 x = a[k];
+                u8 v = vals[k];
+                u8 res = x - v;
+                f[k] = N_MASK | ((res == 0) << Z_INDEX) | (((x & 0xf) < (v & 0xf)) << H_INDEX)
+                    | ((x < v) << C_INDEX);
+                // cp only sets flags
+                a[k] = op == 2 ? res : x;
             }
-            case 0x85: {
-                cpu.a = add(&cpu, cpu.l);
-                break;
+            break;
+        }
+        case 3: {
+            for (int k = 0; k < n; k++) {
+                u8 x = a[k];
+                u8 v = vals[k];
+                u8 carry = (f[k] >> C_INDEX) & 1;
+                u8 res = x - v - carry;
+                f[k] = N_MASK | ((res == 0) << Z_INDEX) | (((x & 0xf) < (v & 0xf) + carry) << H_INDEX)
+                    | ((x < v + carry) << C_INDEX);
+                a[k] = res;
             }
-            case 0x86: {
-                cpu.a = add(&cpu, dereference_hl(&cpu));
-                break;
+            break;
+        }
+        case 4: {
+            for (int k = 0; k < n; k++) {
+                a[k] &= vals[k];
+                f[k] = H_MASK | ((a[k] == 0) << Z_INDEX);
             }
-            case 0x87: {
-                cpu.a = add(&cpu, cpu.a);
-                break;
+            break;
+        }
+        case 5: {
+            for (int k = 0; k < n; k++) {
+                a[k] ^= vals[k];
+                f[k] = (a[k] == 0) << Z_INDEX;
             }
-            case 0x90: {
-                cpu.a = sub(&cpu, cpu.b);
-                break;
+            break;
+        }
+        default: {
+            for (int k = 0; k < n; k++) {
+                a[k] |= vals[k];
+                f[k] = (a[k] == 0) << Z_INDEX;
             }
-            case 0x91: {
-                cpu.a = sub(&cpu, cpu.c);
-                break;
+            break;
+        }
+    }
+}
+
+// Whether address is plain memory on cpu: no handler behind it, so reading
+// or writing it neither depends on nor changes timing or interrupt state
+bool batch_plain(CPU *cpu, u16 address, bool write) {
+    if (address >= 0xff80) {
+        // hram, but not ie
+        return address != interrupt_enable_address;
+    }
+    return write ? cpu->write_map[address >> 8] != NULL : cpu->read_map[address >> 8] != NULL;
+}
+
+// io registers whose reads have no side effects, only depending on the
+// lane's clock, which the run brings up to date first
+bool batch_io_readable(u16 address) {
+    return address == joypad_address || address == ly_address || address == lcd_status_address
+        || address == lcd_control_address || address == ly_compare_address
+        || address == interrupt_flag_address || address == div_address;
+}
+
+bool batch_stack_opcode(u8 byte) {
+    return byte == 0xcd || (byte >= 0xc0 && !(byte & 8) && ((byte & 7) == 1 || (byte & 7) == 5));
+}
+
+// Where the memory opcode byte reaches in column k, or the lower of the
+// two addresses a stack opcode moves
+u16 batch_address(Batch *batch, int k, u8 byte, bool stack, u8 imm, u16 imm16) {
+    u8 (*r)[batch_max_lanes] = batch->regs;
+    switch (byte) {
+        case 0x02:
+        case 0x0a: {
+            return make_u16(r[0][k], r[1][k]);
+        }
+        case 0x12:
+        case 0x1a: {
+            return make_u16(r[2][k], r[3][k]);
+        }
+        case 0xe0:
+        case 0xf0: {
+            return 0xff00 | imm;
+        }
+        case 0xe2:
+        case 0xf2: {
+            return 0xff00 | r[1][k];
+        }
+        case 0xea:
+        case 0xfa: {
+            return imm16;
+        }
+        default: {
+            if (stack) {
+                // pop reads from sp, push and call write below it
+                return (byte & 7) == 1 ? batch->sp[k] : batch->sp[k] - 2;
             }
-            case 0x92: {
-                cpu.a = sub(&cpu, cpu.d);
-                break;
+            return make_u16(r[4][k], r[5][k]);
+        }
+    }
+}
+
+// Whether the memory opcode byte reaches only plain memory on every lane,
+// or for a plain read, an io register batch_io_readable() allows. Fills in
+// batch->addresses on the way, and sets *io if any lane reads io.
+bool batch_memory_ready(Batch *batch, const int *lanes, int n, u8 byte, u8 imm, u16 imm16,
+                        bool *io) {
+    u8 kind = batch_opcodes[byte];
+    bool stack = batch_stack_opcode(byte);
+    *io = false;
+    for (int k = 0; k < n; k++) {
+        CPU *cpu = &batch->cpus[lanes[k]];
+        u16 address = batch_address(batch, k, byte, stack, imm, imm16);
+        batch->addresses[k] = address;
+        if (kind == BATCH_READ && !stack && batch_io_readable(address)) {
+            *io = true;
+            continue;
+        }
+        for (int i = 0; i <= stack; i++) {
+            if ((kind != BATCH_WRITE && !batch_plain(cpu, address + i, false))
+                || (kind != BATCH_READ && !batch_plain(cpu, address + i, true))) {
+                return false;
             }
-            case 0x93: {
-                cpu.a = sub(&cpu, cpu.e);
-                break;
+        }
+    }
+    return true;
+}
+
+// Runs the memory opcode byte on the first n columns at the addresses
+// batch_memory_ready() found, each lane through its own bus in the order
+// step() would, so write hashes and metrics come out the same. next is the
+// pc after the instruction, which call pushes.
+void batch_access(Batch *batch, const int *lanes, int n, u8 byte, u8 imm, u16 next) {
+    u8 (*r)[batch_max_lanes] = batch->regs;
+    const u16 *addresses = batch->addresses;
+    u8 *f = r[batch_f];
+    u8 *a = r[batch_a];
+    int y = (byte >> 3) & 7;
+    int z = byte & 7;
+    if (byte >= 0x80 && byte < 0xc0) {
+        // alu a, (hl)
+        u8 vals[batch_max_lanes];
+        for (int k = 0; k < n; k++) {
+            vals[k] = memory(&batch->cpus[lanes[k]], addresses[k]);
+        }
+        batch_alu(batch, n, y, vals);
+    } else if (byte >= 0x40 && byte < 0x80 && z == 6) {
+        for (int k = 0; k < n; k++) {
+            r[y][k] = memory(&batch->cpus[lanes[k]], addresses[k]);
+        }
+    } else if (byte >= 0x40 && byte < 0x80) {
+        for (int k = 0; k < n; k++) {
+            set_memory(&batch->cpus[lanes[k]], addresses[k], r[z][k]);
+        }
+    } else if (byte == 0x36) {
+        for (int k = 0; k < n; k++) {
+            set_memory(&batch->cpus[lanes[k]], addresses[k], imm);
+        }
+    } else if (byte == 0x34 || byte == 0x35) {
+        // inc (hl), dec (hl)
+        for (int k = 0; k < n; k++) {
+            CPU *cpu = &batch->cpus[lanes[k]];
+            u8 v = memory(cpu, addresses[k]);
+            u8 res = byte == 0x34 ? v + 1 : v - 1;
+            u8 half = byte == 0x34 ? (v & 0xf) == 0xf : (v & 0xf) == 0;
+            f[k] = (f[k] & C_MASK) | (byte == 0x35 ? N_MASK : 0) | ((res == 0) << Z_INDEX)
+                | (half << H_INDEX);
+            set_memory(cpu, addresses[k], res);
+        }
+    } else if (byte < 0x40) {
+        // ld (bc), a, ld a, (bc) and the same through de, hl+ and hl-
+        for (int k = 0; k < n; k++) {
+            CPU *cpu = &batch->cpus[lanes[k]];
+            u16 address = addresses[k];
+            if (y & 1) {
+                a[k] = memory(cpu, address);
+            } else {
+                set_memory(cpu, address, a[k]);
+            }
+            if (y >= 4) {
+                address += y >= 6 ? -1 : 1;
+                r[4][k] = hi(address);
+                r[5][k] = lo(address);
             }
-            case 0x94: {
-                cpu.a = sub(&cpu, cpu.h);
-                break;
+        }
+    } else if (byte == 0xe0 || byte == 0xe2 || byte == 0xea) {
+        for (int k = 0; k < n; k++) {
+            set_memory(&batch->cpus[lanes[k]], addresses[k], a[k]);
+        }
+    } else if (byte == 0xf0 || byte == 0xf2 || byte == 0xfa) {
+        for (int k = 0; k < n; k++) {
+            a[k] = memory(&batch->cpus[lanes[k]], addresses[k]);
+        }
+    } else if (z == 1) {
+        // pop rr. Pairs are bc, de, hl, af.
+        int pair = y >> 1;
+        for (int k = 0; k < n; k++) {
+            CPU *cpu = &batch->cpus[lanes[k]];
+            u16 val = make_u16(memory(cpu, addresses[k] + 1), memory(cpu, addresses[k]));
+            batch->sp[k] = addresses[k] + 2;
+            if (pair == 3) {
+                a[k] = hi(val);
+                f[k] = lo(val) & 0xf0;
+            } else {
+                r[pair * 2][k] = hi(val);
+                r[pair * 2 + 1][k] = lo(val);
             }
-            case 0x95: {
-                cpu.a = sub(&cpu, cpu.l);
-                break;
+        }
+    } else {
+        // push rr, call
+        int pair = y >> 1;
+        for (int k = 0; k < n; k++) {
+            CPU *cpu = &batch->cpus[lanes[k]];
+            u16 val = byte == 0xcd ? next
+                : pair == 3 ? make_u16(a[k], f[k]) : make_u16(r[pair * 2][k], r[pair * 2 + 1][k]);
+            batch->sp[k] = addresses[k];
+            set_memory(cpu, addresses[k], lo(val));
+            set_memory(cpu, addresses[k] + 1, hi(val));
+        }
+    }
+}
+
+// Runs byte, fetched from the shared code at pc, on the first n columns.
+// Returns the pc to go on at. A conditional branch sets *target and, as a
+// mask, taken for the columns that go there, and returns how many do in
+// *taken_count, which is -1 otherwise.
+u16 batch_execute(Batch *batch, const int *lanes, int n, u8 *taken, int *taken_count,
+                  u16 *target, CPU *leader, u16 pc, u8 byte) {
+    u8 (*r)[batch_max_lanes] = batch->regs;
+    u8 *f = r[batch_f];
+    u8 *a = r[batch_a];
+    int y = (byte >> 3) & 7;
+    int z = byte & 7;
+    u8 imm = batch_fetch(leader, pc + 1);
+    u16 imm16 = make_u16(batch_fetch(leader, pc + 2), imm);
+    u16 next = pc + opcodes[byte].length;
+    *taken_count = -1;
+    if (batch_opcodes[byte] != BATCH_REGISTERS) {
+        batch_access(batch, lanes, n, byte, imm, next);
+        return byte == 0xcd ? imm16 : next;
+    } else if (byte >= 0x40 && byte < 0x80) {
+        for (int k = 0; k < n; k++) {
+            r[y][k] = r[z][k];
+        }
+    } else if (byte >= 0x80 && byte < 0xc0) {
+        batch_alu(batch, n, y, r[z]);
+    } else if (byte >= 0xc0 && z == 6) {
+        u8 vals[batch_max_lanes];
+        memset(vals, imm, n);
+        batch_alu(batch, n, y, vals);
+    } else if (byte < 0x40 && z == 4) {
+        // inc r
+        for (int k = 0; k < n; k++) {
+            u8 v = r[y][k];
+            u8 res = v + 1;
+            r[y][k] = res;
+            f[k] = (f[k] & C_MASK) | ((res == 0) << Z_INDEX) | (((v & 0xf) == 0xf) << H_INDEX);
+        }
+    } else if (byte < 0x40 && z == 5) {
+        // dec r
+        for (int k = 0; k < n; k++) {
+            u8 v = r[y][k];
+            u8 res = v - 1;
+            r[y][k] = res;
+            f[k] = (f[k] & C_MASK) | N_MASK | ((res == 0) << Z_INDEX) | (((v & 0xf) == 0) << H_INDEX);
+        }
+    } else if (byte < 0x40 && z == 6) {
+        memset(r[y], imm, n);
+    } else if (byte < 0x40 && (z == 1 || z == 3)) {
+        // ld rr, d16 / inc rr / dec rr. Pairs are bc, de, hl, sp.
+        int pair = y >> 1;
+        int delta = z == 1 ? 0 : (y & 1) ? -1 : 1;
+        if (pair == 3) {
+            for (int k = 0; k < n; k++) {
+                batch->sp[k] = z == 1 ? imm16 : batch->sp[k] + delta;
             }
-            case 0x96: {
-                cpu.a = sub(&cpu, dereference_hl(&cpu));
-                break;
+        } else {
+            u8 *hi_row = r[pair * 2];
+            u8 *lo_row = r[pair * 2 + 1];
+            for (int k = 0; k < n; k++) {
+                u16 val = z == 1 ? imm16 : make_u16(hi_row[k], lo_row[k]) + delta;
+                hi_row[k] = hi(val);
+                lo_row[k] = lo(val);
             }
-            case 0x97: {
-                cpu.a = sub(&cpu, cpu.a);
-                break;
+        }
+    } else if (byte < 0x40 && z == 7) {
+        // rlca, rrca, rla, rra, cpl, scf, ccf
+        for (int k = 0; k < n; k++) {
+            u8 x = a[k];
+            u8 carry = (f[k] >> C_INDEX) & 1;
+            u8 res = x;
+            u8 flags = f[k];
+            switch (y) {
+                case 0: {
+                    res = (x << 1) | (x >> 7);
+                    flags = (x >> 7) << C_INDEX;
+                    break;
+                }
+                case 1: {
+                    res = (x >> 1) | (x << 7);
+                    flags = (x & 1) << C_INDEX;
+                    break;
+                }
+                case 2: {
+                    res = (x << 1) | carry;
+                    flags = (x >> 7) << C_INDEX;
+                    break;
+                }
+                case 3: {
+                    res = (x >> 1) | (carry << 7);
+                    flags = (x & 1) << C_INDEX;
+                    break;
+                }
+                case 5: {
+                    res = ~x;
+                    flags |= N_MASK | H_MASK;
+                    break;
+                }
+                case 6: {
+                    flags = (flags & Z_MASK) | C_MASK;
+                    break;
+                }
+                case 7: {
+                    flags = (flags & Z_MASK) | ((flags ^ C_MASK) & C_MASK);
+                    break;
+                }
             }
-            case 0xa8: {
-                xor(&cpu, cpu.b);
-                break;
+            a[k] = res;
+            f[k] = flags;
+        }
+    } else if (byte == 0x18 || byte == 0xc3) {
+        return byte == 0x18 ? next + (i8) imm : imm16;
+    } else if (byte != 0x00) {
+        // jr cc, jp cc. The condition is nz, z, nc, c.
+        *target = byte < 0x40 ? next + (i8) imm : imm16;
+        u8 flag = (y & 2) ? C_MASK : Z_MASK;
+        u8 want = (y & 1) ? flag : 0;
+        int count = 0;
+        for (int k = 0; k < n; k++) {
+            taken[k] = (f[k] & flag) == want;
+            count += taken[k];
+        }
+        *taken_count = count;
+    }
+    return next;
+}
+
+// Runs the n lanes, all at one pc, lane-wide for as long as they keep to
+// opcodes batch_opcodes allows and one pc below limit. Until the run ends they
+// share one clock, so it stops at the first instruction that takes a lane
+// up to an event or until. Returns false, having run nothing, if a lane
+// isn't ready to go lane-wide.
+bool batch_run_wide(Batch *batch, const int *lanes, int n, u32 limit, u64 until) {
+    CPU *first = &batch->cpus[lanes[0]];
+    const u8 *code = batch_code(first, first->pc >> 8);
+    u64 room;
+    if (!code || !batch_opcodes[code[first->pc & 0xff]] || !batch_gather(batch, lanes, n, until, &room)) {
+        return false;
+    }
+    CPU *leader = &batch->cpus[lanes[0]];
+    u8 speed = leader->double_speed;
+    u16 pc = leader->pc;
+    u8 code_page = pc >> 8;
+    u16 target = 0;
+    u8 taken[batch_max_lanes];
+    int taken_count = -1;
+    u64 elapsed = 0;
+    u8 run[batch_max_run];
+    int length = 0;
+    while (true) {
+        // Jumps can take the lanes onto pages they map differently
+        if (length && (pc >> 8 != code_page || (u16) (pc + 2) >> 8 != code_page)) {
+            code_page = pc >> 8;
+            bool same = true;
+            for (int k = 0; k < n && same; k++) {
+                same = batch_same_code(&batch->cpus[lanes[k]], leader, pc);
             }
-            case 0xa9: {
-                xor(&cpu, cpu.c);
+            if (!same) {
                 break;
             }
-            case 0xaa: {
-                xor(&cpu, cpu.d);
+        }
+        u8 byte = batch_fetch(leader, pc);
+        if (!batch_opcodes[byte]) {
+            break;
+        }
+        if (batch_opcodes[byte] >= BATCH_READ) {
+            // Code outside the rom could be changed by the lanes' own stores
+            u8 imm = batch_fetch(leader, pc + 1);
+            u16 imm16 = make_u16(batch_fetch(leader, pc + 2), imm);
+            bool io;
+            if (pc >= 0x8000 || !batch_memory_ready(batch, lanes, n, byte, imm, imm16, &io)) {
                 break;
             }
-            case 0xab: {
-                xor(&cpu, cpu.e);
-                break;
+            if (io) {
+                for (int k = 0; k < n; k++) {
+                    batch->cpus[lanes[k]].cycles += elapsed;
+                }
+                room -= elapsed;
+                elapsed = 0;
             }
-            case 0xac: {
-                xor(&cpu, cpu.h);
-                break;
+        }
+        run[length++] = byte;
+        pc = batch_execute(batch, lanes, n, taken, &taken_count, &target, leader, pc, byte);
+        u8 cycles = opcodes[byte].cycles;
+        if (taken_count == n) {
+            pc = target;
+            cycles += 4;
+        }
+        elapsed += cycles >> speed;
+        if ((taken_count > 0 && taken_count < n) || elapsed >= room || pc >= limit
+            || length == batch_max_run) {
+            break;
+        }
+    }
+    if (!length) {
+        return false;
+    }
+    batch_scatter(batch, lanes, n);
+    bool split = taken_count > 0 && taken_count < n;
+    for (int k = 0; k < n; k++) {
+        CPU *cpu = &batch->cpus[lanes[k]];
+        bool branched = split && taken[k];
+        cpu->pc = branched ? target : pc;
+        cpu->cycles += elapsed + (branched ? 4 >> speed : 0);
+#ifndef NO_METRICS
+        for (int i = 0; i < length; i++) {
+            count_metric(cpu->metrics.instructions);
+            count_metric(cpu->metrics.opcodes[run[i]]);
+        }
+#endif
+        if (cpu->cycles >= cpu->next_event) {
+            run_events(cpu);
+        }
+    }
+    batch->wide += (u64) n * length;
+    return true;
+}
+
+// Runs group until its pc passes limit, the lowest pc of the groups still
+// queued, or its lanes part ways, then queues what's left of it again.
+// Returns whether a lane finished a frame or reached until, which also
+// ends the run.
+bool batch_run_group(Batch *batch, int group, u32 limit, u64 until) {
+    CPU *leader = &batch->cpus[group];
+    bool stop = false;
+    if (batch->group_size[group] == 1) {
+        // A lane on its own runs like any other cpu until it catches up
+        Core core = step_core(leader);
+        do {
+            core(leader);
+            batch->scalar++;
+        } while (leader->pc < limit && !leader->frame_done && leader->cycles < until);
+        stop = leader->frame_done || leader->cycles >= until;
+        batch_requeue(batch, group, until);
+        return stop;
+    }
+    int lanes[batch_max_lanes];
+    int n = 0;
+    for (int i = group; i >= 0; i = batch->next_lane[i]) {
+        lanes[n++] = i;
+    }
+    // Batch lanes never trace or cover, so they all step the same way
+    Core core = step_core(leader);
+    bool together = true;
+    while (together && !stop && leader->pc < limit) {
+        if (!batch_run_wide(batch, lanes, n, limit, until)) {
+            for (int k = 0; k < n; k++) {
+                core(&batch->cpus[lanes[k]]);
+            }
+            batch->scalar += n;
+        }
+        for (int k = 0; k < n; k++) {
+            CPU *cpu = &batch->cpus[lanes[k]];
+            stop |= cpu->frame_done || cpu->cycles >= until;
+            together &= cpu->pc == leader->pc;
+        }
+    }
+    batch_requeue(batch, group, until);
+    return stop;
+}
+
+// Runs groups, lowest pc first, until a lane finishes a frame or reaches
+// until. Returns false once every lane has reached it.
+bool batch_run(Batch *batch, u64 until) {
+    while (batch->queued) {
+        int group = batch_pop(batch);
+        // Groups that have caught up with each other go on as one
+        while (batch->queued && batch->cpus[batch->queue[0]].pc == batch->cpus[group].pc) {
+            batch_join(batch, group, batch_pop(batch));
+        }
+        u32 limit = batch->queued ? batch->cpus[batch->queue[0]].pc : 0x10000;
+        if (batch_run_group(batch, group, limit, until)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs lanes of the rom until each has done max_cycles, with every lane
+// mashing its own pseudo-random buttons so they actually diverge
+int run_batch(int lanes, u64 max_cycles, bool fast_boot) {
+    static Batch batch;
+    init_batch(&batch, lanes, fast_boot);
+    u64 rng[batch_max_lanes];
+    for (int i = 0; i < lanes; i++) {
+        rng[i] = 0x9e3779b97f4a7c15ull * (i + 1);
+    }
+    u32 frames[batch_max_lanes] = {0};
+    // Every lane starts at the same cycle, 0 or just past the boot rom
+    u64 until = batch.cpus[0].cycles + max_cycles;
+    u64 start = host_ns();
+    while (batch_run(&batch, until)) {
+        for (int i = 0; i < lanes; i++) {
+            CPU *cpu = &batch.cpus[i];
+            if (!cpu->frame_done) {
+                continue;
+            }
+            cpu->frame_done = false;
+            // A new set of buttons held every quarter second or so
+            if (frames[i]++ % 16 == 0) {
+                rng[i] ^= rng[i] << 13;
+                rng[i] ^= rng[i] >> 7;
+                rng[i] ^= rng[i] << 17;
+                set_buttons(cpu, rng[i] >> 56);
             }
-            case 0xad: {
-                xor(&cpu, cpu.l);
+        }
+    }
+    double seconds = (host_ns() - start) / 1e9;
+    u64 total = batch.wide + batch.scalar;
+    fprintf(stderr, "%d lanes, %llu instructions in %.2fs (%.1f M/s), %.1f%% lane-wide\n",
+            lanes, (unsigned long long) total, seconds, seconds > 0 ? total / seconds / 1e6 : 0,
+            total ? 100.0 * batch.wide / total : 0);
+    if (print_fingerprints) {
+        for (int i = 0; i < lanes; i++) {
+            fprintf(stderr, "lane %d state %016llx\n", i,
+                    (unsigned long long) state_hash(&batch.cpus[i]));
+        }
+    }
+    free_batch(&batch);
+    return 0;
+}
+
+// The Env interface from gameboy.h. Every Env keeps a template machine,
+// booted and run for one drawn frame, and resets by forking from it.
+struct Env {
+    CPU start;
+    CPU cpu;
+    u64 frames;
+    u16 range_addresses[ENV_MAX_RANGES];
+    int range_count;
+};
+
+bool env_rom_loaded;
+
+// Runs one frame: until the next vblank, or a frame's worth of cycles if
+// the lcd is off and there won't be one
+void env_frame(CPU *cpu, bool draw) {
+    cpu->skip_render = !draw;
+    // With the lcd off there's no vblank, so a frame is just its length. Once
+    // it's on, run to vblank so the next frame is drawn from the top.
+    u64 deadline = cpu->cycles + (u64) line_cycles * lines_per_frame;
+    Core core = step_core(cpu);
+    while (!cpu->frame_done
+           && (cpu->cycles < deadline || (load(cpu, lcd_control_address) & 0x80))) {
+        core(cpu);
+    }
+    cpu->frame_done = false;
+}
+
+void env_observation(Env *env, CPU *cpu, EnvObservation *observation) {
+    // Right after a reset nothing has been drawn yet but the template's frame
+    Frame *frame = cpu->gpu.latest ? cpu->gpu.latest : env->start.gpu.latest;
+    observation->shades = &frame->shades[0][0];
+    observation->pixels = &frame->pixels[0][0];
+    observation->frames = env->frames;
+    for (int i = 0; i < env->range_count; i++) {
+        u16 address = env->range_addresses[i];
+        // Through the page table, for whichever wram bank a cgb has in
+        u32 offset = page_base(cpu, address >> 8) | (address & 0xff);
+        observation->ranges[i] = cpu->blocks[offset >> block_bits]->bytes + (offset & (block_size - 1));
+    }
+}
+
+Env *env_create(const char *rom_path) {
+    if (!env_rom_loaded) {
+        if (!load_rom(rom_path)) {
+            return NULL;
+        }
+        env_rom_loaded = true;
+    }
+    Env *env = calloc(1, sizeof(Env));
+    assert(env);
+    env->start.fast_boot = true;
+    init_cpu(&env->start);
+    env_frame(&env->start, true);
+    env_reset(env, NULL);
+    return env;
+}
+
+void env_destroy(Env *env) {
+    free_cpu(&env->cpu);
+    free_cpu(&env->start);
+    free(env);
+}
+
+int env_observe(Env *env, u16 address, u16 len) {
+    u32 end = (u32) address + len;
+    bool wram = address >= 0xc000 && end <= 0xe000;
+    bool hram = address >= 0xff80 && end <= 0xffff;
+    // A cgb's banked 0xd000 isn't next to 0xc000 in memory
+    bool split = env->start.cgb && address < 0xd000 && end > 0xd000;
+    if (env->range_count == ENV_MAX_RANGES || !len || !(wram || hram) || split) {
+        return -1;
+    }
+    env->range_addresses[env->range_count] = address;
+    return env->range_count++;
+}
+
+void env_reset(Env *env, EnvObservation *observation) {
+    fork_cpu(&env->cpu, &env->start);
+    env->frames = 0;
+    if (observation) {
+        env_observation(env, &env->cpu, observation);
+    }
+}
+
+void env_step(Env *env, u8 action, int frameskip, EnvObservation *observation) {
+    CPU *cpu = &env->cpu;
+    set_buttons(cpu, action);
+    for (int i = 0; i < frameskip; i++) {
+        env_frame(cpu, i == frameskip - 1);
+    }
+    env->frames += frameskip;
+    env_observation(env, cpu, observation);
+}
+
+#ifndef GB_LIBRARY
+CPU cpu;
+CPU reference_cpu;
+CPU link_cpu;
+const char *profile_path = "profile.folded";
+
+void report_profile_at_exit() {
+    report_profile(&cpu, profile_path);
+}
+
+void handle_sigusr1(int signal) {
+    (void) signal;
+    metrics_requested = 1;
+}
+
+void dump_metrics_at_exit() {
+    dump_metrics(&cpu, video, metrics_format, stderr);
+}
+
+// path with its extension swapped for extension
+void sibling_path(char *out, size_t len, const char *path, const char *extension) {
+    snprintf(out, len, "%s", path);
+    char *old = strrchr(out, '.');
+    if (old && !strchr(old, '/')) {
+        *old = '\0';
+    }
+    strncat(out, extension, len - strlen(out) - 1);
+}
+
+void finish_capture_at_exit() {
+    finish_capture(capture);
+}
+
+void stop_streamer_at_exit() {
+    stop_streamer(streamer);
+}
+
+int main(int argc, char **argv) {
+    bool threaded_render = false;
+    bool debug_enabled = false;
+    bool disassemble_only = false;
+    const char *symbol_path = NULL;
+    u64 profile_interval = 0;
+    bool test_vectors = false;
+    bool headless = false;
+    bool lockstep_enabled = false;
+    u64 max_cycles = 0;
+    bool fuzz_enabled = false;
+    int fuzz_frames = 60;
+    u64 fuzz_execs = 0;
+    const char *fuzz_out = "fuzz";
+    bool link_enabled = false;
+    bool link_socket = false;
+    int batch_lanes = 0;
+    bool check_boot = false;
+    bool check_decode_only = false;
+    const char *capture_path = NULL;
+    CapturePolicy capture_policy = CAPTURE_BLOCK;
+    int capture_workers = 2;
+    const char *stream_path = NULL;
+    const char *watch_path = NULL;
+    // Parsed once the symbols are loaded so labels work
+    const char *initial_breakpoints[max_breakpoints];
+    int initial_breakpoint_count = 0;
+    struct option options[] = {
+        {"render-thread", no_argument, NULL, 'r'},
+        {"trace", no_argument, NULL, 't'},
+        {"debug", no_argument, NULL, 'd'},
+        {"break", required_argument, NULL, 'b'},
+        {"symbols", required_argument, NULL, 's'},
+        {"disassemble", no_argument, NULL, 'D'},
+        {"profile", required_argument, NULL, 'p'},
+        {"profile-out", required_argument, NULL, 'P'},
+        {"metrics", required_argument, NULL, 'm'},
+        {"test-vectors", no_argument, NULL, 'T'},
+        {"headless", no_argument, NULL, 'H'},
+        {"max-cycles", required_argument, NULL, 'C'},
+        {"lockstep", no_argument, NULL, 'L'},
+        {"fingerprint", no_argument, NULL, 'F'},
+        {"fuzz", no_argument, NULL, 'z'},
+        {"fuzz-frames", required_argument, NULL, 'Z'},
+        {"fuzz-execs", required_argument, NULL, 'E'},
+        {"fuzz-out", required_argument, NULL, 'O'},
+        {"link", no_argument, NULL, 'K'},
+        {"link-socket", no_argument, NULL, 'S'},
+        {"batch", required_argument, NULL, 'B'},
+        {"fast-boot", no_argument, NULL, 'f'},
+        {"check-boot", no_argument, NULL, 'V'},
+        {"check-decode", no_argument, NULL, 'G'},
+        {"capture", required_argument, NULL, 'A'},
+        {"capture-workers", required_argument, NULL, 'W'},
+        {"capture-drop", no_argument, NULL, 'X'},
+        {"stream", required_argument, NULL, 'Q'},
+        {"watch", required_argument, NULL, 'U'},
+        {0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "rtdb:s:Dp:m:THLFzf", options, NULL)) != -1) {
+        switch (opt) {
+            case 'r': {
+                threaded_render = true;
+                break;
+            }
+            case 't': {
+                cpu.trace = true;
+                break;
+            }
+            case 'd': {
+                debug_enabled = true;
+                break;
+            }
+            case 'b': {
+                if (initial_breakpoint_count < max_breakpoints) {
+                    initial_breakpoints[initial_breakpoint_count++] = optarg;
+                }
                 break;
             }
-            case 0xae: {
-                xor(&cpu, dereference_hl(&cpu));
+            case 's': {
+                symbol_path = optarg;
                 break;
             }
-            case 0xaf: {
-                xor(&cpu, cpu.a);
+            case 'D': {
+                disassemble_only = true;
                 break;
             }
-            case 0xb8: {
-                sub(&cpu, cpu.b);
+            case 'p': {
+                profile_interval = strtoull(optarg, NULL, 0);
+                if (!profile_interval) {
+                    fprintf(stderr, "profile interval must be positive\n");
+                    exit(1);
+                }
                 break;
             }
-            case 0xb9: {
-                sub(&cpu, cpu.c);
+            case 'P': {
+                profile_path = optarg;
                 break;
             }
-            case 0xba: {
-                sub(&cpu, cpu.d);
+            case 'm': {
+#ifdef NO_METRICS
+                fprintf(stderr, "metrics were compiled out\n");
+                exit(1);
+#endif
+                if (strcmp(optarg, "json") == 0) {
+                    metrics_format = METRICS_JSON;
+                } else if (strcmp(optarg, "prometheus") == 0) {
+                    metrics_format = METRICS_PROMETHEUS;
+                } else {
+                    fprintf(stderr, "unknown metrics format %s\n", optarg);
+                    exit(1);
+                }
                 break;
             }
-            case 0xbb: {
-                sub(&cpu, cpu.e);
+            case 'T': {
+                test_vectors = true;
                 break;
             }
-            case 0xbc: {
-                sub(&cpu, cpu.h);
+            case 'H': {
+                headless = true;
                 break;
             }
-            case 0xbd: {
-                sub(&cpu, cpu.l);
+            case 'C': {
+                max_cycles = strtoull(optarg, NULL, 0);
                 break;
             }
-            case 0xbe: {
-                sub(&cpu, dereference_hl(&cpu));
+            case 'L': {
+                lockstep_enabled = true;
                 break;
             }
-            case 0xbf: {
-                sub(&cpu, cpu.a);
+            case 'F': {
+                print_fingerprints = true;
                 break;
             }
-            case 0xc1: {
-                set_bc(&cpu, pop(&cpu));
+            case 'z': {
+                fuzz_enabled = true;
                 break;
             }
-            case 0xc5: {
-                push(&cpu, bc(&cpu));
+            case 'Z': {
+                fuzz_frames = atoi(optarg);
+                if (fuzz_frames <= 0) {
+                    fprintf(stderr, "fuzz input must be at least one frame\n");
+                    exit(1);
+                }
                 break;
             }
-            case 0xc9: {
-                cpu.pc = pop(&cpu);
+            case 'E': {
+                fuzz_execs = strtoull(optarg, NULL, 0);
                 break;
             }
-            case 0xcb: {
-                cb_prefix(&cpu);
+            case 'O': {
+                fuzz_out = optarg;
                 break;
             }
-            case 0xcd: {
-                u16 arg = parse_u16(&cpu);
-                push(&cpu, cpu.pc);
-                cpu.pc = arg;
+            case 'K': {
+                link_enabled = true;
                 break;
             }
-            case 0xd1: {
-                set_de(&cpu, pop(&cpu));
+            case 'S': {
+                link_socket = true;
                 break;
             }
-            case 0xd5: {
-                push(&cpu, de(&cpu));
+            case 'f': {
+                cpu.fast_boot = true;
                 break;
             }
-            case 0xe0: {
-                u8 arg = parse_u8(&cpu);
-                set_memory(&cpu, 0xff00 + arg, cpu.a);
+            case 'V': {
+                check_boot = true;
                 break;
             }
-            case 0xe1: {
-                set_hl(&cpu, pop(&cpu));
+            case 'G': {
+                check_decode_only = true;
                 break;
             }
-            case 0xe2: {
-                set_memory(&cpu, 0xff00 + cpu.c, cpu.a);
+            case 'A': {
+                capture_path = optarg;
                 break;
             }
-            case 0xe5: {
-                push(&cpu, hl(&cpu));
+            case 'W': {
+                capture_workers = atoi(optarg);
+                if (capture_workers <= 0 || capture_workers > max_capture_workers) {
+                    fprintf(stderr, "capture needs 1 to %d workers\n", max_capture_workers);
+                    exit(1);
+                }
                 break;
             }
-            case 0xea: {
-                u16 arg = parse_u16(&cpu);
-                set_memory(&cpu, arg, cpu.a);
+            case 'X': {
+                capture_policy = CAPTURE_DROP;
                 break;
             }
-            case 0xf0: {
-                u8 arg = parse_u8(&cpu);
-                cpu.a = memory(&cpu, 0xff00 + arg);
+            case 'Q': {
+                stream_path = optarg;
                 break;
             }
-            case 0xf1: {
-                set_af(&cpu, pop(&cpu));
+            case 'U': {
+                watch_path = optarg;
                 break;
             }
-            case 0xf2: {
-                cpu.a = memory(&cpu, 0xff00 + cpu.c);
+            case 'B': {
+                batch_lanes = atoi(optarg);
+                if (batch_lanes <= 0 || batch_lanes > batch_max_lanes) {
+                    fprintf(stderr, "batch must be 1 to %d lanes\n", batch_max_lanes);
+                    exit(1);
+                }
                 break;
             }
-            case 0xf5: {
-                push(&cpu, af(&cpu));
-                break;
+            default: {
+                fprintf(stderr, "usage: %s [-r|--render-thread] [-t|--trace] "
+                        "[-d|--debug] [-b|--break ADDR]... [-s|--symbols FILE] "
+                        "[-D|--disassemble] [-p|--profile CYCLES] "
+                        "[--profile-out FILE] [-m|--metrics json|prometheus] "
+                        "[-H|--headless] [-L|--lockstep] [--max-cycles N] "
+                        "[-F|--fingerprint] [--link|--link-socket] [-f|--fast-boot] "
+                        "[--capture FILE.y4m|DIR] [--capture-workers N] [--capture-drop] "
+                        "[--stream SOCKET|tcp:PORT] [ROM]\n"
+                        "       %s -z|--fuzz [--fuzz-frames N] [--fuzz-execs N] "
+                        "[--fuzz-out DIR] [ROM]\n"
+                        "       %s --batch N [--max-cycles N] [-F|--fingerprint] [-f|--fast-boot] [ROM]\n"
+                        "       %s --check-boot [ROM]\n"
+                        "       %s --check-decode\n"
+                        "       %s --watch SOCKET|tcp:PORT\n"
+                        "       %s -T|--test-vectors FILE.json...\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+                exit(1);
             }
-            case 0xfa: {
-                u16 arg = parse_u16(&cpu);
-                cpu.a = memory(&cpu, arg);
-                break;
+        }
+    }
+    if (watch_path) {
+        return watch_stream(watch_path);
+    }
+    if (check_decode_only) {
+        return check_decode();
+    }
+    if (test_vectors) {
+        int failed = 0;
+        for (int i = optind; i < argc; i++) {
+            failed += run_test_vectors(&cpu, argv[i]);
+        }
+        return failed != 0;
+    }
+    const char *rom_path = optind < argc ? argv[optind] : "tetris.gb";
+
+    if (symbol_path) {
+        if (!load_symbols(symbol_path)) {
+            perror(symbol_path);
+            exit(1);
+        }
+    } else {
+        // rgbds writes game.sym next to game.gb
+        char path[4096];
+        sibling_path(path, sizeof(path), rom_path, ".sym");
+        load_symbols(path);
+    }
+
+    if (disassemble_only) {
+        if (!disassemble_rom(rom_path)) {
+            perror(rom_path);
+            exit(1);
+        }
+        return 0;
+    }
+
+    if (!load_rom(rom_path)) {
+        perror(rom_path);
+        exit(1);
+    }
+
+    if (check_boot) {
+        return check_fast_boot(&cpu, &reference_cpu);
+    }
+    if (batch_lanes) {
+        // Ten seconds of play unless told otherwise
+        return run_batch(batch_lanes, max_cycles ? max_cycles : 600ull * lines_per_frame * line_cycles,
+                         cpu.fast_boot);
+    }
+    init_cpu(&cpu);
+    if (fuzz_enabled) {
+        return fuzz(&cpu, fuzz_frames, fuzz_execs, fuzz_out);
+    }
+    if (lockstep_enabled) {
+        // The page table fast path against per-access page resolution
+        reference_cpu.reference_memory = true;
+        reference_cpu.fast_boot = cpu.fast_boot;
+        init_cpu(&reference_cpu);
+        return lockstep(&reference_cpu, step, &cpu, step, max_cycles);
+    }
+    // Before any other threads exist, so the fork only has to copy this one
+    if (link_socket) {
+        link_process(&cpu);
+    } else if (link_enabled) {
+        link_thread(&cpu, &link_cpu);
+    }
+    // After the fork, so the partner process doesn't write to the save too
+    if (battery_backed()) {
+        char path[4096];
+        sibling_path(path, sizeof(path), rom_path, ".sav");
+        Block *save = open_save(path);
+        if (!save) {
+            perror(path);
+            exit(1);
+        }
+        attach_save(&cpu, save);
+    }
+    if (debug_enabled || initial_breakpoint_count) {
+        start_debugger(&cpu);
+        for (int i = 0; i < initial_breakpoint_count; i++) {
+            add_breakpoint(&cpu, parse_address(initial_breakpoints[i]));
+        }
+        if (!initial_breakpoint_count) {
+            request_stop(&cpu);
+        }
+    }
+    if (profile_interval) {
+        start_profiler(&cpu, profile_interval);
+        atexit(report_profile_at_exit);
+    }
+    FrameSink console;
+    if (threaded_render && !headless) {
+        RenderThread *rt = start_render_thread(&cpu);
+        video = &rt->gpu;
+    } else {
+        video = &cpu.gpu;
+    }
+    if (capture_path) {
+        capture = start_capture(capture_path, capture_policy, capture_workers);
+        if (!capture) {
+            perror(capture_path);
+            exit(1);
+        }
+        add_sink(video, &capture->sink);
+        atexit(finish_capture_at_exit);
+    }
+    if (stream_path) {
+        streamer = start_streamer(stream_path);
+        if (!streamer) {
+            perror(stream_path);
+            exit(1);
+        }
+        add_sink(video, &streamer->sink);
+        atexit(stop_streamer_at_exit);
+    }
+    if (metrics_format != METRICS_NONE) {
+        signal(SIGUSR1, handle_sigusr1);
+        atexit(dump_metrics_at_exit);
+    }
+    if (headless) {
+        return run_headless(&cpu, max_cycles);
+    }
+    add_sink(video, &console);
+    Core run_frame = run_frame_core(&cpu);
+    while (true) {
+        if (cpu.frame_done) {
+            cpu.frame_done = false;
+            present_frame(&console);
+            if (capture) {
+                capture_frame(capture);
             }
-            case 0xfe: {
-                u8 arg = parse_u8(&cpu);
-                sub(&cpu, arg);
-                break;
+            if (print_fingerprints) {
+                print_fingerprint(&cpu);
             }
-            default: {
-                printf("Not yet implemented: 0x%02x\n", byte);
-                exit(1);
+            // Checked once a frame to keep it off the per-instruction path
+            if (metrics_requested) {
+                metrics_requested = 0;
+                dump_metrics(&cpu, video, metrics_format, stderr);
             }
         }
+
+        // run_frame() also stops where the debugger wants a look
+        if (cpu.break_pages[cpu.pc >> 8]) {
+            debug(&cpu);
+            step(&cpu);
+            run_frame = run_frame_core(&cpu);
+        }
+        run_frame(&cpu);
     }
 }
+#endif
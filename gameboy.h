@@ -0,0 +1,64 @@
+#ifndef GAMEBOY_H
+#define GAMEBOY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Environment-style interface to the emulator for agents and search: each
+// Env is one headless machine that is reset to just after boot and stepped
+// a whole number of frames at a time. Build emulator.c with -DGB_LIBRARY
+// (make libgameboy.a) to link against it. The library still carries the
+// debugger, png capture and threaded rendering, so link it with
+// -lreadline -lz -lpthread as well.
+//
+// There is one cartridge per process; every Env runs the rom the first one
+// was created with.
+
+#define ENV_SCREEN_WIDTH 160
+#define ENV_SCREEN_HEIGHT 144
+#define ENV_MAX_RANGES 8
+
+// Bits of an action, 1 = held for the whole step
+#define ENV_RIGHT 0x01
+#define ENV_LEFT 0x02
+#define ENV_UP 0x04
+#define ENV_DOWN 0x08
+#define ENV_A 0x10
+#define ENV_B 0x20
+#define ENV_SELECT 0x40
+#define ENV_START 0x80
+
+typedef struct Env Env;
+
+// Views into the machine, not copies. They stay valid until the next
+// env_reset() or env_step() on the same Env.
+typedef struct EnvObservation {
+    // The last frame drawn, ENV_SCREEN_HEIGHT rows of ENV_SCREEN_WIDTH.
+    // Shades are 0 (white) to 3 (black); pixels are RGBA.
+    const uint8_t *shades;
+    const uint32_t *pixels;
+    // Frames run since the last reset
+    uint64_t frames;
+    // The memory ranges registered with env_observe(), in order
+    const uint8_t *ranges[ENV_MAX_RANGES];
+} EnvObservation;
+
+// Loads the rom (the first time) and boots a machine on it. NULL if the
+// rom can't be read.
+Env *env_create(const char *rom_path);
+void env_destroy(Env *env);
+
+// Adds len bytes at address to every observation. The range has to lie
+// within wram (0xc000-0xdfff) or hram (0xff80-0xfffe), and for a cgb
+// cartridge not cross 0xd000. 0xd000-0xdfff shows whichever wram bank is
+// switched in. Returns its index in ranges, or -1 if it can't be observed.
+int env_observe(Env *env, uint16_t address, uint16_t len);
+
+// Puts the machine back to just after boot
+void env_reset(Env *env, EnvObservation *observation);
+
+// Holds action for frameskip frames. Only the last one is drawn; the others
+// keep video timing and interrupts but skip rendering.
+void env_step(Env *env, uint8_t action, int frameskip, EnvObservation *observation);
+
+#endif